@@ -0,0 +1,1006 @@
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <grainr.hpp>
+#include <CpuParticleSystem.hpp>
+#include <CpuThreadPool.hpp>
+#include <geyser_kernels.hpp>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <time.h>
+
+using namespace grainr;
+using namespace std;
+
+namespace
+{
+
+namespace PassType
+{
+	enum Enum
+	{
+		Emitter,
+		ExactEmitter,
+		Affector,
+		Pipeline
+	};
+}
+
+struct ParamValue
+{
+	const char* mName;
+	GLsizei mSize;
+	float mValue[4];
+};
+
+struct PassDesc
+{
+	PassType::Enum mType;
+	const char* mName;
+	float mRate;
+	// a pipeline takes the params of each of its stages
+	const ParamValue* mParams[2];
+};
+
+struct ScenarioDesc
+{
+	const char* mName;
+	const char* mResource;
+	const char* mRenderer;
+	GLenum mPrimType;
+	GLsizei mPrimCount;
+	const PassDesc* mPasses;
+	GLsizei mNumRegions; // instances sharing one system, needs grainc -a
+};
+
+// Same scripts and parameters as the demos in examples/
+const ParamValue gGeyserEmitterParams[] = {
+	{ "min_life", 1, { 19.0f } },
+	{ "max_life", 1, { 28.5f } },
+	{ "min_speed", 1, { 18.0f } },
+	{ "max_speed", 1, { 21.0f } },
+	{ "min_angle", 1, { 0.4f * 3.14159265f } },
+	{ "max_angle", 1, { 0.6f * 3.14159265f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gGeyserAffectorParams[] = {
+	{ "gravity", 2, { 0.0f, -1.98f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gRainEmitterParams[] = {
+	{ "min_life", 1, { 23.0f } },
+	{ "max_life", 1, { 29.0f } },
+	{ "max_horizontal_speed", 1, { 3.10f } },
+	{ "width", 1, { 800.0f } },
+	{ "height", 1, { 300.0f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gRainRightDeflectorParams[] = {
+	{ "radius", 1, { 30.0f } },
+	{ "center", 2, { 100.0f, 0.0f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gRainLeftDeflectorParams[] = {
+	{ "radius", 1, { 30.0f } },
+	{ "center", 2, { 0.0f, 0.0f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gRainAffectorParams[] = {
+	{ "gravity", 2, { 0.0f, -1.8f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const ParamValue gRandomEmitterParams[] = {
+	{ "width", 1, { 256.0f } },
+	{ "height", 1, { 256.0f } },
+	{ NULL, 0, { 0.0f } }
+};
+
+const PassDesc gGeyserPasses[] = {
+	{ PassType::Emitter, "geyser", 0.003f, { gGeyserEmitterParams, NULL } },
+	{ PassType::Affector, "geyser", 0.0f, { gGeyserAffectorParams, NULL } },
+	{ PassType::Emitter, NULL, 0.0f, { NULL, NULL } }
+};
+
+// emits a fixed number of particles per second into dead slots only
+const PassDesc gGeyserExactPasses[] = {
+	{ PassType::ExactEmitter, "geyser", 4000.0f, { gGeyserEmitterParams, NULL } },
+	{ PassType::Affector, "geyser", 0.0f, { gGeyserAffectorParams, NULL } },
+	{ PassType::Emitter, NULL, 0.0f, { NULL, NULL } }
+};
+
+// geyser.emitter and geyser.affector fused into a single pass
+const PassDesc gGeyserFusedPasses[] = {
+	{ PassType::Pipeline, "geyser", 0.003f, { gGeyserEmitterParams, gGeyserAffectorParams } },
+	{ PassType::Emitter, NULL, 0.0f, { NULL, NULL } }
+};
+
+const PassDesc gRainPasses[] = {
+	{ PassType::Emitter, "line", 0.002f, { gRainEmitterParams, NULL } },
+	{ PassType::Affector, "circle_deflector", 0.0f, { gRainRightDeflectorParams, NULL } },
+	{ PassType::Affector, "circle_deflector", 0.0f, { gRainLeftDeflectorParams, NULL } },
+	{ PassType::Affector, "geyser", 0.0f, { gRainAffectorParams, NULL } },
+	{ PassType::Emitter, NULL, 0.0f, { NULL, NULL } }
+};
+
+const PassDesc gRandomPasses[] = {
+	{ PassType::Emitter, "box", 0.03f, { gRandomEmitterParams, NULL } },
+	{ PassType::Emitter, NULL, 0.0f, { NULL, NULL } }
+};
+
+const ScenarioDesc gScenarios[] = {
+	{ "geyser", "geyser", "point", GL_POINTS, 1, gGeyserPasses, 0 },
+	{ "geyser_blocks", "geyser_blocks", "point", GL_POINTS, 1, gGeyserPasses, 0 },
+	{ "geyser_exact", "geyser", "point", GL_POINTS, 1, gGeyserExactPasses, 0 },
+	{ "geyser_fused", "geyser", "point", GL_POINTS, 1, gGeyserFusedPasses, 0 },
+	// many small geysers updated together in one atlas, a row of particles each
+	{ "geyser_atlas", "geyser_atlas", "point", GL_POINTS, 1, gGeyserPasses, 64 },
+	{ "rain", "rain", "quad", GL_TRIANGLE_FAN, 4, gRainPasses, 0 },
+	{ "random", "random", "point", GL_POINTS, 1, gRandomPasses, 0 },
+	{ NULL, NULL, NULL, 0, 0, NULL, 0 }
+};
+
+const GLsizei gTargetWidth = 800;
+const GLsizei gTargetHeight = 600;
+const float gDt = 3.0f / 60.0f;
+
+struct Size
+{
+	size_t mWidth;
+	size_t mHeight;
+};
+
+struct PassStats
+{
+	string mName;
+	double mWallTime;
+	double mGpuTime;
+};
+
+struct Result
+{
+	string mScenario;
+	Size mSize;
+	size_t mFrames;
+	vector<PassStats> mPasses;
+};
+
+double now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool createHeadlessContext(EGLDisplay& display, EGLContext& context)
+{
+	display = EGL_NO_DISPLAY;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if(getPlatformDisplay != NULL)
+	{
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+#endif
+
+	if(display == EGL_NO_DISPLAY)
+	{
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major, minor;
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		cerr << "Can't initialize EGL display" << endl;
+		return false;
+	}
+
+	if(!eglBindAPI(EGL_OPENGL_API))
+	{
+		cerr << "EGL does not support desktop OpenGL" << endl;
+		return false;
+	}
+
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	eglChooseConfig(display, configAttribs, &config, 1, &numConfigs);
+
+	// Programs are drawn with GL_QUADS so a compatibility profile is needed
+	context = eglCreateContext(display, numConfigs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, NULL);
+	if(context == EGL_NO_CONTEXT)
+	{
+		cerr << "Can't create OpenGL context (EGL error 0x" << hex << eglGetError() << dec << ')' << endl;
+		return false;
+	}
+
+	// No surface is needed, everything is drawn to an offscreen framebuffer
+	if(!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		cerr << "Can't make context current (EGL error 0x" << hex << eglGetError() << dec << ')' << endl;
+		return false;
+	}
+
+	glewExperimental = GL_TRUE;
+	GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW also tries to load GLX which is not available without a display
+	if(glewStatus == GLEW_ERROR_NO_GLX_DISPLAY) { glewStatus = GLEW_OK; }
+#endif
+	if(glewStatus != GLEW_OK)
+	{
+		cerr << "Can't initialize GLEW" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// The params of every stage of a pass in one list
+void collectParams(const PassDesc& pass, vector<ParamValue>& params)
+{
+	const size_t numLists = sizeof(pass.mParams) / sizeof(pass.mParams[0]);
+	for(size_t i = 0; i < numLists && pass.mParams[i] != NULL; ++i)
+	{
+		for(const ParamValue* param = pass.mParams[i]; param->mName != NULL; ++param)
+		{
+			params.push_back(*param);
+		}
+	}
+}
+
+// Parameters are resolved once, before the measured frames
+void setParams(Program* program, const vector<ParamValue>& params, const vector<ParamHandle>& handles)
+{
+	for(size_t i = 0; i < params.size(); ++i)
+	{
+		const ParamValue& param = params[i];
+		switch(param.mSize)
+		{
+			case 1:
+				program->setParamFloat(handles[i], param.mValue[0]);
+				break;
+			case 2:
+				program->setParamVec2(handles[i], param.mValue);
+				break;
+			case 3:
+				program->setParamVec3(handles[i], param.mValue);
+				break;
+			case 4:
+				program->setParamVec4(handles[i], param.mValue);
+				break;
+		}
+	}
+}
+
+void setCpuParams(CpuProgram* program, const vector<ParamValue>& params)
+{
+	for(size_t i = 0; i < params.size(); ++i)
+	{
+		const ParamValue& param = params[i];
+		float value[4];
+		memcpy(value, param.mValue, sizeof(value));
+		switch(param.mSize)
+		{
+			case 1:
+				program->setParamFloat(param.mName, value[0]);
+				break;
+			case 2:
+				program->setParamVec2(param.mName, value);
+				break;
+			case 3:
+				program->setParamVec3(param.mName, value);
+				break;
+			case 4:
+				program->setParamVec4(param.mName, value);
+				break;
+		}
+	}
+}
+
+const ScenarioDesc* findScenario(const char* name)
+{
+	for(const ScenarioDesc* scenario = gScenarios; scenario->mName != NULL; ++scenario)
+	{
+		if(strcmp(scenario->mName, name) == 0) { return scenario; }
+	}
+	return NULL;
+}
+
+// The CPU kernels of a scenario are generated by grainc -k, only emitters
+// and affectors have one
+bool createCpuPrograms(CpuParticleSystem* sys, const ScenarioDesc& scenario, vector<CpuProgram*>& programs)
+{
+	for(const PassDesc* pass = scenario.mPasses; pass->mName != NULL; ++pass)
+	{
+		CpuProgram* program = NULL;
+		switch(pass->mType)
+		{
+			case PassType::Emitter:
+				program = sys->createEmitter(pass->mName, cerr);
+				break;
+			case PassType::Affector:
+				program = sys->createAffector(pass->mName, cerr);
+				break;
+			default:
+				cerr << "'" << scenario.mName << "' has no CPU kernel for '" << pass->mName << "'" << endl;
+				break;
+		}
+		if(program == NULL) { return false; }
+		programs.push_back(program);
+	}
+	return true;
+}
+
+void runCpuPass(const PassDesc& pass, const vector<ParamValue>& params, CpuProgram* program)
+{
+	setCpuParams(program, params);
+	if(pass.mType == PassType::Emitter)
+	{
+		static_cast<CpuEmitter*>(program)->setRate(pass.mRate);
+	}
+	program->run();
+}
+
+// Updates the geyser scenario with the generated kernels on every hardware
+// thread, there is no rendering
+bool runCpuScenario(Size size, size_t numWarmupFrames, size_t numFrames, Result& result)
+{
+	const ScenarioDesc& scenario = *findScenario("geyser");
+	CpuThreadPool* threadPool = CpuThreadPool::create();
+	CpuParticleSystem* sys = CpuParticleSystem::create(geyser_kernels::module, size.mWidth, size.mHeight, threadPool);
+
+	vector<CpuProgram*> programs;
+	bool success = createCpuPrograms(sys, scenario, programs);
+	vector<vector<ParamValue> > passParams(programs.size());
+	for(size_t i = 0; i < programs.size(); ++i)
+	{
+		collectParams(scenario.mPasses[i], passParams[i]);
+	}
+	if(success)
+	{
+		result.mScenario = "geyser_cpu";
+		result.mSize = size;
+		result.mFrames = numFrames;
+		result.mPasses.resize(programs.size());
+		for(size_t i = 0; i < programs.size(); ++i)
+		{
+			const PassDesc& pass = scenario.mPasses[i];
+			PassStats& stats = result.mPasses[i];
+			stats.mName = pass.mType == PassType::Emitter ? "emitter:" : "affector:";
+			stats.mName += pass.mName;
+			stats.mWallTime = 0.0;
+			stats.mGpuTime = -1.0;
+		}
+
+		for(size_t frame = 0; frame < numWarmupFrames + numFrames; ++frame)
+		{
+			bool measure = frame >= numWarmupFrames;
+			sys->update(gDt);
+
+			for(size_t i = 0; i < programs.size(); ++i)
+			{
+				double startTime = now();
+				runCpuPass(scenario.mPasses[i], passParams[i], programs[i]);
+				double endTime = now();
+
+				if(measure) { result.mPasses[i].mWallTime += endTime - startTime; }
+			}
+		}
+	}
+
+	for(vector<CpuProgram*>::iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		(*itr)->destroy();
+	}
+	sys->destroy();
+	threadPool->destroy();
+
+	return success;
+}
+
+// Runs the geyser scenario on the fragment backend and on the CPU with the
+// same seed and compares the particles. Random numbers are the same bit for
+// bit but sin and cos are not, a particle whose life ends within rounding
+// of a frame may also die a frame apart.
+bool checkCpu(Context& ctx, const string& resourceDir, Size size, size_t numFrames)
+{
+	const ScenarioDesc& scenario = *findScenario("geyser");
+	const unsigned int seed = 1234;
+
+	string filename = resourceDir + '/' + scenario.mResource;
+	SystemDefinition* def = ctx.load(filename.c_str(), cerr);
+	if(def == NULL) { return false; }
+
+	ParticleSystem* sys = def->create(size.mWidth, size.mHeight);
+	CpuParticleSystem* cpuSys = CpuParticleSystem::create(geyser_kernels::module, size.mWidth, size.mHeight);
+	sys->setSeed(seed);
+	cpuSys->setSeed(seed);
+
+	vector<Program*> programs;
+	vector<vector<ParamValue> > passParams;
+	vector<vector<ParamHandle> > paramHandles;
+	bool success = true;
+	for(const PassDesc* pass = scenario.mPasses; success && pass->mName != NULL; ++pass)
+	{
+		Program* program = pass->mType == PassType::Emitter
+			? static_cast<Program*>(sys->createEmitter(pass->mName, cerr))
+			: static_cast<Program*>(sys->createAffector(pass->mName, cerr));
+		if(program == NULL)
+		{
+			success = false;
+			break;
+		}
+		programs.push_back(program);
+
+		passParams.push_back(vector<ParamValue>());
+		collectParams(*pass, passParams.back());
+		paramHandles.push_back(vector<ParamHandle>());
+		for(vector<ParamValue>::const_iterator param = passParams.back().begin(); param != passParams.back().end(); ++param)
+		{
+			paramHandles.back().push_back(program->getParam(param->mName));
+		}
+	}
+
+	vector<CpuProgram*> cpuPrograms;
+	success = success && createCpuPrograms(cpuSys, scenario, cpuPrograms);
+
+	if(success)
+	{
+		for(size_t frame = 0; frame < numFrames; ++frame)
+		{
+			ctx.update(gDt);
+			for(size_t i = 0; i < programs.size(); ++i)
+			{
+				const PassDesc& pass = scenario.mPasses[i];
+				programs[i]->prepare();
+				setParams(programs[i], passParams[i], paramHandles[i]);
+				if(pass.mType == PassType::Emitter)
+				{
+					static_cast<Emitter*>(programs[i])->setRate(pass.mRate);
+				}
+				programs[i]->run();
+			}
+
+			cpuSys->update(gDt);
+			for(size_t i = 0; i < cpuPrograms.size(); ++i)
+			{
+				runCpuPass(scenario.mPasses[i], passParams[i], cpuPrograms[i]);
+			}
+		}
+
+		ParticleSnapshot snapshot;
+		sys->snapshot(snapshot);
+
+		// The streams of the kernels follow the float slots of the definition
+		// compiled along with them, 4 floats per texel and texture
+		size_t numParticles = size.mWidth * size.mHeight;
+		vector<bool> differs(numParticles, false);
+		float maxDifference = 0.0f;
+		for(const CpuAttribute* attr = geyser_kernels::module.mAttributes; attr->mName != NULL; ++attr)
+		{
+			for(size_t j = 0; j < attr->mSize; ++j)
+			{
+				size_t slot = attr->mOffset + j;
+				const float* gpu = &snapshot.mData[(slot / 4) * 4 * numParticles + slot % 4];
+				const float* cpu = cpuSys->getStream(attr->mName, j);
+				for(size_t i = 0; i < numParticles; ++i)
+				{
+					float difference = fabs(gpu[i * 4] - cpu[i]);
+					if(difference > 1e-3f * max(1.0f, fabs(cpu[i]))) { differs[i] = true; }
+					else { maxDifference = max(maxDifference, difference); }
+				}
+			}
+		}
+
+		size_t numDiffering = 0;
+		for(vector<bool>::const_iterator itr = differs.begin(); itr != differs.end(); ++itr)
+		{
+			if(*itr) { ++numDiffering; }
+		}
+		cerr << "CPU check: " << numDiffering << " of " << numParticles << " particles differ after "
+		     << numFrames << " frames, the others by up to " << maxDifference << endl;
+		success = numDiffering <= numParticles / 1000;
+	}
+
+	for(vector<CpuProgram*>::iterator itr = cpuPrograms.begin(); itr != cpuPrograms.end(); ++itr)
+	{
+		(*itr)->destroy();
+	}
+	for(vector<Program*>::iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		(*itr)->destroy();
+	}
+	cpuSys->destroy();
+	sys->destroy();
+	def->destroy();
+
+	return success;
+}
+
+bool runScenario(
+	Context& ctx,
+	const ScenarioDesc& scenario,
+	const string& resourceDir,
+	Size size,
+	Compaction::Enum compaction,
+	size_t numWarmupFrames,
+	size_t numFrames,
+	Result& result
+)
+{
+	string filename = resourceDir + '/' + scenario.mResource;
+	SystemDefinition* def = ctx.load(filename.c_str(), cerr);
+	if(def == NULL) { return false; }
+
+	ParticleSystem* sys = def->create(size.mWidth, size.mHeight);
+
+	bool success = sys->setCompaction(compaction);
+	if(!success)
+	{
+		cerr << "Compaction mode is not supported by '" << scenario.mName << "'" << endl;
+	}
+
+	// one row of instances per region
+	vector<int> regions;
+	for(GLsizei i = 0; success && i < scenario.mNumRegions; ++i)
+	{
+		int region = sys->allocateRegion(size.mWidth, size.mHeight / scenario.mNumRegions);
+		if(region < 0)
+		{
+			cerr << "Can't allocate " << scenario.mNumRegions << " regions for '" << scenario.mName << "'" << endl;
+			success = false;
+		}
+		regions.push_back(region);
+	}
+	// systems without regions have their params set once per pass
+	if(regions.empty()) { regions.push_back(-1); }
+
+	vector<Program*> programs;
+	vector<vector<ParamValue> > passParams;
+	vector<vector<ParamHandle> > paramHandles;
+	for(const PassDesc* pass = scenario.mPasses; success && pass->mName != NULL; ++pass)
+	{
+		Program* program = NULL;
+		switch(pass->mType)
+		{
+			case PassType::Emitter:
+				program = sys->createEmitter(pass->mName, cerr);
+				break;
+			case PassType::ExactEmitter:
+				program = sys->createEmitter(pass->mName, cerr, Emission::Exact);
+				break;
+			case PassType::Affector:
+				program = sys->createAffector(pass->mName, cerr);
+				break;
+			case PassType::Pipeline:
+				program = sys->createPipeline(pass->mName, cerr);
+				break;
+		}
+		if(program == NULL)
+		{
+			success = false;
+			break;
+		}
+		programs.push_back(program);
+
+		passParams.push_back(vector<ParamValue>());
+		collectParams(*pass, passParams.back());
+		paramHandles.push_back(vector<ParamHandle>());
+		for(vector<ParamValue>::const_iterator param = passParams.back().begin(); param != passParams.back().end(); ++param)
+		{
+			paramHandles.back().push_back(program->getParam(param->mName));
+		}
+	}
+
+	Renderer* renderer = success ? sys->createRenderer(scenario.mRenderer, cerr) : NULL;
+	success = success && renderer != NULL;
+
+	if(success)
+	{
+		// orthographic projection matching the demos
+		const float mvp[] = {
+			2.0f / gTargetWidth, 0.0f, 0.0f, 0.0f,
+			0.0f, 2.0f / gTargetHeight, 0.0f, 0.0f,
+			0.0f, 0.0f, -1.0f, 0.0f,
+			0.0f, 0.0f, 0.0f, 1.0f
+		};
+		renderer->prepare();
+		glUniformMatrix4fv(renderer->getUniformLocation("uMVP"), 1, GL_FALSE, mvp);
+
+		GLuint quadBuff, quadVao;
+		glGenBuffers(1, &quadBuff);
+		glBindBuffer(GL_ARRAY_BUFFER, quadBuff);
+		const float quad[] = {
+			-1.0f,  1.0f,
+			 1.0f,  1.0f,
+			 1.0f, -1.0f,
+			-1.0f, -1.0f
+		};
+		glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+		glGenVertexArrays(1, &quadVao);
+		glBindVertexArray(quadVao);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+		glBindVertexArray(0);
+
+		GLuint targetFbo, targetRbo;
+		glGenRenderbuffers(1, &targetRbo);
+		glBindRenderbuffer(GL_RENDERBUFFER, targetRbo);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, gTargetWidth, gTargetHeight);
+		glGenFramebuffers(1, &targetFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, targetRbo);
+
+		size_t numPasses = programs.size() + 1;
+		bool hasTimer = GLEW_ARB_timer_query;
+		vector<GLuint> queries(numPasses, 0);
+		if(hasTimer) { glGenQueries(numPasses, queries.data()); }
+
+		result.mScenario = scenario.mName;
+		result.mSize = size;
+		result.mFrames = numFrames;
+		result.mPasses.resize(numPasses);
+		for(size_t i = 0; i < numPasses; ++i)
+		{
+			PassStats& stats = result.mPasses[i];
+			if(i + 1 < numPasses)
+			{
+				const PassDesc& pass = scenario.mPasses[i];
+				switch(pass.mType)
+				{
+					case PassType::Emitter:
+						stats.mName = "emitter:";
+						break;
+					case PassType::ExactEmitter:
+						stats.mName = "exact_emitter:";
+						break;
+					case PassType::Affector:
+						stats.mName = "affector:";
+						break;
+					case PassType::Pipeline:
+						stats.mName = "pipeline:";
+						break;
+				}
+				stats.mName += pass.mName;
+			}
+			else
+			{
+				stats.mName = "render:";
+				stats.mName += scenario.mRenderer;
+			}
+			stats.mWallTime = 0.0;
+			stats.mGpuTime = hasTimer ? 0.0 : -1.0;
+		}
+
+		glFinish();
+		for(size_t frame = 0; frame < numWarmupFrames + numFrames; ++frame)
+		{
+			bool measure = frame >= numWarmupFrames;
+			ctx.update(gDt);
+
+			for(size_t i = 0; i < numPasses; ++i)
+			{
+				double startTime = now();
+				if(hasTimer) { glBeginQuery(GL_TIME_ELAPSED, queries[i]); }
+
+				if(i + 1 < numPasses)
+				{
+					const PassDesc& pass = scenario.mPasses[i];
+					Program* program = programs[i];
+					program->prepare();
+					for(vector<int>::const_iterator region = regions.begin(); region != regions.end(); ++region)
+					{
+						program->setRegion(*region);
+						setParams(program, passParams[i], paramHandles[i]);
+						if(pass.mType == PassType::Emitter || pass.mType == PassType::ExactEmitter)
+						{
+							static_cast<Emitter*>(program)->setRate(pass.mRate);
+						}
+						else if(pass.mType == PassType::Pipeline)
+						{
+							static_cast<Pipeline*>(program)->setRate(pass.mRate);
+						}
+					}
+					program->run();
+				}
+				else
+				{
+					glBindFramebuffer(GL_FRAMEBUFFER, targetFbo);
+					glViewport(0, 0, gTargetWidth, gTargetHeight);
+					glClear(GL_COLOR_BUFFER_BIT);
+					renderer->prepare();
+					glBindVertexArray(quadVao);
+					sys->render(scenario.mPrimType, scenario.mPrimCount);
+				}
+
+				if(hasTimer) { glEndQuery(GL_TIME_ELAPSED); }
+				glFinish();
+				double endTime = now();
+
+				if(!measure) { continue; }
+
+				PassStats& stats = result.mPasses[i];
+				stats.mWallTime += endTime - startTime;
+				if(hasTimer)
+				{
+					GLuint64 elapsed = 0;
+					glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed);
+					stats.mGpuTime += elapsed * 1e-9;
+				}
+			}
+		}
+
+		if(hasTimer) { glDeleteQueries(numPasses, queries.data()); }
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &targetFbo);
+		glDeleteRenderbuffers(1, &targetRbo);
+		glDeleteVertexArrays(1, &quadVao);
+		glDeleteBuffers(1, &quadBuff);
+	}
+
+	if(renderer) renderer->destroy();
+	for(vector<Program*>::iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		(*itr)->destroy();
+	}
+	sys->destroy();
+	def->destroy();
+
+	return success;
+}
+
+void writeCsv(ostream& out, const vector<Result>& results)
+{
+	out << "scenario,width,height,particles,frames,pass,wall_ms,gpu_ms,particles_per_sec" << endl;
+	for(vector<Result>::const_iterator itr = results.begin(); itr != results.end(); ++itr)
+	{
+		size_t numParticles = itr->mSize.mWidth * itr->mSize.mHeight;
+		double frames = (double)itr->mFrames;
+		double frameWall = 0.0;
+		double frameGpu = 0.0;
+		for(vector<PassStats>::const_iterator pass = itr->mPasses.begin(); pass != itr->mPasses.end(); ++pass)
+		{
+			frameWall += pass->mWallTime;
+			frameGpu += pass->mGpuTime;
+			out << itr->mScenario << ','
+			    << itr->mSize.mWidth << ',' << itr->mSize.mHeight << ','
+			    << numParticles << ',' << itr->mFrames << ','
+			    << pass->mName << ','
+			    << pass->mWallTime * 1000.0 / frames << ','
+			    << (pass->mGpuTime < 0.0 ? -1.0 : pass->mGpuTime * 1000.0 / frames) << ','
+			    << numParticles * frames / pass->mWallTime << endl;
+		}
+		out << itr->mScenario << ','
+		    << itr->mSize.mWidth << ',' << itr->mSize.mHeight << ','
+		    << numParticles << ',' << itr->mFrames << ','
+		    << "frame" << ','
+		    << frameWall * 1000.0 / frames << ','
+		    << (frameGpu < 0.0 ? -1.0 : frameGpu * 1000.0 / frames) << ','
+		    << numParticles * frames / frameWall << endl;
+	}
+}
+
+void writeJson(ostream& out, const vector<Result>& results)
+{
+	out << '[' << endl;
+	for(vector<Result>::const_iterator itr = results.begin(); itr != results.end(); ++itr)
+	{
+		size_t numParticles = itr->mSize.mWidth * itr->mSize.mHeight;
+		double frames = (double)itr->mFrames;
+		double frameWall = 0.0;
+		double frameGpu = 0.0;
+
+		out << "\t{" << endl
+		    << "\t\t\"scenario\": \"" << itr->mScenario << "\"," << endl
+		    << "\t\t\"width\": " << itr->mSize.mWidth << ',' << endl
+		    << "\t\t\"height\": " << itr->mSize.mHeight << ',' << endl
+		    << "\t\t\"particles\": " << numParticles << ',' << endl
+		    << "\t\t\"frames\": " << itr->mFrames << ',' << endl
+		    << "\t\t\"passes\": [" << endl;
+		for(vector<PassStats>::const_iterator pass = itr->mPasses.begin(); pass != itr->mPasses.end(); ++pass)
+		{
+			frameWall += pass->mWallTime;
+			frameGpu += pass->mGpuTime;
+			out << "\t\t\t{ \"pass\": \"" << pass->mName << "\""
+			    << ", \"wall_ms\": " << pass->mWallTime * 1000.0 / frames
+			    << ", \"gpu_ms\": " << (pass->mGpuTime < 0.0 ? -1.0 : pass->mGpuTime * 1000.0 / frames)
+			    << ", \"particles_per_sec\": " << numParticles * frames / pass->mWallTime
+			    << " }" << (pass + 1 != itr->mPasses.end() ? "," : "") << endl;
+		}
+		out << "\t\t]," << endl
+		    << "\t\t\"wall_ms\": " << frameWall * 1000.0 / frames << ',' << endl
+		    << "\t\t\"gpu_ms\": " << (frameGpu < 0.0 ? -1.0 : frameGpu * 1000.0 / frames) << ',' << endl
+		    << "\t\t\"particles_per_sec\": " << numParticles * frames / frameWall << endl
+		    << "\t}" << (itr + 1 != results.end() ? "," : "") << endl;
+	}
+	out << ']' << endl;
+}
+
+}
+
+int main(int argc, const char* const argv[])
+{
+	string resourceDir = GRAIN_BENCH_RESOURCE_DIR;
+	const char* outputFile = NULL;
+	const char* scenarioFilter = NULL;
+	bool json = false;
+	bool check = false;
+	size_t numFrames = 300;
+	size_t numWarmupFrames = 30;
+	Compaction::Enum compaction = Compaction::Gpu;
+	vector<Size> sizes;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-f") == 0 && (++i < argc))
+		{
+			numFrames = strtoul(argv[i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "-w") == 0 && (++i < argc))
+		{
+			numWarmupFrames = strtoul(argv[i], NULL, 10);
+		}
+		else if(strcmp(argv[i], "-s") == 0 && (++i < argc))
+		{
+			Size size;
+			if(sscanf(argv[i], "%zux%zu", &size.mWidth, &size.mHeight) != 2)
+			{
+				cerr << "Invalid size '" << argv[i] << "'" << endl;
+				return EXIT_FAILURE;
+			}
+			sizes.push_back(size);
+		}
+		else if(strcmp(argv[i], "-r") == 0 && (++i < argc))
+		{
+			resourceDir = argv[i];
+		}
+		else if(strcmp(argv[i], "-o") == 0 && (++i < argc))
+		{
+			outputFile = argv[i];
+		}
+		else if(strcmp(argv[i], "-t") == 0 && (++i < argc))
+		{
+			scenarioFilter = argv[i];
+		}
+		else if(strcmp(argv[i], "-c") == 0 && (++i < argc))
+		{
+			if(strcmp(argv[i], "none") == 0) { compaction = Compaction::None; }
+			else if(strcmp(argv[i], "cpu") == 0) { compaction = Compaction::Cpu; }
+			else if(strcmp(argv[i], "gpu") == 0) { compaction = Compaction::Gpu; }
+			else
+			{
+				cerr << "Invalid compaction mode '" << argv[i] << "'" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "-j") == 0)
+		{
+			json = true;
+		}
+		else if(strcmp(argv[i], "-v") == 0)
+		{
+			check = true;
+		}
+		else
+		{
+			cout << "Usage: grain_bench [options]" << endl
+			     << "Options:" << endl
+			     << left << setw(20) << "-f <frames>"    << "Number of measured frames (default: 300)" << endl
+			     << left << setw(20) << "-w <frames>"    << "Number of warm up frames (default: 30)" << endl
+			     << left << setw(20) << "-s <w>x<h>"     << "Add a system size to the sweep (default: 64x64 to 1024x1024)" << endl
+			     << left << setw(20) << "-t <scenario>"  << "Only run the given scenario (e.g. geyser, rain, random or geyser_cpu)" << endl
+			     << left << setw(20) << "-r <dir>"       << "Directory of compiled definitions" << endl
+			     << left << setw(20) << "-c <mode>"      << "How dead particles are culled: none, cpu or gpu (default: gpu)" << endl
+			     << left << setw(20) << "-o <output>"    << "Write results to a file instead of stdout" << endl
+			     << left << setw(20) << "-j"             << "Output JSON instead of CSV" << endl
+			     << left << setw(20) << "-v"             << "Compare the CPU kernels of geyser with the GPU over the measured frames, at the first size" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(sizes.empty())
+	{
+		for(size_t dim = 64; dim <= 1024; dim *= 2)
+		{
+			Size size = { dim, dim };
+			sizes.push_back(size);
+		}
+	}
+
+	EGLDisplay display;
+	EGLContext eglContext;
+	if(!createHeadlessContext(display, eglContext))
+	{
+		return EXIT_FAILURE;
+	}
+	cerr << "Renderer: " << glGetString(GL_RENDERER) << " (" << glGetString(GL_VERSION) << ')' << endl;
+
+	vector<Result> results;
+	bool success = true;
+	{
+		Context ctx;
+		if(check)
+		{
+			success = checkCpu(ctx, resourceDir, sizes.front(), numFrames);
+		}
+		for(const ScenarioDesc* scenario = gScenarios; !check && success && scenario->mName != NULL; ++scenario)
+		{
+			if(scenarioFilter != NULL && strcmp(scenarioFilter, scenario->mName) != 0) { continue; }
+
+			for(vector<Size>::const_iterator size = sizes.begin(); size != sizes.end(); ++size)
+			{
+				if(size->mHeight < (size_t)scenario->mNumRegions)
+				{
+					cerr << "Skipping '" << scenario->mName << "' at " << size->mWidth << 'x' << size->mHeight
+						<< ", it needs a row per region" << endl;
+					continue;
+				}
+
+				Result result;
+				if(!runScenario(ctx, *scenario, resourceDir, *size, compaction, numWarmupFrames, numFrames, result))
+				{
+					success = false;
+					break;
+				}
+				results.push_back(result);
+			}
+		}
+
+		// the same updates as geyser with the kernels of grainc -k
+		bool runCpu = scenarioFilter == NULL || strcmp(scenarioFilter, "geyser_cpu") == 0;
+		for(vector<Size>::const_iterator size = sizes.begin(); !check && runCpu && success && size != sizes.end(); ++size)
+		{
+			Result result;
+			success = runCpuScenario(*size, numWarmupFrames, numFrames, result);
+			if(success) { results.push_back(result); }
+		}
+	}
+
+	if(success && !check)
+	{
+		ofstream outFile;
+		if(outputFile != NULL)
+		{
+			outFile.open(outputFile);
+			if(!outFile.good())
+			{
+				cerr << "Can't open '" << outputFile << "' for writing" << endl;
+				success = false;
+			}
+		}
+
+		ostream& out = outputFile != NULL ? outFile : cout;
+		if(success)
+		{
+			if(json) { writeJson(out, results); }
+			else { writeCsv(out, results); }
+		}
+	}
+
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, eglContext);
+	eglTerminate(display);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
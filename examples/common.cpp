@@ -4,6 +4,11 @@
 using namespace grainr;
 using namespace std;
 
+// the demos simulate 3 seconds per second, in steps of a 60th of that
+const float gTimeScale = 3.0f;
+const float gStep = 3.0f / 60.0f;
+const size_t gMaxSteps = 4;
+
 bool init(Context& ctx);
 void update(Context& ctx);
 void render();
@@ -26,9 +31,12 @@ int main(int argc, const char* const argv[])
 		return 1;
 	}
 
+	ctx.setFixedStep(gStep, gMaxSteps);
+
 	bool running = true;
 	SDL_Event event;
 	double lastTime = (double)SDL_GetTicks();
+	double lastUpdateTime = lastTime;
 	double targetTime = 1000.0 / 60.0;
 
 	while(running)
@@ -43,7 +51,13 @@ int main(int argc, const char* const argv[])
 			}
 		}
 
-		update(ctx);
+		double updateTime = (double)SDL_GetTicks();
+		ctx.advance(gTimeScale * (float)(updateTime - lastUpdateTime) / 1000.0f);
+		lastUpdateTime = updateTime;
+		while(ctx.step())
+		{
+			update(ctx);
+		}
 
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
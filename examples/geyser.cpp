@@ -24,6 +24,7 @@ bool init(Context& ctx)
 	if(sysDef == NULL) return false;
 
 	sys = sysDef->create(256, 256);
+	sys->setInterpolation(true);
 	emitter = sys->createEmitter("geyser", cerr);
 	if(emitter == NULL) return false;
 
@@ -69,8 +70,6 @@ void cleanup()
 
 void update(Context& ctx)
 {
-	ctx.update(3.0f / 60.0f);
-
 	emitter->prepare();
 	emitter->setParamFloat("min_life", 19.0f);
 	emitter->setParamFloat("max_life", 28.5f);
@@ -26,6 +26,7 @@ bool init(Context& ctx)
 	if(sysDef == NULL) return false;
 
 	sys = sysDef->create(256, 256);
+	sys->setInterpolation(true);
 	emitter = sys->createEmitter("line", cerr);
 	if(emitter == NULL) return false;
 
@@ -75,8 +76,6 @@ void cleanup()
 
 void update(Context& ctx)
 {
-	ctx.update(3.0f / 60.0f);
-
 	emitter->prepare();
 	emitter->setParamFloat("min_life", 23.0f);
 	emitter->setParamFloat("max_life", 29.0f);
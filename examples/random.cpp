@@ -24,6 +24,7 @@ bool init(Context& ctx)
 	if(sysDef == NULL) return false;
 
 	sys = sysDef->create(256, 256);
+	sys->setInterpolation(true);
 	emitter = sys->createEmitter("box", cerr);
 	if(emitter == NULL) return false;
 
@@ -66,8 +67,6 @@ void cleanup()
 
 void update(Context& ctx)
 {
-	ctx.update(3.0f / 60.0f);
-
 	emitter->prepare();
 	emitter->setParamFloat("width", 256.0f);
 	emitter->setParamFloat("height", 256.0f);
@@ -1,10 +1,21 @@
 #include "CompileTask.hpp"
+#include <cstddef>
 
 CompileTask* createCompileTask()
 {
 	CompileTask* task = new CompileTask;
 	task->mOptimize = false;
+	task->mUniformBlocks = false;
+	task->mAtlas = false;
+	task->mFeedback = false;
+	task->mComputeGroupSize = 0;
+	task->mComputeStreams = false;
+	task->mMaxDrawBuffers = 8;
+	task->mNumThreads = 0;
 	task->mOutput = "a.out";
+	task->mKernelOutput = NULL;
+	task->mDepFile = NULL;
+	task->mCacheDirectory = NULL;
 	return task;
 }
 
@@ -18,11 +29,61 @@ void setOptimize(CompileTask* task, bool optimize)
 	task->mOptimize = optimize;
 }
 
+void setUniformBlocks(CompileTask* task, bool uniformBlocks)
+{
+	task->mUniformBlocks = uniformBlocks;
+}
+
+void setAtlas(CompileTask* task, bool atlas)
+{
+	task->mAtlas = atlas;
+}
+
+void setFeedback(CompileTask* task, bool feedback)
+{
+	task->mFeedback = feedback;
+}
+
+void setComputeGroupSize(CompileTask* task, size_t groupSize)
+{
+	task->mComputeGroupSize = groupSize;
+}
+
+void setComputeStreams(CompileTask* task, bool streams)
+{
+	task->mComputeStreams = streams;
+}
+
+void setMaxDrawBuffers(CompileTask* task, size_t maxDrawBuffers)
+{
+	task->mMaxDrawBuffers = maxDrawBuffers;
+}
+
+void setNumThreads(CompileTask* task, size_t numThreads)
+{
+	task->mNumThreads = numThreads;
+}
+
 void setOutput(CompileTask* task, const char* filename)
 {
 	task->mOutput = filename;
 }
 
+void setKernelOutput(CompileTask* task, const char* filename)
+{
+	task->mKernelOutput = filename;
+}
+
+void setDepFile(CompileTask* task, const char* filename)
+{
+	task->mDepFile = filename;
+}
+
+void setCacheDirectory(CompileTask* task, const char* path)
+{
+	task->mCacheDirectory = path;
+}
+
 void addInput(CompileTask* task, const char* filename)
 {
 	task->mInputs.push_back(filename);
@@ -33,3 +94,7 @@ void addIncludePath(CompileTask* task, const char* path)
 	task->mIncludePaths.push_back(path);
 }
 
+void addPipeline(CompileTask* task, const char* spec)
+{
+	task->mPipelines.push_back(spec);
+}
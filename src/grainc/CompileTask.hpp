@@ -1,14 +1,26 @@
 #ifndef GRAINC_COMPILE_TASK_HPP
 #define GRAINC_COMPILE_TASK_HPP
 
+#include <cstddef>
 #include <vector>
 
 struct CompileTask
 {
 	bool mOptimize;
+	bool mUniformBlocks;
+	bool mAtlas;
+	bool mFeedback;
+	size_t mComputeGroupSize; // 0 when no compute kernel is generated
+	bool mComputeStreams;
+	size_t mMaxDrawBuffers; // textures written by a fragment pass
+	size_t mNumThreads; // 0 to use every core
 	const char* mOutput;
+	const char* mKernelOutput;
+	const char* mDepFile;
+	const char* mCacheDirectory;
 	std::vector<const char*> mInputs;
 	std::vector<const char*> mIncludePaths;
+	std::vector<const char*> mPipelines;
 };
 
 #endif
@@ -3,11 +3,18 @@
 #include <string>
 #include <fstream>
 #include <map>
+#include <set>
+#include <cctype>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <functional>
 #include <glsl_optimizer.h>
 #include "grainc.hpp"
 #include "CompileTask.hpp"
 #include "Script.hpp"
 #include "SourceMap.hpp"
+#include "ResultCache.hpp"
 #include "builtins.h"
 #include "Logger.hpp"
 
@@ -57,33 +64,143 @@ struct CompileContext
 	CompileContext(const Compiler* compiler, const CompileTask* compileTask)
 		:mCompiler(*compiler)
 		,mCompileTask(*compileTask)
+		,mResultCache(compileTask->mCacheDirectory)
 		,mDeclHelper(mAttributes)
 	{
 		stringstream ss;
 		ss.write(builtins, builtins_len);
 		unsigned int lineCount = 0;
 		string line;
-		while(getline(ss, line)) { ++lineCount; };
+		while(getline(ss, line))
+		{
+			++lineCount;
+
+			// Keep macros and turn function signatures into prototypes,
+			// line by line so that line numbers stay the same
+			bool isSignature = !line.empty()
+				&& line[0] != '#'
+				&& line[0] != '{'
+				&& line[0] != '}'
+				&& line[0] != '\t'
+				&& line.compare(0, 2, "//") != 0;
+			if(isSignature) { line += ';'; }
+			if(isSignature || (!line.empty() && line[0] == '#'))
+			{
+				mBuiltInDeclarations += line;
+			}
+			mBuiltInDeclarations += '\n';
+		};
 		mBuiltInStartLine = mSourceMap.addMapping("<builtins.glsl>", 1, lineCount);
 	}
 
+	// Same context for a worker thread, with its own compiler
+	CompileContext(const CompileContext& other, const Compiler* compiler)
+		:mSourceMap(other.mSourceMap)
+		,mCompiler(*compiler)
+		,mCompileTask(other.mCompileTask)
+		,mResultCache(other.mResultCache)
+		,mAttributeMap(other.mAttributeMap)
+		,mDeclHelper(mAttributes)
+		,mBuiltInStartLine(other.mBuiltInStartLine)
+		,mBuiltInDeclarations(other.mBuiltInDeclarations)
+		,mSamplerDeclarations(other.mSamplerDeclarations)
+		,mStreamDeclarations(other.mStreamDeclarations)
+		,mBufferDeclarations(other.mBufferDeclarations)
+		,mBufferTextureDeclarations(other.mBufferTextureDeclarations)
+		,mStructDeclaration(other.mStructDeclaration)
+		,mNumFloats(other.mNumFloats)
+		,mNumTextures(other.mNumTextures)
+		,mTexturePrecisions(other.mTexturePrecisions)
+	{
+		mDeclHelper.copy(other.mDeclHelper);
+	}
+
 	typedef map<string, size_t> AttibuteMap;
 
 	SourceMap mSourceMap;
 	const Compiler& mCompiler;
 	const CompileTask& mCompileTask;
+	ResultCache mResultCache;
 	AttibuteMap mAttributeMap;
 	Declarations mAttributes;
 	DeclarationHelper mDeclHelper;
 	unsigned int mBuiltInStartLine;
+	// builtins.glsl without function bodies, for sections linked with the
+	// prelude
+	string mBuiltInDeclarations;
 	string mSamplerDeclarations;
+	// vertex inputs of the transform feedback variants, one per texture
+	string mStreamDeclarations;
+	// storage buffer of the compute kernels, renderers read it through a
+	// buffer texture. _GR_SLOT(index, slot) is a float of a particle.
+	string mBufferDeclarations;
+	string mBufferTextureDeclarations;
 	string mStructDeclaration;
-	string mOutputDeclarations;
+	size_t mNumFloats;
 	size_t mNumTextures;
+	vector<Precision::Enum> mTexturePrecisions;
 };
 
 const char gFieldNames[] = { 'x', 'y', 'z', 'w' };
 
+// The main functions generated for a modifier
+namespace ModifierVariant
+{
+	enum Enum
+	{
+		Fragment,      // drawn over every texel of the attribute textures
+		ExactEmission, // drawn only on the dead slots to fill
+		Feedback,            // a vertex per particle, captured by transform feedback
+		Compute,             // a kernel invocation per particle, updated in place
+		ComputeExactEmission // same, dead particles take tickets from a counter
+	};
+}
+
+// Where the particles read by generated code are stored
+namespace ParticleStorage
+{
+	enum Enum
+	{
+		Textures, // a texel per 4 floats
+		Streams,  // vertex attributes, one per texture
+		Buffer    // floats of a storage buffer
+	};
+}
+
+// Textures fetched and written by a modifier program, bit i is texture i
+struct TextureAccess
+{
+	unsigned int mFetchMask;
+	unsigned int mWriteMask;
+};
+
+// Keeps the messages of a job so that they are printed in order
+class BufferedLogStream: public ILogStream
+{
+public:
+	void write(const char* msg)
+	{
+		mMessages.push_back(msg);
+	}
+
+	vector<string> mMessages;
+};
+
+// Link and optimization of a root script, with its exact emission variant,
+// or of a pipeline
+struct LinkJob
+{
+	vector<const Script*> mStages;
+	bool mIsPipeline;
+	string mPipelineName;
+
+	bool mSuccess;
+	string mOutput;
+	string mRegionParams;
+	string mAccess;
+	vector<string> mLog;
+};
+
 }
 
 struct Compiler
@@ -121,6 +238,12 @@ static bool compile(Compiler* compiler, CompileTask* task)
 	ScriptCache fshCache;
 	string scriptName;
 
+	if(task->mMaxDrawBuffers == 0)
+	{
+		Logger(logStream) << "A pass needs at least one draw buffer";
+		return false;
+	}
+
 	//load all scripts
 	string filename;
 	size_t numScripts = task->mInputs.size();
@@ -173,6 +296,7 @@ static bool compile(Compiler* compiler, CompileTask* task)
 		"life",
 		DeclarationType::Attribute,
 		DataType::Float,
+		Precision::Full,
 		1,
 		"<built-in>",
 		false
@@ -187,14 +311,37 @@ static bool compile(Compiler* compiler, CompileTask* task)
 	size_t numFloats = 0;
 	compileCtx.mStructDeclaration = "struct _gr_particle {\n";
 
+	// calculate attributes' locations, attributes of the same precision are
+	// packed together so that each texture has a single format
+	const Precision::Enum precisions[] = { Precision::Full, Precision::Half, Precision::Unorm8 };
+	for(size_t i = 0; i < sizeof(precisions) / sizeof(precisions[0]); ++i)
+	{
+		size_t groupStart = (numFloats + 3) / 4 * 4;
+		size_t groupEnd = groupStart;
+
+		for(Declarations::const_iterator itr = compileCtx.mAttributes.begin()
+		;   itr != compileCtx.mAttributes.end()
+		;   ++itr)
+		{
+			if(itr->second.mPrecision != precisions[i]) { continue; }
+
+			compileCtx.mAttributeMap.insert(make_pair(itr->first, groupEnd));
+			groupEnd += DataType::size(itr->second.mDataType);
+		}
+
+		if(groupEnd == groupStart) { continue; }
+
+		for(size_t texture = groupStart / 4; texture < (groupEnd + 3) / 4; ++texture)
+		{
+			compileCtx.mTexturePrecisions.push_back(precisions[i]);
+		}
+		numFloats = groupEnd;
+	}
+
 	for(Declarations::const_iterator itr = compileCtx.mAttributes.begin()
 	;   itr != compileCtx.mAttributes.end()
 	;   ++itr)
 	{
-		// calculate attributes' locations
-		compileCtx.mAttributeMap.insert(make_pair(itr->first, numFloats));
-		numFloats += DataType::size(itr->second.mDataType);
-
 		// define particle's state struct
 		compileCtx.mStructDeclaration += "\t";
 		compileCtx.mStructDeclaration += DataType::name(itr->second.mDataType);
@@ -204,16 +351,38 @@ static bool compile(Compiler* compiler, CompileTask* task)
 	}
 
 	compileCtx.mStructDeclaration += "};\n";
+	compileCtx.mNumFloats = numFloats;
 
-	// generate sampler and output declarations
+	// generate sampler and stream declarations
 	compileCtx.mNumTextures = (numFloats + 3) / 4;//a texel has 4 fields: a, r, g, b
 	compileCtx.mSamplerDeclarations += "uniform sampler2D _gr_tex[";
 	compileCtx.mSamplerDeclarations += str(compileCtx.mNumTextures);
 	compileCtx.mSamplerDeclarations += "];\n";
 
-	compileCtx.mOutputDeclarations += "out vec4 _gr_out[";
-	compileCtx.mOutputDeclarations += str(compileCtx.mNumTextures);
-	compileCtx.mOutputDeclarations += "];\n";
+	for(size_t i = 0; i < compileCtx.mNumTextures; ++i)
+	{
+		compileCtx.mStreamDeclarations += "in vec4 _gr_stream";
+		compileCtx.mStreamDeclarations += str(i);
+		compileCtx.mStreamDeclarations += ";\n";
+	}
+
+	// floats are grouped by particle (AoS) or by slot (SoA)
+	if(task->mComputeGroupSize > 0)
+	{
+		string index = task->mComputeStreams
+			? "(slot) * _gr_numParticles + (index)"
+			: "(index) * " + str(4 * compileCtx.mNumTextures) + " + (slot)";
+		compileCtx.mBufferDeclarations =
+			"uniform int _gr_numParticles;\n"
+			"layout(std430, binding = 2) buffer _gr_particle_buffer { float _gr_data[]; };\n"
+			"#define _GR_SLOT(index, slot) _gr_data[" + index + "]\n";
+		compileCtx.mBufferTextureDeclarations =
+			"uniform int _gr_numParticles;\n"
+			"uniform samplerBuffer _gr_particles;\n"
+			"uniform samplerBuffer _gr_previousParticles;\n"
+			"#define _GR_SLOT(index, slot) texelFetch(_gr_particles, " + index + ").x\n"
+			"#define _GR_PREVIOUS_SLOT(index, slot) texelFetch(_gr_previousParticles, " + index + ").x\n";
+	}
 
 	// Compile all scripts
 	if(!compileModifiers(compileCtx, emitterCache)
@@ -224,97 +393,369 @@ static bool compile(Compiler* compiler, CompileTask* task)
 		return false;
 	}
 
-	// Link scripts
+	// Every modifier is checked once, no matter how many scripts require it
+	if(!checkModifiers(compileCtx, emitterCache, affectorCache, emitterCache)
+	|| !checkModifiers(compileCtx, emitterCache, affectorCache, affectorCache))
+	{
+		return false;
+	}
+
+	// Every root script and pipeline is linked on its own so they are
+	// spread over worker threads
+	vector<LinkJob> jobs;
+	bool hasModifiers = !task->mPipelines.empty();
+	for(size_t i = 0; i < numScripts; ++i)
+	{
+		jobs.push_back(LinkJob());
+		jobs.back().mStages.push_back(rootScripts[i]);
+		jobs.back().mIsPipeline = false;
+
+		ScriptType::Enum scriptType = rootScripts[i]->mType;
+		hasModifiers = hasModifiers || scriptType == ScriptType::Emitter || scriptType == ScriptType::Affector;
+	}
+
+	for(vector<const char*>::const_iterator itr = task->mPipelines.begin()
+	;   itr != task->mPipelines.end()
+	;   ++itr)
+	{
+		jobs.push_back(LinkJob());
+		LinkJob& job = jobs.back();
+		job.mIsPipeline = true;
+		if(!parsePipeline(compileCtx, *itr, emitterCache, affectorCache, job.mPipelineName, job.mStages))
+		{
+			return false;
+		}
+	}
+
+	runLinkJobs(compileCtx, emitterCache, affectorCache, jobs);
+
+	// Results and logs are gathered in order, as if the jobs ran serially
+	stringstream output;
+	stringstream regionParams;
+	stringstream access;
+	for(vector<LinkJob>::const_iterator itr = jobs.begin(); itr != jobs.end(); ++itr)
+	{
+		for(vector<string>::const_iterator msgItr = itr->mLog.begin(); msgItr != itr->mLog.end(); ++msgItr)
+		{
+			logStream->write(msgItr->c_str());
+		}
+		if(!itr->mSuccess) { return false; }
+
+		output << itr->mOutput;
+		regionParams << itr->mRegionParams;
+		access << itr->mAccess;
+	}
+
+	// Write final result
+	ofstream outFile(task->mOutput);
+	if(!outFile.good())
+	{
+		Logger(logStream) << "Can't open '" << task->mOutput << "' for writing";
+		return false;
+	}
+	outFile << compileCtx.mNumTextures << endl;
+	for(vector<Precision::Enum>::const_iterator itr = compileCtx.mTexturePrecisions.begin()
+	;   itr != compileCtx.mTexturePrecisions.end()
+	;   ++itr)
+	{
+		outFile << "texture " << textureFormat(*itr) << endl;
+	}
+	for(Declarations::const_iterator itr = compileCtx.mAttributes.begin()
+	;   itr != compileCtx.mAttributes.end()
+	;   ++itr)
+	{
+		outFile << "attribute " << itr->first
+		        << ' ' << compileCtx.mAttributeMap.find(itr->first)->second
+		        << ' ' << DataType::size(itr->second.mDataType) << endl;
+	}
+	if(task->mAtlas)
+	{
+		outFile << "atlas" << endl;
+		outFile << regionParams.str();
+	}
+	outFile << access.str();
+	outFile << "drawbuffers " << task->mMaxDrawBuffers << endl;
+	if(task->mComputeGroupSize > 0)
+	{
+		outFile << "compute " << (task->mComputeStreams ? "soa" : "aos") << endl;
+	}
+	if(!task->mOptimize && hasModifiers)
+	{
+		// The functions of builtins.glsl as a shader of their own, the
+		// runtime compiles it once and attaches it to every modifier.
+		// Optimized sections have them inlined instead.
+		outFile << "@prelude" << endl
+		        << "#version 140\n"
+		           "uniform uint _gr_frame;\n"
+		           "uniform uint _gr_stream;\n"
+		           "#line " << compileCtx.mBuiltInStartLine << '\n';
+		outFile.write(builtins, builtins_len);
+	}
+	outFile << output.str() << endl;
+
+	if(task->mDepFile != NULL
+	&& !writeDepFile(compileCtx, emitterCache, affectorCache, vshCache, fshCache))
+	{
+		return false;
+	}
+
+	// Generate C++ kernels for the CPU backend
+	if(task->mKernelOutput != NULL
+	&& !generateKernels(compileCtx, rootScripts, emitterCache, affectorCache))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static bool link(
+	const CompileContext& ctx,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	LinkJob& job
+)
+{
 	string code;
+	string sharedCode;
+	string paramLayout;
+	TextureAccess access;
 	stringstream output;
+	stringstream regionParams;
+	stringstream accessLayout;
 
-	for(size_t i = 0; i < numScripts; ++i)
+	if(job.mIsPipeline)
 	{
-		Script& script = *rootScripts[i];
-		code.clear();
+		string sectionName = job.mPipelineName + ".pipeline";
+		if(!linkModifier(ctx, job.mStages, emitterCache, affectorCache, true, ModifierVariant::Fragment, code, sharedCode, paramLayout, access)
+		|| !optimizeSection(ctx, sectionName, kGlslOptShaderFragment, code, sharedCode, output))
+		{
+			return false;
+		}
+		writeRegionParams(sectionName, paramLayout, regionParams);
+		writeAccess(sectionName, access, accessLayout);
+		reportPasses(ctx, sectionName, access);
+
+		if(ctx.mCompileTask.mFeedback
+		&& !linkFeedbackModifier(ctx, job.mStages, emitterCache, affectorCache, true, sectionName, output))
+		{
+			return false;
+		}
+
+		if(ctx.mCompileTask.mComputeGroupSize > 0
+		&& !linkComputeModifier(ctx, job.mStages, emitterCache, affectorCache, true, ModifierVariant::Compute, sectionName, output))
+		{
+			return false;
+		}
+
+		job.mOutput = output.str();
+		job.mRegionParams = regionParams.str();
+		job.mAccess = accessLayout.str();
+		return true;
+	}
+
+	const Script& script = *job.mStages.front();
+	bool success;
+	switch(script.mType)
+	{
+		case ScriptType::Emitter:
+		case ScriptType::Affector:
+			success = linkModifier(
+				ctx,
+				job.mStages,
+				emitterCache,
+				affectorCache,
+				false,
+				ModifierVariant::Fragment,
+				code,
+				sharedCode,
+				paramLayout,
+				access
+			);
+			break;
+		case ScriptType::VertexShader:
+		case ScriptType::FragmentShader:
+			success = linkRenderShader(ctx, script, ParticleStorage::Textures, code);
+			sharedCode = code;
+			break;
+	}
+
+	if(!success) { return false; }
+
+	string sectionName = script.mName;
+	switch(script.mType)
+	{
+		case ScriptType::Emitter:
+			sectionName += ".emitter";
+			break;
+		case ScriptType::Affector:
+			sectionName += ".affector";
+			break;
+		case ScriptType::VertexShader:
+			sectionName += ".vsh";
+			break;
+		case ScriptType::FragmentShader:
+			sectionName += ".fsh";
+			break;
+	}
+
+	bool isVertexShader = script.mType == ScriptType::VertexShader;
+	if(!optimizeSection(
+		ctx,
+		sectionName,
+		isVertexShader ? kGlslOptShaderVertex : kGlslOptShaderFragment,
+		code,
+		sharedCode,
+		output
+	))
+	{
+		return false;
+	}
+	writeRegionParams(sectionName, paramLayout, regionParams);
+	if(script.mType == ScriptType::Emitter || script.mType == ScriptType::Affector)
+	{
+		writeAccess(sectionName, access, accessLayout);
+		reportPasses(ctx, sectionName, access);
+	}
+
+	// Variant drawn only on the dead slots to fill (Emission::Exact).
+	// Regions of an atlas only support random emission.
+	string exactLayout;
+	TextureAccess exactAccess;
+	if(script.mType == ScriptType::Emitter
+	&& !ctx.mCompileTask.mAtlas
+	&& (!linkModifier(
+			ctx,
+			job.mStages,
+			emitterCache,
+			affectorCache,
+			false,
+			ModifierVariant::ExactEmission,
+			code,
+			sharedCode,
+			exactLayout,
+			exactAccess
+		)
+		|| !optimizeSection(ctx, sectionName + ".exact", kGlslOptShaderFragment, code, sharedCode, output)))
+	{
+		return false;
+	}
+	if(script.mType == ScriptType::Emitter && !ctx.mCompileTask.mAtlas)
+	{
+		reportPasses(ctx, sectionName + ".exact", exactAccess);
+	}
 
-		ScriptCache* cache = NULL;
+	// Variants for the transform feedback backend. The fragment shaders
+	// of renderers are shared by both backends.
+	if(ctx.mCompileTask.mFeedback)
+	{
 		switch(script.mType)
 		{
-			case ScriptType::Affector:
-				cache = &affectorCache;
-				break;
 			case ScriptType::Emitter:
-				cache = &emitterCache;
+			case ScriptType::Affector:
+				success = linkFeedbackModifier(ctx, job.mStages, emitterCache, affectorCache, false, sectionName, output);
 				break;
 			case ScriptType::VertexShader:
-				cache = &vshCache;
+				success = linkRenderShader(ctx, script, ParticleStorage::Streams, code)
+					&& optimizeSection(ctx, sectionName + ".feedback", kGlslOptShaderVertex, code, code, output);
 				break;
 			case ScriptType::FragmentShader:
-				cache = &fshCache;
 				break;
 		}
 
-		bool success;
+		if(!success) { return false; }
+	}
+
+	// Kernels for the compute backend, exact emission included since it
+	// runs over every particle with a counter
+	if(ctx.mCompileTask.mComputeGroupSize > 0)
+	{
 		switch(script.mType)
 		{
 			case ScriptType::Emitter:
+				success = linkComputeModifier(ctx, job.mStages, emitterCache, affectorCache, false, ModifierVariant::Compute, sectionName, output)
+					&& (ctx.mCompileTask.mAtlas
+					|| linkComputeModifier(ctx, job.mStages, emitterCache, affectorCache, false, ModifierVariant::ComputeExactEmission, sectionName + ".exact", output));
+				break;
 			case ScriptType::Affector:
-				success = linkModifier(compileCtx, script, *cache, code);
+				success = linkComputeModifier(ctx, job.mStages, emitterCache, affectorCache, false, ModifierVariant::Compute, sectionName, output);
 				break;
 			case ScriptType::VertexShader:
+				success = linkRenderShader(ctx, script, ParticleStorage::Buffer, code)
+					&& optimizeSection(ctx, sectionName + ".compute", kGlslOptShaderVertex, code, code, output);
+				break;
 			case ScriptType::FragmentShader:
-				success = linkRenderShader(compileCtx, script, code);
 				break;
 		}
 
 		if(!success) { return false; }
+	}
 
-		bool isVertexShader = script.mType == ScriptType::VertexShader;
-		glslopt_shader* shader = glslopt_optimize(
-			compiler->mGlslOptCtx,
-			isVertexShader ? kGlslOptShaderVertex : kGlslOptShaderFragment,
-			code.c_str(),
-			0
-		);
-		bool status = glslopt_get_status(shader);
-		if(status)
-		{
-			output << "@" << script.mName;
-			switch(script.mType)
-			{
-				case ScriptType::Emitter:
-					output << ".emitter";
-					break;
-				case ScriptType::Affector:
-					output << ".affector";
-					break;
-				case ScriptType::VertexShader:
-					output << ".vsh";
-					break;
-				case ScriptType::FragmentShader:
-					output << ".fsh";
-					break;
-			}
-			output << endl;
-			output << (task->mOptimize ? glslopt_get_output(shader) : code.c_str());
-			dumpLog(compileCtx, glslopt_get_log(shader));
-		}
-		else
-		{
-			dumpLog(compileCtx, glslopt_get_log(shader));
-			return false;
-		}
+	job.mOutput = output.str();
+	job.mRegionParams = regionParams.str();
+	job.mAccess = accessLayout.str();
+	return true;
+}
+
+// Each worker has its own optimizer context, glsl-optimizer contexts can't
+// be shared between threads
+static void linkWorker(
+	const CompileContext& ctx,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	vector<LinkJob>& jobs,
+	atomic<size_t>& nextJob
+)
+{
+	BufferedLogStream logStream;
+	Compiler compiler;
+	compiler.mLogStream = &logStream;
+	compiler.mGlslOptCtx = glslopt_initialize(kGlslTargetOpenGL);
+	CompileContext workerCtx(ctx, &compiler);
 
-		glslopt_shader_delete(shader);
+	for(size_t index = nextJob++; index < jobs.size(); index = nextJob++)
+	{
+		LinkJob& job = jobs[index];
+		job.mSuccess = link(workerCtx, emitterCache, affectorCache, job);
+		job.mLog.swap(logStream.mMessages);
+		logStream.mMessages.clear();
 	}
 
-	// Write final result
-	ofstream outFile(task->mOutput);
-	if(!outFile.good())
+	glslopt_cleanup(compiler.mGlslOptCtx);
+}
+
+static void runLinkJobs(
+	const CompileContext& ctx,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	vector<LinkJob>& jobs
+)
+{
+	size_t numThreads = ctx.mCompileTask.mNumThreads;
+	if(numThreads == 0) { numThreads = thread::hardware_concurrency(); }
+	numThreads = std::max<size_t>(1, std::min(numThreads, jobs.size()));
+
+	atomic<size_t> nextJob(0);
+	vector<thread> threads;
+	for(size_t i = 1; i < numThreads; ++i)
 	{
-		Logger(logStream) << "Can't open '" << task->mOutput << "' for writing";
-		return false;
+		threads.push_back(thread(
+			linkWorker,
+			cref(ctx),
+			cref(emitterCache),
+			cref(affectorCache),
+			ref(jobs),
+			ref(nextJob)
+		));
 	}
-	outFile << compileCtx.mNumTextures << endl
-	        << output.str() << endl;
 
-	return true;
+	// the calling thread is a worker too
+	linkWorker(ctx, emitterCache, affectorCache, jobs, nextJob);
+
+	for(vector<thread>::iterator itr = threads.begin(); itr != threads.end(); ++itr)
+	{
+		itr->join();
+	}
 }
 
 static bool loadDependencies(
@@ -357,6 +798,7 @@ static bool loadDependencies(
 				);
 			newScript->mType = scriptType;
 			newScript->mName = scriptName;
+			script = newScript;
 		}
 		else
 		{
@@ -482,14 +924,14 @@ static bool compileModifiers(
 
 		// signature
 		code = "void ";
-		code += script.mName;
-		code += "(inout float _gr_seed, inout _gr_particle particle) {\n";
+		code += functionName(script.mType, script.mName);
+		code += "(inout uvec4 _gr_seed, inout _gr_particle particle) {\n";
 
 		// invoke dependencies
 		const vector<string>& deps = script.mDependencies;
 		for(vector<string>::const_iterator itr = deps.begin(); itr != deps.end(); ++itr)
 		{
-			code += *itr;
+			code += functionName(script.mType, *itr);
 			code += "(_gr_seed, particle);\n";
 		}
 
@@ -505,68 +947,402 @@ static bool compileModifiers(
 	return true;
 }
 
-static bool compileRenderShaders(
-	const CompileContext& ctx,
-	ScriptCache& cache
-)
+// Declarations shared by every emitter and affector. The transform feedback
+// variant reads particles from vertex attributes instead of textures and
+// compute kernels from a storage buffer.
+static void generatePrelude(const CompileContext& ctx, ModifierVariant::Enum variant, string& code)
 {
-	for(ScriptCache::iterator itr = cache.begin(); itr != cache.end(); ++itr)
+	bool feedback = variant == ModifierVariant::Feedback;
+	bool compute = variant == ModifierVariant::Compute || variant == ModifierVariant::ComputeExactEmission;
+	if(compute)
 	{
-		Script& script = itr->second;
-		string& code = script.mGeneratedCode;
-
-		code = "void main() {\n";
-		generateFetch(ctx, script, code);
-		code += "#line ";
-		code += str(script.mGeneratedCodeStartLine);
-		code += '\n';
-		code += script.mBody;
-		code += "\n}\n";
+		code += "#version 430\n"
+		        "layout(local_size_x = ";
+		code += str(ctx.mCompileTask.mComputeGroupSize);
+		code += ") in;\n";
 	}
-
-	return true;
-}
-
-static void generateFetch(const CompileContext& ctx, const Script& script, string& code)
-{
-	bool isEmitter = script.mType == ScriptType::Emitter;
-	bool isVertex = script.mType == ScriptType::VertexShader;
-
-	// Calculate texture coordinate
-	if(isVertex)
+	else
+	{
+		code += "#version 140\n";
+	}
+	code += "uniform uint _gr_frame;\n"
+	        "uniform uint _gr_stream;\n";
+	code += ctx.mCompileTask.mAtlas ? "float _gr_chance;\n" : "uniform float _gr_chance;\n";
+	code += "uniform float dt;\n";
+	if(ctx.mCompileTask.mAtlas)
+	{
+		code += "uniform isampler2D _gr_regions;\n"
+		        "uniform samplerBuffer _gr_regionParams;\n";
+	}
+	if(feedback || compute)
+	{
+		code += "uniform int _gr_texWidth;\n"
+		        "#define _GR_FRAG_COORD _gr_fragCoord\n"
+		        "vec4 _gr_fragCoord;\n";
+	}
+	if(feedback)
+	{
+		code += ctx.mStreamDeclarations;
+	}
+	else if(compute)
 	{
-		// TODO: use textureSize
-		code += "ivec2 _gr_size = ivec2(_gr_texWidth, _gr_texHeight);\n"
-		        "ivec2 _gr_texCoord = ivec2(gl_InstanceID % _gr_size.x, gl_InstanceID / _gr_size.y);\n";
+		code += ctx.mBufferDeclarations;
 	}
 	else
 	{
-		code += "ivec2 _gr_texCoord = ivec2(gl_FragCoord.xy);\n";
+		code += ctx.mSamplerDeclarations;
 	}
-
-	// Define struct to hold state
-	code += "_gr_particle particle;";
-	if(isEmitter)
+	if(variant == ModifierVariant::ComputeExactEmission)
 	{
-		code += "_gr_particle _gr_previous;";
+		code += "layout(std430, binding = 3) buffer _gr_emission { uint _gr_emitted; };\n"
+		        "uniform int _gr_emitCount;\n";
 	}
-
-	// Fetch texels
-	for(size_t i = 0; i < ctx.mNumTextures; ++i)
+	if(!compute)
 	{
-		code += "vec4 _gr_stream";
-		code += str(i);
-		code += " = texelFetch(_gr_tex[";
-		code += str(i);
-		code += "], _gr_texCoord, 0);\n";
+		// transform feedback captures every texture, a fragment pass writes
+		// at most one texture per draw buffer
+		size_t numOutputs = feedback
+			? ctx.mNumTextures
+			: std::min(ctx.mNumTextures, ctx.mCompileTask.mMaxDrawBuffers);
+		code += "out vec4 _gr_out[";
+		code += str(numOutputs);
+		code += "];\n";
 	}
+	code += ctx.mStructDeclaration;
+}
 
-	string prefix = isEmitter ? "_gr_previous." : "particle.";
-	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
-	{
-		DataType::Enum attrType = itr->second.mDataType;
-		code += prefix;
-		code += itr->first;
+// Checks the function of each script in isolation: the shared prelude, the
+// params and custom declarations it can see, builtins and prototypes of the
+// functions it calls. Errors can't overflow into another script so they map
+// back to the right file.
+static bool checkModifiers(
+	const CompileContext& ctx,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	const ScriptCache& cache
+)
+{
+	string code;
+	for(ScriptCache::const_iterator scriptItr = cache.begin(); scriptItr != cache.end(); ++scriptItr)
+	{
+		const Script& script = scriptItr->second;
+		bool isEmitter = script.mType == ScriptType::Emitter;
+
+		vector<const Script*> deps;
+		collectDependencies(script, deps, isEmitter ? emitterCache : affectorCache);
+
+		Declarations uniforms;
+		if(!collectParams(ctx, deps, true, uniforms)) { return false; }
+
+		code.clear();
+		generatePrelude(ctx, ModifierVariant::Fragment, code);
+
+		// atlas params are plain globals loaded in main
+		for(Declarations::const_iterator itr = uniforms.begin(); itr != uniforms.end(); ++itr)
+		{
+			if(itr->second.mDeclType != DeclarationType::Param) { continue; }
+
+			if(!ctx.mCompileTask.mAtlas) { code += "uniform "; }
+			code += DataType::name(itr->second.mDataType);
+			code += ' ';
+			code += itr->first;
+			code += ";\n";
+		}
+
+		for(vector<const Script*>::const_iterator itr = deps.begin(); itr != deps.end(); ++itr)
+		{
+			code += (*itr)->mCustomDeclarations;
+		}
+
+		code += "#line ";
+		code += str(ctx.mBuiltInStartLine);
+		code += '\n';
+		code.append(builtins, builtins_len);
+
+		const vector<string>& calls = script.mDependencies;
+		for(vector<string>::const_iterator itr = calls.begin(); itr != calls.end(); ++itr)
+		{
+			code += "void ";
+			code += functionName(script.mType, *itr);
+			code += "(inout uvec4 _gr_seed, inout _gr_particle particle);\n";
+		}
+
+		code += script.mGeneratedCode;
+		code += '\n';
+
+		if(!syntaxCheck(
+			ctx,
+			code,
+			kGlslOptShaderFragment,
+			kGlslOptionNotFullShader,
+			&script))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static const char* textureFormat(Precision::Enum precision)
+{
+	switch(precision)
+	{
+		case Precision::Half:
+			return "rgba16f";
+		case Precision::Unorm8:
+			return "rgba8";
+		default:
+			return "rgba32f";
+	}
+}
+
+static void writeRegionParams(const string& sectionName, const string& paramLayout, ostream& output)
+{
+	stringstream ss(paramLayout);
+	string line;
+	while(getline(ss, line))
+	{
+		output << "param " << sectionName << ' ' << line << endl;
+	}
+}
+
+static void writeAccess(const string& sectionName, const TextureAccess& access, ostream& output)
+{
+	output << "access " << sectionName << ' ' << access.mFetchMask << ' ' << access.mWriteMask << endl;
+}
+
+static size_t countTextures(unsigned int mask)
+{
+	size_t count = 0;
+	for(; mask != 0; mask &= mask - 1) { ++count; }
+	return count;
+}
+
+// Splitting a modifier costs a run of the whole script per pass, it is worth
+// knowing about
+static void reportPasses(const CompileContext& ctx, const string& sectionName, const TextureAccess& access)
+{
+	size_t numWritten = countTextures(access.mWriteMask);
+	size_t maxDrawBuffers = ctx.mCompileTask.mMaxDrawBuffers;
+	if(numWritten <= maxDrawBuffers) { return; }
+
+	Logger(ctx.mCompiler.mLogStream)
+		<< '\'' << sectionName << "' writes " << numWritten << " textures but a pass has "
+		<< maxDrawBuffers << " draw buffers (-b), it is split into "
+		<< (numWritten + maxDrawBuffers - 1) / maxDrawBuffers << " passes";
+}
+
+static unsigned int allTextures(const CompileContext& ctx)
+{
+	return ctx.mNumTextures >= 32 ? ~0u : (1u << ctx.mNumTextures) - 1;
+}
+
+static unsigned int attributeTextures(const CompileContext& ctx, const string& name)
+{
+	Declarations::const_iterator declItr = ctx.mAttributes.find(name);
+	if(declItr == ctx.mAttributes.end()) { return 0; }
+
+	size_t attrLoc = ctx.mAttributeMap.find(name)->second;
+	size_t size = DataType::size(declItr->second.mDataType);
+	unsigned int mask = 0;
+	for(size_t texture = attrLoc / 4; texture <= (attrLoc + size - 1) / 4; ++texture)
+	{
+		mask |= 1u << texture;
+	}
+	return mask;
+}
+
+// Textures touched by a set of scripts, from their scan of the body
+static void collectAccess(
+	const CompileContext& ctx,
+	const vector<const Script*>& scripts,
+	unsigned int& readMask,
+	unsigned int& writeMask
+)
+{
+	for(vector<const Script*>::const_iterator scriptItr = scripts.begin(); scriptItr != scripts.end(); ++scriptItr)
+	{
+		const Script& script = **scriptItr;
+		if(script.mAccessesAll)
+		{
+			readMask |= allTextures(ctx);
+			writeMask |= allTextures(ctx);
+			continue;
+		}
+
+		for(set<string>::const_iterator itr = script.mReads.begin(); itr != script.mReads.end(); ++itr)
+		{
+			readMask |= attributeTextures(ctx, *itr);
+		}
+		for(set<string>::const_iterator itr = script.mWrites.begin(); itr != script.mWrites.end(); ++itr)
+		{
+			writeMask |= attributeTextures(ctx, *itr);
+		}
+	}
+}
+
+// An attribute can span two textures, it is only unpacked when all of them
+// are fetched
+static unsigned int fetchMask(const CompileContext& ctx, unsigned int mask)
+{
+	bool changed = true;
+	while(changed)
+	{
+		changed = false;
+		for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+		{
+			unsigned int textures = attributeTextures(ctx, itr->first);
+			if((textures & mask) != 0 && (textures & mask) != textures)
+			{
+				mask |= textures;
+				changed = true;
+			}
+		}
+	}
+	return mask;
+}
+
+// Emitters and affectors can share a name so their functions are prefixed to
+// be linked together in a pipeline
+static string functionName(ScriptType::Enum scriptType, const string& scriptName)
+{
+	return (scriptType == ScriptType::Emitter ? "_gr_emitter_" : "_gr_affector_") + scriptName;
+}
+
+static bool compileRenderShaders(
+	const CompileContext& ctx,
+	ScriptCache& cache
+)
+{
+	for(ScriptCache::iterator itr = cache.begin(); itr != cache.end(); ++itr)
+	{
+		Script& script = itr->second;
+		script.mGeneratedCode.clear();
+		generateRenderMain(ctx, script, ParticleStorage::Textures, script.mGeneratedCode);
+	}
+
+	return true;
+}
+
+static void generateRenderMain(
+	const CompileContext& ctx,
+	const Script& script,
+	ParticleStorage::Enum storage,
+	string& code
+)
+{
+	vector<const Script*> scripts(1, &script);
+	unsigned int readMask = 0;
+	unsigned int writeMask = 0;
+	collectAccess(ctx, scripts, readMask, writeMask);
+
+	code += "void main() {\n";
+	generateFetch(ctx, script.mType, storage, fetchMask(ctx, readMask | writeMask), code);
+	code += "#line ";
+	code += str(script.mGeneratedCodeStartLine);
+	code += '\n';
+	code += script.mBody;
+	code += "\n}\n";
+}
+
+// Emitted particles start with every attribute zeroed, whatever their
+// scripts don't write stays 0
+static void generateZeroedParticle(const CompileContext& ctx, string& code)
+{
+	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+	{
+		code += "particle.";
+		code += itr->first;
+		code += " = ";
+		code += DataType::name(itr->second.mDataType);
+		code += "(0.0);\n";
+	}
+}
+
+// With feedback, the streams are vertex attributes named like the fetched
+// texels and particles are indexed by vertex or instance. In a buffer, the
+// floats of a texel are gathered into a stream of the same name.
+static void generateFetch(
+	const CompileContext& ctx,
+	ScriptType::Enum scriptType,
+	ParticleStorage::Enum storage,
+	unsigned int textureMask,
+	string& code
+)
+{
+	bool isEmitter = scriptType == ScriptType::Emitter;
+	bool isVertex = scriptType == ScriptType::VertexShader;
+
+	// Calculate texture coordinate
+	if(isVertex)
+	{
+		// instances are drawn from the list of particles to render
+		code += storage == ParticleStorage::Streams ? "int _gr_index = gl_InstanceID;\n" : "int _gr_index = texelFetch(_gr_indices, gl_InstanceID).x;\n";
+		code += "ivec2 _gr_texCoord = ivec2(_gr_index % _gr_texWidth, _gr_index / _gr_texWidth);\n";
+	}
+	else if(storage == ParticleStorage::Streams)
+	{
+		code += "ivec2 _gr_texCoord = ivec2(gl_VertexID % _gr_texWidth, gl_VertexID / _gr_texWidth);\n";
+	}
+	else if(storage == ParticleStorage::Buffer)
+	{
+		// the last work group can go past the last particle
+		code += "int _gr_index = int(gl_GlobalInvocationID.x);\n"
+		        "if(_gr_index >= _gr_numParticles) { return; }\n"
+		        "ivec2 _gr_texCoord = ivec2(_gr_index % _gr_texWidth, _gr_index / _gr_texWidth);\n";
+	}
+	else
+	{
+		code += "ivec2 _gr_texCoord = ivec2(gl_FragCoord.xy);\n";
+	}
+
+	// Define struct to hold state
+	code += "_gr_particle particle;\n";
+	if(isEmitter)
+	{
+		code += "_gr_particle _gr_previous;\n";
+	}
+
+	// Fetch texels, attributes of the other textures are left undefined
+	for(size_t i = 0; i < ctx.mNumTextures && storage != ParticleStorage::Streams; ++i)
+	{
+		if((textureMask & (1u << i)) == 0) { continue; }
+
+		code += "vec4 _gr_stream";
+		code += str(i);
+		if(storage == ParticleStorage::Buffer)
+		{
+			code += " = vec4(";
+			for(size_t j = 0; j < 4; ++j)
+			{
+				code += j > 0 ? ", _GR_SLOT(_gr_index, " : "_GR_SLOT(_gr_index, ";
+				code += str(4 * i + j);
+				code += ')';
+			}
+			code += ");\n";
+		}
+		else
+		{
+			code += " = texelFetch(_gr_tex[";
+			code += str(i);
+			code += "], _gr_texCoord, 0);\n";
+		}
+	}
+
+	if(isVertex && storage != ParticleStorage::Streams)
+	{
+		generateInterpolation(ctx, storage, textureMask, code);
+	}
+
+	string prefix = isEmitter ? "_gr_previous." : "particle.";
+	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+	{
+		if((attributeTextures(ctx, itr->first) & ~textureMask) != 0) { continue; }
+
+		DataType::Enum attrType = itr->second.mDataType;
+		code += prefix;
+		code += itr->first;
 		code += " = ";
 		code += DataType::name(attrType);
 		code += '(';
@@ -594,113 +1370,273 @@ static void generateFetch(const CompileContext& ctx, const Script& script, strin
 	}
 }
 
+// Renderers move particles back towards their state before the last update
+// by _gr_previousWeight, see ParticleSystem::setInterpolation. A particle
+// whose life is not decreasing was emitted since, it has no previous state.
+static void generateInterpolation(
+	const CompileContext& ctx,
+	ParticleStorage::Enum storage,
+	unsigned int textureMask,
+	string& code
+)
+{
+	code += "if(_gr_previousWeight > 0.0) {\n";
+	for(size_t i = 0; i < ctx.mNumTextures; ++i)
+	{
+		if((textureMask & (1u << i)) == 0) { continue; }
+
+		code += "vec4 _gr_previousStream";
+		code += str(i);
+		if(storage == ParticleStorage::Buffer)
+		{
+			code += " = vec4(";
+			for(size_t j = 0; j < 4; ++j)
+			{
+				code += j > 0 ? ", _GR_PREVIOUS_SLOT(_gr_index, " : "_GR_PREVIOUS_SLOT(_gr_index, ";
+				code += str(4 * i + j);
+				code += ')';
+			}
+			code += ");\n";
+		}
+		else
+		{
+			code += " = texelFetch(_gr_previousTex[";
+			code += str(i);
+			code += "], _gr_texCoord, 0);\n";
+		}
+	}
+
+	CompileContext::AttibuteMap::const_iterator life = ctx.mAttributeMap.find("life");
+	if(life != ctx.mAttributeMap.end() && (textureMask & (1u << (life->second / 4))) != 0)
+	{
+		string field = str(life->second / 4) + '.' + gFieldNames[life->second % 4];
+		code += "if(_gr_previousStream" + field + " > 0.0 && _gr_stream" + field + " <= _gr_previousStream" + field + ")\n";
+	}
+	code += "{\n";
+	for(size_t i = 0; i < ctx.mNumTextures; ++i)
+	{
+		if((textureMask & (1u << i)) == 0) { continue; }
+
+		code += "_gr_stream" + str(i) + " = mix(_gr_stream" + str(i) + ", _gr_previousStream" + str(i) + ", _gr_previousWeight);\n";
+	}
+	code += "}\n}\n";
+}
+
+// A region param takes a whole texel of the param buffer, like a std140 vec4
+static void addRegionParam(
+	const string& name,
+	DataType::Enum dataType,
+	size_t slot,
+	string& loadParams,
+	string& paramLayout
+)
+{
+	static const char* swizzles[] = { ".x", ".xy", ".xyz", "" };
+	size_t size = DataType::size(dataType);
+
+	loadParams += name;
+	loadParams += " = _gr_region < 0 ? ";
+	loadParams += DataType::name(dataType);
+	loadParams += "(0.0) : texelFetch(_gr_regionParams, _gr_paramBase + ";
+	loadParams += str(slot);
+	loadParams += ")";
+	loadParams += swizzles[size - 1];
+	loadParams += ";\n";
+
+	paramLayout += name;
+	paramLayout += ' ';
+	paramLayout += str(slot);
+	paramLayout += ' ';
+	paramLayout += str(size);
+	paramLayout += '\n';
+}
+
 static bool linkModifier(
 	const CompileContext& ctx,
-	const Script& script,
-	const ScriptCache& cache,
-	std::string& code
+	const vector<const Script*>& stages,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	bool shareParams,
+	ModifierVariant::Enum variant,
+	std::string& code,
+	std::string& sharedCode,
+	std::string& paramLayout,
+	TextureAccess& access
 )
 {
+	// In an atlas, params belong to the region of a particle instead of the
+	// whole pass so they are read from a buffer in main
+	bool useAtlas = ctx.mCompileTask.mAtlas;
+	bool exactEmission = variant == ModifierVariant::ExactEmission;
+	bool feedback = variant == ModifierVariant::Feedback;
+	bool compute = variant == ModifierVariant::Compute || variant == ModifierVariant::ComputeExactEmission;
+
 	// emitter is trickier with temporary storage
-	code = "#version 140\n"
-	       "uniform float _gr_time;\n"
-	       "uniform float _gr_chance;\n"
-	       "uniform float dt;\n";
-	code += ctx.mSamplerDeclarations;
-	code += ctx.mOutputDeclarations;
-	code += ctx.mStructDeclaration;
+	code.clear();
+	generatePrelude(ctx, variant, code);
 
 	// sort dependencies
 	vector<const Script*> deps;
-	collectDependencies(script, deps, cache);
+	for(vector<const Script*>::const_iterator itr = stages.begin(); itr != stages.end(); ++itr)
+	{
+		bool isEmitter = (*itr)->mType == ScriptType::Emitter;
+		collectDependencies(**itr, deps, isEmitter ? emitterCache : affectorCache);
+	}
 
 	// generate uniform declarations
 	Declarations uniforms;
-	DeclarationHelper declHelper(uniforms);
-	declHelper.copy(ctx.mDeclHelper);
+	if(!collectParams(ctx, deps, shareParams, uniforms)) { return false; }
 
-	for(vector<const Script*>::const_iterator scriptItr = deps.begin()
-	;   scriptItr != deps.end()
-	;   ++scriptItr)
-	{
-		const Declarations& declarations = (*scriptItr)->mDeclarations;
-		for(Declarations::const_iterator declItr = declarations.begin()
-		;   declItr != declarations.end()
-		;   ++declItr)
-		{
-			if(declItr->second.mDeclType != DeclarationType::Param) { continue; }
+	// only the first stage can be an emitter
+	bool isEmitter = stages.front()->mType == ScriptType::Emitter;
 
-			const string* conflictedFile;
-			const Declaration* conflictedDecl;
-			if(!declHelper.declare(
-				declItr->first,
-				declItr->second,
-				(*scriptItr)->mFilename,
-				false,
-				&conflictedFile,
-				&conflictedDecl
-			))
-			{
-				Logger(ctx.mCompiler.mLogStream)
-					<< (*scriptItr)->mFilename
-					<< ':' << declItr->second.mLine
-					<< ": This declaration of '" << declItr->first << '\''
-					<< " conflicts with a previous one"
-					<< " (found at " << *conflictedFile <<
-					':' << conflictedDecl->mLine << ')';
-				return false;
-			}
-		}
+	// params can be grouped so that the runtime updates them with a single buffer
+	bool useBlock = ctx.mCompileTask.mUniformBlocks && !useAtlas;
+	string params;
+	string loadParams;
+	size_t numSlots = 0;
+	if(useAtlas && isEmitter)
+	{
+		addRegionParam("_gr_chance", DataType::Float, numSlots++, loadParams, paramLayout);
 	}
-
 	for(Declarations::const_iterator itr = uniforms.begin()
 	;   itr != uniforms.end()
 	;   ++itr)
 	{
 		if(itr->second.mDeclType != DeclarationType::Param) { continue; }
 
-		code += "uniform ";
-		code += DataType::name(itr->second.mDataType);
-		code += ' ';
-		code += itr->first;
-		code += ";\n";
+		if(!useAtlas)
+		{
+			params += useBlock ? "\t" : "uniform ";
+		}
+		params += DataType::name(itr->second.mDataType);
+		params += ' ';
+		params += itr->first;
+		params += ";\n";
+
+		if(useAtlas)
+		{
+			addRegionParam(itr->first, itr->second.mDataType, numSlots++, loadParams, paramLayout);
+		}
+	}
+
+	if(useBlock && !params.empty())
+	{
+		code += "layout(std140) uniform _gr_params {\n";
+		code += params;
+		code += "};\n";
+	}
+	else
+	{
+		code += params;
 	}
 
 	// append custom declarations
-	code += script.mCustomDeclarations;
+	for(vector<const Script*>::const_iterator itr = stages.begin(); itr != stages.end(); ++itr)
+	{
+		code += (*itr)->mCustomDeclarations;
+	}
 
 	// add builtin functions
 	code += "#line ";
 	code += str(ctx.mBuiltInStartLine);
 	code += '\n';
+	sharedCode = code;
+	sharedCode += ctx.mBuiltInDeclarations;
 	code.append(builtins, builtins_len);
+	string::size_type builtInsEnd = code.size();
 
-	// add dependencies
+	// add dependencies, they were already checked by checkModifiers
 	for(vector<const Script*>::const_iterator itr = deps.begin(); itr != deps.end(); ++itr)
 	{
 		code += (*itr)->mGeneratedCode;
 		code += '\n';
+	}
 
-		// Check for syntax error after every dependencies to prevent errors
-		// from overflowing to next script
-		if(!syntaxCheck(
-			ctx,
-			code,
-			kGlslOptShaderFragment,
-			kGlslOptionNotFullShader,
-			*itr))
-		{
-			return false;
-		}
+	// Only the textures touched by the scripts are fetched and stored, the
+	// runtime keeps the others as they are. Emitters also read the previous
+	// life to find dead particles and exact emission writes whole particles.
+	// Compute kernels update the buffer in place with the same masks.
+	unsigned int readMask = 0;
+	unsigned int writeMask = 0;
+	collectAccess(ctx, deps, readMask, writeMask);
+	if(isEmitter)
+	{
+		readMask |= attributeTextures(ctx, "life");
+	}
+	if(exactEmission)
+	{
+		readMask = 0;
+		writeMask = allTextures(ctx);
+	}
+	if(variant == ModifierVariant::ComputeExactEmission)
+	{
+		// filled slots are written whole like with the fragment variant, the
+		// others are stored back as they were
+		writeMask = allTextures(ctx);
+	}
+	if(feedback)
+	{
+		// transform feedback writes whole vertices, every particle is copied
+		readMask = allTextures(ctx);
+		writeMask = allTextures(ctx);
+	}
+	access.mFetchMask = exactEmission ? 0 : fetchMask(ctx, readMask | writeMask);
+	access.mWriteMask = writeMask;
+
+	// Fragment outputs are the written textures in order. When there are
+	// more than draw buffers, the runtime draws once per group of them and
+	// _gr_pass selects the group to output.
+	vector<size_t> outputs(ctx.mNumTextures);
+	size_t numWritten = 0;
+	for(size_t i = 0; i < ctx.mNumTextures; ++i)
+	{
+		if((writeMask & (1u << i)) != 0) { outputs[i] = numWritten++; }
+	}
+	size_t maxDrawBuffers = ctx.mCompileTask.mMaxDrawBuffers;
+	bool splitPasses = !feedback && !compute && numWritten > maxDrawBuffers;
+	if(splitPasses)
+	{
+		code += "uniform int _gr_pass;\n";
 	}
 
 	// create main function
-	code += "void main()  {\n"
-	        "float _gr_seed = _gr_init_seed();\n";
+	code += "void main()  {\n";
+
+	if(exactEmission)
+	{
+		// every fragment is a dead slot chosen by the runtime, nothing to fetch
+		code += "_gr_particle particle;\n";
+		generateZeroedParticle(ctx, code);
+	}
+	else
+	{
+		ParticleStorage::Enum storage = feedback
+			? ParticleStorage::Streams
+			: (compute ? ParticleStorage::Buffer : ParticleStorage::Textures);
+		generateFetch(ctx, stages.front()->mType, storage, access.mFetchMask, code);
+		if(variant == ModifierVariant::ComputeExactEmission)
+		{
+			generateZeroedParticle(ctx, code);
+		}
+	}
 
-	generateFetch(ctx, script, code);
+	if(feedback || compute)
+	{
+		// same random numbers as the fragment of the particle's texel
+		code += "_gr_fragCoord = vec4(vec2(_gr_texCoord) + 0.5, 0.0, 1.0);\n";
+	}
+	code += "uvec4 _gr_seed = _gr_init_seed();\n";
 
-	bool isEmitter = script.mType == ScriptType::Emitter;
+	if(useAtlas)
+	{
+		// texels outside of any region get zeroed params
+		code += "int _gr_region = texelFetch(_gr_regions, _gr_texCoord, 0).x;\n"
+		        "int _gr_paramBase = _gr_region * ";
+		code += str(numSlots);
+		code += ";\n";
+		code += loadParams;
+	}
 
 	if(isEmitter)
 	{
@@ -715,17 +1651,32 @@ static bool linkModifier(
 	}
 
 	// invoke main script
-	code += script.mName;
+	code += functionName(stages.front()->mType, stages.front()->mName);
 	code += "(_gr_seed, particle);\n";
 
-	if(isEmitter)
+	if(isEmitter && !exactEmission)
 	{
-		// randomly select
-		code += "bool _gr_canEmit = rand() <= _gr_chance;\n"
-		        "bool _gr_dead = _gr_previous.life <= 0.0;\n"
-		        "float _gr_selected = float(_gr_dead && _gr_canEmit);\n";
+		code += "bool _gr_dead = _gr_previous.life <= 0.0;\n";
+		if(variant == ModifierVariant::ComputeExactEmission)
+		{
+			// only dead particles take a ticket, the first ones are emitted
+			code += "float _gr_selected = float(_gr_dead && atomicAdd(_gr_emitted, 1u) < uint(_gr_emitCount));\n";
+		}
+		else
+		{
+			// randomly select
+			code += "bool _gr_canEmit = rand() <= _gr_chance;\n";
+			if(useAtlas)
+			{
+				// rand() can return 0 so a zeroed chance is not enough
+				code += "_gr_canEmit = _gr_canEmit && _gr_region >= 0;\n";
+			}
+			code += "float _gr_selected = float(_gr_dead && _gr_canEmit);\n";
+		}
 		for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
 		{
+			if((attributeTextures(ctx, itr->first) & ~access.mFetchMask) != 0) { continue; }
+
 			code += "particle.";
 			code += itr->first;
 			code += " = mix(_gr_previous.";
@@ -736,41 +1687,203 @@ static bool linkModifier(
 		}
 	}
 
+	// the remaining stages of a pipeline work on the result of the previous one
+	for(vector<const Script*>::const_iterator itr = stages.begin() + 1; itr != stages.end(); ++itr)
+	{
+		code += functionName((*itr)->mType, (*itr)->mName);
+		code += "(_gr_seed, particle);\n";
+	}
+
+	if(splitPasses)
+	{
+		code += "vec4 _gr_texels[";
+		code += str(numWritten);
+		code += "];\n";
+	}
+
 	// store
 	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
 	{
 		size_t attrLoc = ctx.mAttributeMap.find(itr->first)->second;
 		size_t size = DataType::size(itr->second.mDataType);
 
-		if(size > 1)
+		for(size_t j = 0; j < size; ++j)
 		{
-			for(int j = 0; j < size; ++j)
+			size_t slot = attrLoc + j;
+			if((writeMask & (1u << (slot / 4))) == 0) { continue; }
+
+			if(compute)
+			{
+				code += "_GR_SLOT(_gr_index, ";
+				code += str(slot);
+				code += ')';
+			}
+			else
 			{
-				code += "_gr_out[";
-				code += str((attrLoc + j) / 4);
+				code += splitPasses ? "_gr_texels[" : "_gr_out[";
+				code += str(outputs[slot / 4]);
 				code += "].";
-				code += gFieldNames[(attrLoc + j) % 4];
-				code += " = particle.";
-				code += itr->first;
+				code += gFieldNames[slot % 4];
+			}
+			code += " = particle.";
+			code += itr->first;
+			if(size > 1)
+			{
 				code += '.';
 				code += gFieldNames[j];
-				code += ";\n";
 			}
+			code += ";\n";
 		}
-		else
+	}
+
+	if(splitPasses)
+	{
+		// the last group can be smaller, its extra outputs are not drawn
+		for(size_t i = 0; i < maxDrawBuffers; ++i)
 		{
 			code += "_gr_out[";
-			code += str(attrLoc / 4);
-			code += "].";
-			code +=	gFieldNames[attrLoc % 4];
-			code += " = particle.";
-			code += itr->first;
-			code += ";\n";
+			code += str(i);
+			code += "] = _gr_texels[min(_gr_pass * ";
+			code += str(maxDrawBuffers);
+			code += " + ";
+			code += str(i);
+			code += ", ";
+			code += str(numWritten - 1);
+			code += ")];\n";
 		}
 	}
 
 	code += "}\n";
 
+	// the prelude section is a fragment shader, vertex shaders and compute
+	// kernels have the builtins inlined
+	if(feedback || compute)
+	{
+		sharedCode = code;
+	}
+	else
+	{
+		sharedCode += code.substr(builtInsEnd);
+	}
+
+	return true;
+}
+
+// Vertex shader of a modifier for the transform feedback backend, in a
+// section named after the fragment one
+static bool linkFeedbackModifier(
+	const CompileContext& ctx,
+	const vector<const Script*>& stages,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	bool shareParams,
+	const string& sectionName,
+	ostream& output
+)
+{
+	string code;
+	string sharedCode;
+	string paramLayout;
+	TextureAccess access;
+	return linkModifier(
+			ctx,
+			stages,
+			emitterCache,
+			affectorCache,
+			shareParams,
+			ModifierVariant::Feedback,
+			code,
+			sharedCode,
+			paramLayout,
+			access
+		)
+		&& optimizeSection(ctx, sectionName + ".feedback", kGlslOptShaderVertex, code, sharedCode, output);
+}
+
+// Kernel of a modifier for the compute backend, in a section named after the
+// fragment one. glsl-optimizer has no compute stage so it is written as
+// generated, the scripts themselves were checked by checkModifiers.
+static bool linkComputeModifier(
+	const CompileContext& ctx,
+	const vector<const Script*>& stages,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	bool shareParams,
+	ModifierVariant::Enum variant,
+	const string& sectionName,
+	ostream& output
+)
+{
+	string code;
+	string sharedCode;
+	string paramLayout;
+	TextureAccess access;
+	if(!linkModifier(
+		ctx,
+		stages,
+		emitterCache,
+		affectorCache,
+		shareParams,
+		variant,
+		code,
+		sharedCode,
+		paramLayout,
+		access
+	))
+	{
+		return false;
+	}
+
+	output << "@" << sectionName << ".compute" << endl;
+	output << code;
+	return true;
+}
+
+static bool collectParams(
+	const CompileContext& ctx,
+	const vector<const Script*>& deps,
+	bool shareParams,
+	Declarations& uniforms
+)
+{
+	// attributes are copied too so that name clashes are detected
+	DeclarationHelper declHelper(uniforms);
+	declHelper.copy(ctx.mDeclHelper);
+
+	for(vector<const Script*>::const_iterator scriptItr = deps.begin()
+	;   scriptItr != deps.end()
+	;   ++scriptItr)
+	{
+		const Declarations& declarations = (*scriptItr)->mDeclarations;
+		for(Declarations::const_iterator declItr = declarations.begin()
+		;   declItr != declarations.end()
+		;   ++declItr)
+		{
+			if(declItr->second.mDeclType != DeclarationType::Param) { continue; }
+
+			const string* conflictedFile;
+			const Declaration* conflictedDecl;
+			if(!declHelper.declare(
+				declItr->first,
+				declItr->second,
+				(*scriptItr)->mFilename,
+				shareParams,
+				&conflictedFile,
+				&conflictedDecl
+			))
+			{
+				Logger(ctx.mCompiler.mLogStream)
+					<< (*scriptItr)->mFilename
+					<< ':' << declItr->second.mLine
+					<< ": This declaration of '" << declItr->first << '\''
+					<< " conflicts with a previous one"
+					<< " (found at " << *conflictedFile <<
+					':' << conflictedDecl->mLine << ')';
+				return false;
+			}
+		}
+	}
+
 	return true;
 }
 
@@ -797,9 +1910,12 @@ static void collectDependencies(
 	sortedDeps.push_back(&script);
 }
 
+// The transform feedback variant of a vertex shader reads particles as
+// instanced attributes, the compute one from the storage buffer
 static bool linkRenderShader(
 	const CompileContext& ctx,
 	const Script& script,
+	ParticleStorage::Enum storage,
 	std::string& code
 )
 {
@@ -807,6 +1923,29 @@ static bool linkRenderShader(
 	code += script.mCustomDeclarations;
 	code += "uniform int _gr_texWidth;\n"
 	        "uniform int _gr_texHeight;\n";
+	if(storage == ParticleStorage::Streams)
+	{
+		code += ctx.mStreamDeclarations;
+		code += ctx.mStructDeclaration;
+		generateRenderMain(ctx, script, storage, code);
+		return true;
+	}
+	if(storage == ParticleStorage::Buffer)
+	{
+		code += "uniform isamplerBuffer _gr_indices;\n"
+		        "uniform float _gr_previousWeight;\n";
+		code += ctx.mBufferTextureDeclarations;
+		code += ctx.mStructDeclaration;
+		generateRenderMain(ctx, script, storage, code);
+		return true;
+	}
+
+	if(script.mType == ScriptType::VertexShader)
+	{
+		code += "uniform isamplerBuffer _gr_indices;\n"
+		        "uniform float _gr_previousWeight;\n"
+		        "uniform sampler2D _gr_previousTex[" + str(ctx.mNumTextures) + "];\n";
+	}
 	code += ctx.mSamplerDeclarations;
 	code += ctx.mStructDeclaration;
 	code += script.mGeneratedCode;
@@ -814,6 +1953,358 @@ static bool linkRenderShader(
 	return true;
 }
 
+static bool generateKernels(
+	const CompileContext& ctx,
+	const vector<Script*>& rootScripts,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache
+)
+{
+	ILogStream* logStream = ctx.mCompiler.mLogStream;
+	const char* filename = ctx.mCompileTask.mKernelOutput;
+
+	// The module is named after the output file
+	string moduleName = filename;
+	string::size_type slashPos = moduleName.find_last_of('/');
+	if(slashPos != string::npos) { moduleName = moduleName.substr(slashPos + 1); }
+	moduleName = moduleName.substr(0, moduleName.find_first_of('.'));
+	for(string::iterator itr = moduleName.begin(); itr != moduleName.end(); ++itr)
+	{
+		if(!isalnum(*itr)) { *itr = '_'; }
+	}
+
+	stringstream out;
+	out << "// Generated by grainc, do not edit\n"
+	    << "#ifndef GRAIN_KERNELS_" << moduleName << "_HPP\n"
+	    << "#define GRAIN_KERNELS_" << moduleName << "_HPP\n\n"
+	    << "#include <algorithm>\n"
+	    << "#include <CpuModule.hpp>\n\n"
+	    << "namespace " << moduleName << "\n{\n\n"
+	    << "GRAINR_GLSL_IMPORT\n\n"
+	    << ctx.mStructDeclaration << '\n';
+
+	// Each component of an attribute is a separate stream
+	out << "inline void _gr_load(float* const* _gr_streams, size_t _gr_i, _gr_particle& particle)\n{\n";
+	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+	{
+		size_t attrLoc = ctx.mAttributeMap.find(itr->first)->second;
+		size_t size = DataType::size(itr->second.mDataType);
+		out << "\tparticle." << itr->first << " = " << DataType::name(itr->second.mDataType) << '(';
+		for(size_t j = 0; j < size; ++j)
+		{
+			out << (j > 0 ? ", " : "") << "_gr_streams[" << attrLoc + j << "][_gr_i]";
+		}
+		out << ");\n";
+	}
+	out << "}\n\n";
+
+	out << "inline void _gr_store(float* const* _gr_streams, size_t _gr_i, const _gr_particle& particle)\n{\n";
+	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+	{
+		size_t attrLoc = ctx.mAttributeMap.find(itr->first)->second;
+		size_t size = DataType::size(itr->second.mDataType);
+		for(size_t j = 0; j < size; ++j)
+		{
+			out << "\t_gr_streams[" << attrLoc + j << "][_gr_i] = particle." << itr->first;
+			if(size > 1) { out << '.' << gFieldNames[j]; }
+			out << ";\n";
+		}
+	}
+	out << "}\n\n";
+
+	// Same macros as builtins.glsl, select converts with a conditional because
+	// vectorizers don't handle float(bool)
+	out << "#define rand() _gr_seed.next()\n"
+	       "#define random_range(lower, upper) mix(lower, upper, rand())\n"
+	       "#define select(condition, ifTrue, ifFalse) mix(ifFalse, ifTrue, (condition) ? 1.0f : 0.0f)\n\n";
+
+	stringstream kernels;
+	for(vector<Script*>::const_iterator rootItr = rootScripts.begin(); rootItr != rootScripts.end(); ++rootItr)
+	{
+		const Script& script = **rootItr;
+		bool isEmitter = script.mType == ScriptType::Emitter;
+		if(!isEmitter && script.mType != ScriptType::Affector) { continue; }
+
+		const ScriptCache& cache = isEmitter ? emitterCache : affectorCache;
+		vector<const Script*> deps;
+		collectDependencies(script, deps, cache);
+
+		Declarations uniforms;
+		if(!collectParams(ctx, deps, false, uniforms)) { return false; }
+
+		// Params become members so that scripts can access them like uniforms
+		string kernelName = script.mName + (isEmitter ? "_emitter" : "_affector");
+		out << "struct " << kernelName << "\n{\n"
+		    << "\tfloat _gr_chance;\n"
+		    << "\tfloat dt;\n";
+		for(Declarations::const_iterator itr = uniforms.begin(); itr != uniforms.end(); ++itr)
+		{
+			if(itr->second.mDeclType != DeclarationType::Param) { continue; }
+			out << '\t' << DataType::name(itr->second.mDataType) << ' ' << itr->first << ";\n";
+		}
+
+		for(vector<const Script*>::const_iterator depItr = deps.begin(); depItr != deps.end(); ++depItr)
+		{
+			const Script& dep = **depItr;
+			if(!dep.mCustomDeclarations.empty())
+			{
+				Logger(logStream) << dep.mFilename << ": @declare is ignored by the CPU backend";
+			}
+
+			// scripts which don't draw random numbers leave the seed unused
+			out << "\n\tvoid " << dep.mName << "(grainr::CpuRandom& _gr_seed, _gr_particle& particle) const\n\t{\n"
+			    << "\t\t(void)_gr_seed;\n";
+			for(vector<string>::const_iterator itr = dep.mDependencies.begin(); itr != dep.mDependencies.end(); ++itr)
+			{
+				out << "\t\t" << *itr << "(_gr_seed, particle);\n";
+			}
+			out << "#line " << dep.mFirstBodyLine << " \"" << dep.mFilename << "\"\n"
+			    << dep.mBody
+			    << "\t}\n";
+		}
+		out << "};\n\n";
+
+		out << "const grainr::CpuParam " << kernelName << "_params[] = {\n";
+		for(Declarations::const_iterator itr = uniforms.begin(); itr != uniforms.end(); ++itr)
+		{
+			if(itr->second.mDeclType != DeclarationType::Param) { continue; }
+			out << "\t{ \"" << itr->first << "\", offsetof(" << kernelName << ", " << itr->first << "), "
+			    << DataType::size(itr->second.mDataType) << " },\n";
+		}
+		out << "\t{ NULL, 0, 0 }\n};\n\n";
+
+		out << "inline void " << kernelName << "_run(const grainr::CpuKernelArgs& _gr_args)\n{\n"
+		    << '\t' << kernelName << " _gr_self = *static_cast<const " << kernelName << "*>(_gr_args.mParams);\n"
+		    << "\t_gr_self._gr_chance = _gr_args.mChance;\n"
+		    << "\t_gr_self.dt = _gr_args.mDt;\n"
+		    << "\tfloat* const* _gr_streams = _gr_args.mStreams;\n"
+		    // one row at a time so that the inner loop has no division by the width
+		    << "\tfor(size_t _gr_begin = _gr_args.mBegin; _gr_begin < _gr_args.mEnd; )\n\t{\n"
+		    << "\t\tsize_t _gr_y = _gr_begin / _gr_args.mWidth;\n"
+		    << "\t\tsize_t _gr_rowStart = _gr_y * _gr_args.mWidth;\n"
+		    << "\t\tsize_t _gr_end = std::min(_gr_rowStart + _gr_args.mWidth, _gr_args.mEnd);\n"
+		    << "\t\tGRAINR_CPU_VECTORIZE\n"
+		    << "\t\tfor(size_t _gr_i = _gr_begin; _gr_i < _gr_end; ++_gr_i)\n\t\t{\n"
+		    << "\t\t\tgrainr::CpuRandom _gr_seed(_gr_i - _gr_rowStart, _gr_y, _gr_args.mFrame, _gr_args.mStream);\n"
+		    << "\t\t\t_gr_particle _gr_previous;\n"
+		    << "\t\t\t_gr_load(_gr_streams, _gr_i, _gr_previous);\n"
+		    << "\t\t\t_gr_particle particle = _gr_previous;\n"
+		    << "\t\t\t_gr_self." << script.mName << "(_gr_seed, particle);\n";
+		if(isEmitter)
+		{
+			// same selection as the emitter's main function in linkModifier.
+			// && or a product of two float(bool) still compile to branches,
+			// which keep the loop from vectorizing, the bitwise and doesn't.
+			out << "\t\t\tfloat _gr_selected = float(int(rand() <= _gr_self._gr_chance) & int(_gr_previous.life <= 0.0f));\n";
+			for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+			{
+				out << "\t\t\tparticle." << itr->first << " = mix(_gr_previous." << itr->first
+				    << ", particle." << itr->first << ", _gr_selected);\n";
+			}
+		}
+		out << "\t\t\t_gr_store(_gr_streams, _gr_i, particle);\n"
+		    << "\t\t}\n"
+		    << "\t\t_gr_begin = _gr_end;\n"
+		    << "\t}\n"
+		    << "}\n\n";
+
+		kernels << "\t{ \"" << script.mName << "\", "
+		        << (isEmitter ? "grainr::CpuKernelType::Emitter" : "grainr::CpuKernelType::Affector") << ", "
+		        << "sizeof(" << kernelName << "), "
+		        << kernelName << "_params, "
+		        << '&' << kernelName << "_run },\n";
+	}
+
+	out << "#undef rand\n"
+	       "#undef random_range\n"
+	       "#undef select\n\n";
+
+	out << "const grainr::CpuKernel kernels[] = {\n"
+	    << kernels.str()
+	    << "\t{ NULL, grainr::CpuKernelType::Emitter, 0, NULL, NULL }\n};\n\n";
+
+	out << "const grainr::CpuAttribute attributes[] = {\n";
+	for(Declarations::const_iterator itr = ctx.mAttributes.begin(); itr != ctx.mAttributes.end(); ++itr)
+	{
+		out << "\t{ \"" << itr->first << "\", "
+		    << ctx.mAttributeMap.find(itr->first)->second << ", "
+		    << DataType::size(itr->second.mDataType) << " },\n";
+	}
+	out << "\t{ NULL, 0, 0 }\n};\n\n";
+
+	out << "const grainr::CpuModule module = { " << ctx.mNumFloats << ", attributes, kernels };\n\n"
+	    << "}\n\n"
+	    << "#endif\n";
+
+	ofstream outFile(filename);
+	if(!outFile.good())
+	{
+		Logger(logStream) << "Can't open '" << filename << "' for writing";
+		return false;
+	}
+	outFile << out.str();
+
+	return true;
+}
+
+static bool optimizeSection(
+	const CompileContext& ctx,
+	const string& sectionName,
+	glslopt_shader_type shaderType,
+	const string& code,
+	const string& sharedCode,
+	ostream& output
+)
+{
+	bool optimize = ctx.mCompileTask.mOptimize;
+	string key = ctx.mResultCache.makeKey(optimize ? "optimize" : "check", shaderType, 0, code);
+	string result;
+	string log;
+	if(ctx.mResultCache.load(key, result, log))
+	{
+		output << "@" << sectionName << endl;
+		output << result;
+		dumpLog(ctx, log.c_str());
+		return true;
+	}
+
+	glslopt_shader* shader = glslopt_optimize(
+		ctx.mCompiler.mGlslOptCtx,
+		shaderType,
+		code.c_str(),
+		0
+	);
+	bool status = glslopt_get_status(shader);
+	log = glslopt_get_log(shader);
+	if(status)
+	{
+		result = optimize ? glslopt_get_output(shader) : sharedCode.c_str();
+		output << "@" << sectionName << endl;
+		output << result;
+		ctx.mResultCache.store(key, result, log);
+	}
+	dumpLog(ctx, log.c_str());
+	glslopt_shader_delete(shader);
+
+	return status;
+}
+
+// Lists every script that was read, required ones included, so that build
+// systems rebuild the output when any of them changes
+static bool writeDepFile(
+	const CompileContext& ctx,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	const ScriptCache& vshCache,
+	const ScriptCache& fshCache
+)
+{
+	const char* filename = ctx.mCompileTask.mDepFile;
+	ofstream depFile(filename);
+	if(!depFile.good())
+	{
+		Logger(ctx.mCompiler.mLogStream) << "Can't open '" << filename << "' for writing";
+		return false;
+	}
+
+	depFile << escapeDepPath(ctx.mCompileTask.mOutput) << ':';
+	const ScriptCache* caches[] = { &emitterCache, &affectorCache, &vshCache, &fshCache };
+	for(size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i)
+	{
+		for(ScriptCache::const_iterator itr = caches[i]->begin(); itr != caches[i]->end(); ++itr)
+		{
+			depFile << " \\\n  " << escapeDepPath(itr->second.mFilename);
+		}
+	}
+	depFile << endl;
+
+	return depFile.good();
+}
+
+static string escapeDepPath(const string& path)
+{
+	string escaped;
+	for(string::const_iterator itr = path.begin(); itr != path.end(); ++itr)
+	{
+		switch(*itr)
+		{
+			case ' ':
+			case '#':
+				escaped += '\\';
+				break;
+			case '$':
+				escaped += '$';
+				break;
+		}
+		escaped += *itr;
+	}
+	return escaped;
+}
+
+// A pipeline is specified as name:script.emitter,script.affector,...
+static bool parsePipeline(
+	const CompileContext& ctx,
+	const string& spec,
+	const ScriptCache& emitterCache,
+	const ScriptCache& affectorCache,
+	string& pipelineName,
+	vector<const Script*>& stages
+)
+{
+	ILogStream* logStream = ctx.mCompiler.mLogStream;
+	string::size_type colonPos = spec.find_first_of(':');
+	if(colonPos == string::npos || colonPos == 0)
+	{
+		Logger(logStream) << "Invalid pipeline '" << spec << "', expected name:stage,stage...";
+		return false;
+	}
+
+	pipelineName = spec.substr(0, colonPos);
+	stringstream ss(spec.substr(colonPos + 1));
+	string stage;
+	string scriptName;
+	while(getline(ss, stage, ','))
+	{
+		ScriptType::Enum scriptType;
+		if(!Script::parseFilename(stage, scriptName, scriptType)
+		|| (scriptType != ScriptType::Emitter && scriptType != ScriptType::Affector))
+		{
+			Logger(logStream)
+				<< "Pipeline '" << pipelineName << "': "
+				<< '\'' << stage << "' is neither an emitter nor an affector";
+			return false;
+		}
+
+		if(scriptType == ScriptType::Emitter && !stages.empty())
+		{
+			Logger(logStream)
+				<< "Pipeline '" << pipelineName << "': "
+				<< "emitter '" << stage << "' must be the first stage";
+			return false;
+		}
+
+		const ScriptCache& cache = scriptType == ScriptType::Emitter ? emitterCache : affectorCache;
+		ScriptCache::const_iterator scriptItr = cache.find(scriptName);
+		if(scriptItr == cache.end())
+		{
+			Logger(logStream)
+				<< "Pipeline '" << pipelineName << "': "
+				<< '\'' << stage << "' is not one of the compiled scripts";
+			return false;
+		}
+
+		stages.push_back(&scriptItr->second);
+	}
+
+	if(stages.empty())
+	{
+		Logger(logStream) << "Pipeline '" << pipelineName << "' has no stage";
+		return false;
+	}
+
+	return true;
+}
+
 static void dumpLog(const CompileContext& ctx, const char* log, const Script* bottomScript = NULL)
 {
 	stringstream originalLog(log);
@@ -877,6 +2368,11 @@ static bool syntaxCheck(
 	const Script* bottomScript
 )
 {
+	string key = ctx.mResultCache.makeKey("syntax", shaderType, options, code);
+	string result;
+	string log;
+	if(ctx.mResultCache.load(key, result, log)) { return true; }
+
 	glslopt_shader* shader =
 		glslopt_optimize(
 			ctx.mCompiler.mGlslOptCtx,
@@ -885,7 +2381,11 @@ static bool syntaxCheck(
 			options
 		);
 	bool status = glslopt_get_status(shader);
-	if(!status)
+	if(status)
+	{
+		ctx.mResultCache.store(key, result, log);
+	}
+	else
 	{
 		dumpLog(ctx, glslopt_get_log(shader), bottomScript);
 	}
@@ -66,3 +66,26 @@ const char* name(DataType::Enum type)
 }
 
 }
+
+namespace Precision
+{
+
+bool parse(const std::string& str, Enum& out)
+{
+	if(str == "half")
+	{
+		out = Half;
+		return true;
+	}
+	else if(str == "unorm8")
+	{
+		out = Unorm8;
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+}
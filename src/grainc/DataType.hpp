@@ -18,4 +18,17 @@ namespace DataType
 	size_t size(Enum type);
 };
 
+// Storage precision of an attribute, the shader always sees a float
+namespace Precision
+{
+	enum Enum
+	{
+		Full,
+		Half,
+		Unorm8
+	};
+
+	bool parse(const std::string& str, Enum& out);
+};
+
 #endif
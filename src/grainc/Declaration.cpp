@@ -8,6 +8,7 @@ bool DeclarationHelper::declare(
 	const std::string& name,
 	DeclarationType::Enum declType,
 	DataType::Enum dataType,
+	Precision::Enum precision,
 	unsigned int line,
 	const std::string& filename,
 	bool allowCompatibleDup,
@@ -18,7 +19,10 @@ bool DeclarationHelper::declare(
 	if(itr != mDeclarations.end())
 	{
 		const Declaration& oldDecl = itr->second;
-		bool compatible = (oldDecl.mDeclType == declType) && (oldDecl.mDataType == dataType);
+		bool compatible =
+			(oldDecl.mDeclType == declType)
+			&& (oldDecl.mDataType == dataType)
+			&& (oldDecl.mPrecision == precision);
 		if(allowCompatibleDup && compatible)
 		{
 			return true;
@@ -43,6 +47,7 @@ bool DeclarationHelper::declare(
 		Declaration newDecl;
 		newDecl.mLine = line;
 		newDecl.mDataType = dataType;
+		newDecl.mPrecision = precision;
 		newDecl.mDeclType = declType;
 		mDeclarations.insert(std::make_pair(name, newDecl));
 		mDeclToFilename.insert(std::make_pair(name, filename));
@@ -63,6 +68,7 @@ bool DeclarationHelper::declare(
 		name,
 		decl.mDeclType,
 		decl.mDataType,
+		decl.mPrecision,
 		decl.mLine,
 		filename,
 		allowCompatibleDup,
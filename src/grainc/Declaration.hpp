@@ -18,6 +18,7 @@ struct Declaration
 {
 	DeclarationType::Enum mDeclType;
 	DataType::Enum mDataType;
+	Precision::Enum mPrecision;
 	unsigned int mLine;
 };
 
@@ -33,6 +34,7 @@ public:
 		const std::string& name,
 		DeclarationType::Enum declType,
 		DataType::Enum dataType,
+		Precision::Enum precision,
 		unsigned int line,
 		const std::string& filename,
 		bool allowCompatibleDup,
@@ -0,0 +1,82 @@
+#include "ResultCache.hpp"
+#include "FileCache.hpp"
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+
+using namespace std;
+
+namespace
+{
+
+// Bump when the generated code changes in a way the key does not capture
+const char gCacheVersion[] = "grainc-3";
+
+}
+
+ResultCache::ResultCache(const char* directory)
+	:mDirectory(directory != NULL ? directory : "")
+{}
+
+bool ResultCache::isEnabled() const
+{
+	return !mDirectory.empty();
+}
+
+string ResultCache::makeKey(
+	const char* kind,
+	int shaderType,
+	unsigned int options,
+	const string& code
+) const
+{
+	grainr::Hash hash;
+	hash.add(gCacheVersion);
+	hash.add(kind);
+	hash.add((const char*)&shaderType, sizeof(shaderType));
+	hash.add((const char*)&options, sizeof(options));
+	hash.add(code);
+	return hash.hex();
+}
+
+bool ResultCache::load(const string& key, string& result, string& log) const
+{
+	if(!isEnabled()) { return false; }
+
+	// file content: size of the log on a line, the log, then the result
+	ifstream input(path(key).c_str(), ios::in | ios::binary);
+	size_t logSize;
+	if(!(input >> logSize) || input.get() != '\n') { return false; }
+
+	log.resize(logSize);
+	if(logSize > 0 && !input.read(&log[0], logSize)) { return false; }
+
+	result.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+	return true;
+}
+
+void ResultCache::store(const string& key, const string& result, const string& log) const
+{
+	if(!isEnabled()) { return; }
+
+	// workers and other grainc processes may produce the same entry at once
+	string filename = path(key);
+	string tempFilename;
+	if(!grainr::createTempFile(filename, tempFilename)) { return; }
+	{
+		ofstream output(tempFilename.c_str(), ios::out | ios::binary);
+		output << log.size() << '\n' << log << result;
+		if(!output.good())
+		{
+			output.close();
+			std::remove(tempFilename.c_str());
+			return;
+		}
+	}
+	grainr::replaceFile(tempFilename, filename);
+}
+
+string ResultCache::path(const string& key) const
+{
+	return mDirectory + '/' + key;
+}
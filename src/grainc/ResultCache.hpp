@@ -0,0 +1,34 @@
+#ifndef GRAINC_RESULT_CACHE_HPP
+#define GRAINC_RESULT_CACHE_HPP
+
+#include <string>
+
+// Results of glsl-optimizer kept on disk between runs. Entries are keyed by a
+// hash of the code they were produced from so a script only gets optimized
+// again when its own code or the code of one of its dependencies changes.
+// Only successful results are stored, failures are always reported again.
+// The log of a result is stored along with it so that its warnings are
+// reported on every build, not only on the one which produced it.
+class ResultCache
+{
+public:
+	ResultCache(const char* directory);
+
+	bool isEnabled() const;
+
+	std::string makeKey(
+		const char* kind,
+		int shaderType,
+		unsigned int options,
+		const std::string& code
+	) const;
+	bool load(const std::string& key, std::string& result, std::string& log) const;
+	void store(const std::string& key, const std::string& result, const std::string& log) const;
+
+private:
+	std::string path(const std::string& key) const;
+
+	std::string mDirectory;
+};
+
+#endif
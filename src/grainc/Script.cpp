@@ -1,9 +1,32 @@
 #include "Script.hpp"
 #include <fstream>
+#include <cctype>
 #include "Logger.hpp"
 
 using namespace std;
 
+namespace
+{
+
+bool isIdentifierChar(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+string::size_type skipSpaces(const string& str, string::size_type pos)
+{
+	while(pos < str.size() && isspace((unsigned char)str[pos])) { ++pos; }
+	return pos;
+}
+
+string::size_type skipIdentifier(const string& str, string::size_type pos)
+{
+	while(pos < str.size() && isIdentifierChar(str[pos])) { ++pos; }
+	return pos;
+}
+
+}
+
 bool Script::read(const std::string& filename, ILogStream* logStream)
 {
 	ifstream input(filename.c_str());
@@ -46,8 +69,19 @@ bool Script::read(const std::string& filename, ILogStream* logStream)
 		if(firstTok == "@param" || firstTok == "@attribute")
 		{
 			DeclarationType::Enum declType = firstTok == "@param" ? DeclarationType::Param : DeclarationType::Attribute;
-			const string& declName = tokens[2];
-			const string& typeName = tokens[1];
+
+			// attributes can have a precision qualifier: @attribute half vec3 color
+			Precision::Enum precision = Precision::Full;
+			size_t typeTok = 1;
+			if(declType == DeclarationType::Attribute
+			&& tokens.size() > 3
+			&& Precision::parse(tokens[1], precision))
+			{
+				typeTok = 2;
+			}
+
+			const string& declName = tokens[typeTok + 1];
+			const string& typeName = tokens[typeTok];
 
 			DataType::Enum dataType;
 			if(!DataType::parse(typeName, dataType))
@@ -64,6 +98,7 @@ bool Script::read(const std::string& filename, ILogStream* logStream)
 					declName,
 					declType,
 					dataType,
+					precision,
 					lineCount,
 					filename,
 					false,
@@ -114,9 +149,89 @@ bool Script::read(const std::string& filename, ILogStream* logStream)
 		mNumBodyLines = 0;
 	}
 
+	scanAccess();
+
 	return true;
 }
 
+void Script::scanAccess()
+{
+	mReads.clear();
+	mWrites.clear();
+	mAccessesAll = false;
+
+	const string particle = "particle";
+	for(string::size_type pos = mBody.find(particle); pos != string::npos; pos = mBody.find(particle, pos))
+	{
+		string::size_type start = pos;
+		pos += particle.size();
+		if((start > 0 && isIdentifierChar(mBody[start - 1]))
+		|| (pos < mBody.size() && isIdentifierChar(mBody[pos])))
+		{
+			continue;
+		}
+
+		// particle on its own can be read or written by anything
+		string::size_type dotPos = skipSpaces(mBody, pos);
+		if(dotPos >= mBody.size() || mBody[dotPos] != '.')
+		{
+			mAccessesAll = true;
+			continue;
+		}
+
+		string::size_type nameStart = skipSpaces(mBody, dotPos + 1);
+		pos = skipIdentifier(mBody, nameStart);
+		string name = mBody.substr(nameStart, pos - nameStart);
+
+		// swizzles and indices only narrow the access
+		string::size_type end = skipSpaces(mBody, pos);
+		while(end < mBody.size() && (mBody[end] == '.' || mBody[end] == '['))
+		{
+			if(mBody[end] == '.')
+			{
+				end = skipIdentifier(mBody, skipSpaces(mBody, end + 1));
+			}
+			else
+			{
+				string::size_type closePos = mBody.find(']', end);
+				end = closePos == string::npos ? mBody.size() : closePos + 1;
+			}
+			end = skipSpaces(mBody, end);
+		}
+
+		string::size_type before = start;
+		while(before > 0 && isspace((unsigned char)mBody[before - 1])) { --before; }
+		char prev = before > 0 ? mBody[before - 1] : '\0';
+		char next = end < mBody.size() ? mBody[end] : '\0';
+		char afterNext = end + 1 < mBody.size() ? mBody[end + 1] : '\0';
+
+		// An argument may be an out parameter. Increments, decrements and
+		// compound assignments read too.
+		bool isArgument = (prev == '(' || prev == ',') && (next == ',' || next == ')');
+		bool isIncrement = (next == '+' || next == '-') && afterNext == next;
+		bool isPreIncrement = before >= 2
+			&& (prev == '+' || prev == '-')
+			&& mBody[before - 2] == prev;
+		bool isAssignment = next == '=' && afterNext != '=';
+		bool isCompound = afterNext == '='
+			&& (next == '+' || next == '-' || next == '*' || next == '/' || next == '%'
+			 || next == '&' || next == '|' || next == '^');
+		bool isShift = (next == '<' || next == '>')
+			&& afterNext == next
+			&& end + 2 < mBody.size()
+			&& mBody[end + 2] == '=';
+
+		if(!isAssignment)
+		{
+			mReads.insert(name);
+		}
+		if(isAssignment || isCompound || isShift || isIncrement || isPreIncrement || isArgument)
+		{
+			mWrites.insert(name);
+		}
+	}
+}
+
 bool Script::parseFilename(
 	const std::string& filename,
 	std::string& scriptName,
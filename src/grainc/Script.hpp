@@ -1,6 +1,7 @@
 #ifndef GRAINC_SCRIPT_HPP
 #define GRAINC_SCRIPT_HPP
 
+#include <set>
 #include <string>
 #include <vector>
 #include "DataType.hpp"
@@ -22,8 +23,14 @@ struct Script
 	unsigned int mNumBodyLines;
 	unsigned int mGeneratedCodeStartLine;
 	std::string mGeneratedCode;
+	// Attributes accessed as particle.<name> by the body, found by a
+	// conservative scan. Any other use of particle sets mAccessesAll.
+	std::set<std::string> mReads;
+	std::set<std::string> mWrites;
+	bool mAccessesAll;
 
 	bool read(const std::string& filename, ILogStream* logStream);
+	void scanAccess();
 
 	static bool parseFilename(
 		const std::string& filename,
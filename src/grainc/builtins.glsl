@@ -2,18 +2,36 @@
 #define random_range(lower, upper) mix(lower, upper, rand())
 #define select(condition, ifTrue, ifFalse) mix(ifFalse, ifTrue, float(condition))
 
-float _gr_noise(vec2 co)
+// Modifiers run without a fragment (transform feedback vertices, compute
+// invocations) define the coordinate of their particle instead
+#ifndef _GR_FRAG_COORD
+#define _GR_FRAG_COORD gl_FragCoord
+#endif
+
+// Counter based generator: a number is the hash of the stream of its
+// particle and of the numbers drawn before it. It only uses integer ops so
+// that CpuRandom in grainr gets the same bits.
+uvec4 _gr_pcg4d(uvec4 v)
 {
-	return fract(sin(dot(co, vec2(12.9898, 78.233))) * 43758.5453);
+	v = v * 1664525u + 1013904223u;
+	v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+	v ^= v >> 16u;
+	v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
+	return v;
 }
 
-float _gr_init_seed()
+// The stream of a particle is keyed by its texel, the frame and the stream
+// of the modifier (CpuRandom::stream) in xyz, w counts the numbers drawn
+uvec4 _gr_init_seed()
 {
-	return _gr_noise(vec2(_gr_time, _gr_noise(gl_FragCoord.xy)));
+	uvec2 texel = uvec2(_GR_FRAG_COORD.xy);
+	return uvec4(_gr_pcg4d(uvec4(texel, _gr_frame, _gr_stream)).xyz, 0u);
 }
 
-float _gr_rand(inout float seed)
+float _gr_rand(inout uvec4 seed)
 {
-	seed = _gr_noise(vec2(gl_FragCoord.x * seed, gl_FragCoord.y * _gr_time));
-	return seed;
+	uint bits = _gr_pcg4d(seed).x;
+	++seed.w;
+	// 24 bits are exact in a float, the result is in [0, 1)
+	return float(bits >> 8u) * (1.0 / 16777216.0);
 }
@@ -1,6 +1,8 @@
 #ifndef GRAINC_COMPILER_HPP
 #define GRAINC_COMPILER_HPP
 
+#include <cstddef>
+
 struct Compiler;
 
 struct CompileTask;
@@ -20,8 +22,19 @@ CompileTask* createCompileTask();
 void destroyCompileTask(CompileTask* task);
 
 void setOptimize(CompileTask* task, bool optimize);
+void setUniformBlocks(CompileTask* task, bool uniformBlocks);
+void setAtlas(CompileTask* task, bool atlas);
+void setFeedback(CompileTask* task, bool feedback);
+void setComputeGroupSize(CompileTask* task, size_t groupSize);
+void setComputeStreams(CompileTask* task, bool streams);
+void setMaxDrawBuffers(CompileTask* task, size_t maxDrawBuffers);
+void setNumThreads(CompileTask* task, size_t numThreads);
 void setOutput(CompileTask* task, const char* filename);
+void setKernelOutput(CompileTask* task, const char* filename);
+void setDepFile(CompileTask* task, const char* filename);
+void setCacheDirectory(CompileTask* task, const char* path);
 void addInput(CompileTask* task, const char* filename);
 void addIncludePath(CompileTask* task, const char* path);
+void addPipeline(CompileTask* task, const char* spec);
 
 #endif
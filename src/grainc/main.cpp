@@ -13,7 +13,19 @@ int main(int argc, const char* const argv[])
 		cout << "Usage: grainc [options] file..." << endl
 		     << "Options:" << endl
 		     << left << setw(20) << "-o <output>"  << "Set output file name" << endl
-		     << left << setw(20) << "-O"           << "Optimize generated code" << endl;
+		     << left << setw(20) << "-O"           << "Optimize generated code" << endl
+		     << left << setw(20) << "-u"           << "Declare the params of modifiers in a uniform block" << endl
+		     << left << setw(20) << "-a"           << "Read the params of modifiers per atlas region" << endl
+		     << left << setw(20) << "-f"           << "Also generate variants for the transform feedback backend" << endl
+		     << left << setw(20) << "-c <size>"    << "Also generate compute kernels with work groups of this size" << endl
+		     << left << setw(20) << "-s"           << "Store the particles of compute kernels as a stream per float (SoA)" << endl
+		     << left << setw(20) << "-b <count>"   << "Split passes writing more textures than this many draw buffers (default: 8)" << endl
+		     << left << setw(20) << "-I <path>"    << "Add a search path for required scripts" << endl
+		     << left << setw(20) << "-j <threads>" << "Number of scripts linked in parallel (default: one per core)" << endl
+		     << left << setw(20) << "-MF <depfile>" << "Write the scripts read, including required ones, as a Makefile rule" << endl
+		     << left << setw(20) << "-C <dir>"     << "Cache optimized code in a directory between runs" << endl
+		     << left << setw(20) << "-k <header>"  << "Also generate C++ kernels for the CPU backend" << endl
+		     << left << setw(20) << "-p <pipeline>" << "Fuse modifiers into one pass, e.g: rain:line.emitter,geyser.affector" << endl;
 		return 1;
 	}
 
@@ -29,10 +41,54 @@ int main(int argc, const char* const argv[])
 		{
 			setOptimize(task, true);
 		}
+		else if(strcmp(argv[i], "-u") == 0)
+		{
+			setUniformBlocks(task, true);
+		}
+		else if(strcmp(argv[i], "-a") == 0)
+		{
+			setAtlas(task, true);
+		}
+		else if(strcmp(argv[i], "-f") == 0)
+		{
+			setFeedback(task, true);
+		}
+		else if(strcmp(argv[i], "-s") == 0)
+		{
+			setComputeStreams(task, true);
+		}
+		else if(strcmp(argv[i], "-c") == 0 && (++i < argc))
+		{
+			setComputeGroupSize(task, strtoul(argv[i], NULL, 10));
+		}
+		else if(strcmp(argv[i], "-b") == 0 && (++i < argc))
+		{
+			setMaxDrawBuffers(task, strtoul(argv[i], NULL, 10));
+		}
 		else if(strcmp(argv[i], "-o") == 0 && (++i < argc))
 		{
 			setOutput(task, argv[i]);
 		}
+		else if(strcmp(argv[i], "-k") == 0 && (++i < argc))
+		{
+			setKernelOutput(task, argv[i]);
+		}
+		else if(strcmp(argv[i], "-p") == 0 && (++i < argc))
+		{
+			addPipeline(task, argv[i]);
+		}
+		else if(strcmp(argv[i], "-j") == 0 && (++i < argc))
+		{
+			setNumThreads(task, strtoul(argv[i], NULL, 10));
+		}
+		else if(strcmp(argv[i], "-MF") == 0 && (++i < argc))
+		{
+			setDepFile(task, argv[i]);
+		}
+		else if(strcmp(argv[i], "-C") == 0 && (++i < argc))
+		{
+			setCacheDirectory(task, argv[i]);
+		}
 		else if(strcmp(argv[i], "-I") == 0 && (++i < argc))
 		{
 			addIncludePath(task, argv[i]);
@@ -0,0 +1,118 @@
+#include "Atlas.hpp"
+
+namespace grainr
+{
+
+AtlasAllocator::AtlasAllocator(size_t width, size_t height)
+	:mWidth(width)
+	,mHeight(height)
+	,mUsedHeight(0)
+{}
+
+int AtlasAllocator::allocate(size_t width, size_t height)
+{
+	if(width == 0 || height == 0) { return -1; }
+
+	// the smallest released region that fits wastes the least
+	int bestRegion = -1;
+	size_t bestArea = 0;
+	for(size_t i = 0; i < mRegions.size(); ++i)
+	{
+		const Region& region = mRegions[i];
+		const AtlasRect& rect = region.mRect;
+		if(region.mAllocated || rect.mWidth < width || rect.mHeight < height) { continue; }
+
+		size_t area = rect.mWidth * rect.mHeight;
+		if(bestRegion < 0 || area < bestArea)
+		{
+			bestRegion = i;
+			bestArea = area;
+		}
+	}
+
+	if(bestRegion >= 0)
+	{
+		// the region only covers the requested size, the particles of a
+		// region all emit
+		AtlasRect rect = mRegions[bestRegion].mRect;
+		mRegions[bestRegion].mRect.mWidth = width;
+		mRegions[bestRegion].mRect.mHeight = height;
+		mRegions[bestRegion].mAllocated = true;
+		addReleased(rect.mX + width, rect.mY, rect.mWidth - width, height);
+		addReleased(rect.mX, rect.mY + height, rect.mWidth, rect.mHeight - height);
+		return bestRegion;
+	}
+
+	// otherwise pick the lowest shelf with enough room left
+	Shelf* bestShelf = NULL;
+	for(std::vector<Shelf>::iterator itr = mShelves.begin(); itr != mShelves.end(); ++itr)
+	{
+		if(itr->mHeight < height || mWidth - itr->mUsedWidth < width) { continue; }
+		if(bestShelf == NULL || itr->mHeight < bestShelf->mHeight)
+		{
+			bestShelf = &*itr;
+		}
+	}
+
+	if(bestShelf == NULL)
+	{
+		if(width > mWidth || mHeight - mUsedHeight < height) { return -1; }
+
+		Shelf shelf;
+		shelf.mY = mUsedHeight;
+		shelf.mHeight = height;
+		shelf.mUsedWidth = 0;
+		mShelves.push_back(shelf);
+		mUsedHeight += height;
+		bestShelf = &mShelves.back();
+	}
+
+	Region region;
+	region.mRect.mX = bestShelf->mUsedWidth;
+	region.mRect.mY = bestShelf->mY;
+	region.mRect.mWidth = width;
+	region.mRect.mHeight = height;
+	region.mAllocated = true;
+	bestShelf->mUsedWidth += width;
+	mRegions.push_back(region);
+
+	return mRegions.size() - 1;
+}
+
+void AtlasAllocator::addReleased(size_t x, size_t y, size_t width, size_t height)
+{
+	if(width == 0 || height == 0) { return; }
+
+	Region region;
+	region.mRect.mX = x;
+	region.mRect.mY = y;
+	region.mRect.mWidth = width;
+	region.mRect.mHeight = height;
+	region.mAllocated = false;
+	mRegions.push_back(region);
+}
+
+void AtlasAllocator::release(int region)
+{
+	if(isAllocated(region))
+	{
+		mRegions[region].mAllocated = false;
+	}
+}
+
+bool AtlasAllocator::isAllocated(int region) const
+{
+	return region >= 0 && (size_t)region < mRegions.size() && mRegions[region].mAllocated;
+}
+
+const AtlasRect& AtlasAllocator::getRect(int region) const
+{
+	return mRegions[region].mRect;
+}
+
+size_t AtlasAllocator::getNumRegions() const
+{
+	return mRegions.size();
+}
+
+}
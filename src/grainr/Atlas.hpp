@@ -0,0 +1,58 @@
+#ifndef GRAINR_ATLAS_HPP
+#define GRAINR_ATLAS_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace grainr
+{
+
+struct AtlasRect
+{
+	size_t mX;
+	size_t mY;
+	size_t mWidth;
+	size_t mHeight;
+};
+
+// Shelf packer for the regions of a particle system. Region ids are stable
+// and released ones are reused by later allocations which fit in them. The
+// rest of a reused region is split off into released regions of its own.
+class AtlasAllocator
+{
+public:
+	AtlasAllocator(size_t width, size_t height);
+
+	// Returns -1 when there is no room left
+	int allocate(size_t width, size_t height);
+	void release(int region);
+	bool isAllocated(int region) const;
+	const AtlasRect& getRect(int region) const;
+	size_t getNumRegions() const;
+
+private:
+	struct Shelf
+	{
+		size_t mY;
+		size_t mHeight;
+		size_t mUsedWidth;
+	};
+
+	struct Region
+	{
+		AtlasRect mRect;
+		bool mAllocated;
+	};
+
+	void addReleased(size_t x, size_t y, size_t width, size_t height);
+
+	size_t mWidth;
+	size_t mHeight;
+	size_t mUsedHeight;
+	std::vector<Shelf> mShelves;
+	std::vector<Region> mRegions;
+};
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef GRAINR_BINARY_FORMAT_HPP
+#define GRAINR_BINARY_FORMAT_HPP
+
+// Layout of a precompiled system definition (SystemDefinition::save).
+// Every field is a native endian 32 bit integer and every table starts on a
+// 4 byte boundary so the file can be used in place once mapped in memory.
+// Names and sources are offsets into a table of null terminated strings.
+
+namespace grainr
+{
+
+typedef unsigned int BinaryWord;
+
+const char gBinaryMagic[4] = { 'G', 'R', 'N', 'B' };
+const BinaryWord gBinaryVersion = 3;
+
+namespace BinaryFlag
+{
+	enum Enum
+	{
+		Atlas = 1,
+		StorageStreams = 2 // StorageLayout::Streams
+	};
+}
+
+struct BinaryTable
+{
+	BinaryWord mOffset; // from the start of the file
+	BinaryWord mCount;
+};
+
+struct BinaryHeader
+{
+	char mMagic[4];
+	BinaryWord mVersion;
+	BinaryWord mNumTextures;
+	BinaryWord mDrawBuffers;
+	BinaryWord mFlags;
+	BinaryTable mTextureFormats; // BinaryWord
+	BinaryTable mAttributes;     // BinaryAttribute
+	BinaryTable mParams;         // BinaryParam
+	BinaryTable mAccess;         // BinaryAccess
+	BinaryTable mSections;       // BinarySection
+	BinaryTable mPrograms;       // BinaryProgram
+	BinaryTable mStrings;        // count is in bytes
+	BinaryWord mDriver;          // string, driver which produced the program binaries
+};
+
+struct BinaryAttribute
+{
+	BinaryWord mName;
+	BinaryWord mSlot;
+	BinaryWord mSize;
+};
+
+struct BinaryParam
+{
+	BinaryWord mSection;
+	BinaryWord mName;
+	BinaryWord mSlot;
+	BinaryWord mSize;
+};
+
+struct BinaryAccess
+{
+	BinaryWord mSection;
+	BinaryWord mFetchMask;
+	BinaryWord mWriteMask;
+};
+
+struct BinarySection
+{
+	BinaryWord mName;
+	BinaryWord mSource;
+};
+
+// Result of glGetProgramBinary for the program linked from a section
+struct BinaryProgram
+{
+	BinaryWord mSection;
+	BinaryWord mFormat;
+	BinaryWord mOffset;
+	BinaryWord mLength;
+};
+
+}
+
+#endif
@@ -4,8 +4,13 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <cmath>
 #include "SystemDefinition.hpp"
 #include "Shader.hpp"
+#include "BinaryFormat.hpp"
 
 using namespace std;
 
@@ -15,12 +20,6 @@ namespace grainr
 namespace
 {
 
-inline bool endsWith(const std::string& value, const std::string& ending)
-{
-    if (ending.size() > value.size()) return false;
-    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
-}
-
 const char* gQuadVshSource =
 	"#version 140\n"
 	"#extension GL_ARB_explicit_attrib_location: require\n"
@@ -30,16 +29,82 @@ const char* gQuadVshSource =
 	"}\n"
 	;
 
+// Writes the index of every live particle to a buffer and counts them into an
+// indirect draw command. Each work group scans its particles in shared memory
+// and reserves its range of the buffer with a single atomic.
+// The same shader collects dead slots for exact emission (_gr_collectDead).
+// Life is read from the storage buffer of the compute backend when
+// _gr_lifeStride is positive, at _gr_lifeBase + id * _gr_lifeStride.
+const char* gCompactCshSource =
+	"#version 430\n"
+	"layout(local_size_x = 256) in;\n"
+	"layout(std430, binding = 0) buffer _gr_command { uint _gr_counters[4]; };\n"
+	"layout(std430, binding = 1) writeonly buffer _gr_index_buffer { int _gr_indices[]; };\n"
+	"layout(std430, binding = 2) readonly buffer _gr_particle_buffer { float _gr_data[]; };\n"
+	"uniform sampler2D _gr_life;\n"
+	"uniform int _gr_lifeComponent;\n"
+	"uniform int _gr_lifeBase;\n"
+	"uniform int _gr_lifeStride;\n"
+	"uniform int _gr_texWidth;\n"
+	"uniform int _gr_numParticles;\n"
+	"uniform int _gr_counter;\n"
+	"uniform int _gr_maxCount;\n"
+	"uniform bool _gr_collectDead;\n"
+	"shared uint _gr_scan[256];\n"
+	"shared uint _gr_base;\n"
+	"void main() {\n"
+		"int id = int(gl_GlobalInvocationID.x);\n"
+		"uint local = gl_LocalInvocationID.x;\n"
+		"bool selected = false;\n"
+		"if(id < _gr_numParticles) {\n"
+			"ivec2 coord = ivec2(id % _gr_texWidth, id / _gr_texWidth);\n"
+			"float life = _gr_lifeStride > 0\n"
+				"? _gr_data[_gr_lifeBase + id * _gr_lifeStride]\n"
+				": texelFetch(_gr_life, coord, 0)[_gr_lifeComponent];\n"
+			"bool alive = life > 0.0;\n"
+			"selected = alive != _gr_collectDead;\n"
+		"}\n"
+		"_gr_scan[local] = selected ? 1u : 0u;\n"
+		"barrier();\n"
+		"for(uint offset = 1u; offset < 256u; offset <<= 1) {\n"
+			"uint value = local >= offset ? _gr_scan[local - offset] : 0u;\n"
+			"barrier();\n"
+			"_gr_scan[local] += value;\n"
+			"barrier();\n"
+		"}\n"
+		"if(local == 255u) { _gr_base = atomicAdd(_gr_counters[_gr_counter], _gr_scan[255]); }\n"
+		"barrier();\n"
+		"uint rank = _gr_base + _gr_scan[local] - 1u;\n"
+		"if(selected && rank < uint(_gr_maxCount)) { _gr_indices[rank] = id; }\n"
+	"}\n"
+	;
+
+// Places a point on each slot of the free list, negative entries are culled
+const char* gEmitVshSource =
+	"#version 140\n"
+	"uniform isamplerBuffer _gr_free;\n"
+	"uniform int _gr_texWidth;\n"
+	"uniform int _gr_texHeight;\n"
+	"void main() {\n"
+		"int index = texelFetch(_gr_free, gl_VertexID).x;\n"
+		"vec2 size = vec2(_gr_texWidth, _gr_texHeight);\n"
+		"vec2 coord = vec2(index % _gr_texWidth, index / _gr_texWidth) + 0.5;\n"
+		"gl_PointSize = 1.0;\n"
+		"gl_Position = index < 0 ? vec4(2.0, 2.0, 2.0, 1.0) : vec4(coord / size * 2.0 - 1.0, 0.0, 1.0);\n"
+	"}\n"
+	;
+
 }
 
 Context::Context()
 {
 	glGenBuffers(1, &mQuadBuff);
 	glBindBuffer(GL_ARRAY_BUFFER, mQuadBuff);
+	// drawn as a triangle fan
 	float quad[] = {
 		-1.0f,  1.0f,
-		 1.0f,  1.1f,
-		 1.0f, -1.0,
+		 1.0f,  1.0f,
+		 1.0f, -1.0f,
 		-1.0f, -1.0f
 	};
 	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
@@ -52,32 +117,135 @@ Context::Context()
 	glBindVertexArray(0);
 
 	mQuadVsh = createShader(GL_VERTEX_SHADER, gQuadVshSource, cerr);
+	mEmitVsh = createShader(GL_VERTEX_SHADER, gEmitVshSource, cerr);
+
+	// emission points have no vertex attribute
+	glGenVertexArrays(1, &mEmitVAO);
+
+	mCompactProgram = 0;
+	if(GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_draw_indirect)
+	{
+		GLuint compactCsh = createShader(GL_COMPUTE_SHADER, gCompactCshSource, cerr);
+		if(compactCsh != 0)
+		{
+			mCompactProgram = createComputeProgram(compactCsh, cerr);
+			glDeleteShader(compactCsh);
+		}
+	}
+	if(mCompactProgram != 0)
+	{
+		mCompactLocations.mLife = glGetUniformLocation(mCompactProgram, "_gr_life");
+		mCompactLocations.mLifeComponent = glGetUniformLocation(mCompactProgram, "_gr_lifeComponent");
+		mCompactLocations.mLifeBase = glGetUniformLocation(mCompactProgram, "_gr_lifeBase");
+		mCompactLocations.mLifeStride = glGetUniformLocation(mCompactProgram, "_gr_lifeStride");
+		mCompactLocations.mTexWidth = glGetUniformLocation(mCompactProgram, "_gr_texWidth");
+		mCompactLocations.mNumParticles = glGetUniformLocation(mCompactProgram, "_gr_numParticles");
+		mCompactLocations.mCounter = glGetUniformLocation(mCompactProgram, "_gr_counter");
+		mCompactLocations.mMaxCount = glGetUniformLocation(mCompactProgram, "_gr_maxCount");
+		mCompactLocations.mCollectDead = glGetUniformLocation(mCompactProgram, "_gr_collectDead");
+	}
 
-	mTime = 0.0f;
+	mFrame = 0;
 	mDt = 0.0f;
+	mFixedStep = 0.0f;
+	mMaxSteps = 0;
+	mPendingSteps = 0;
+	mAccumulator = 0.0f;
+
+	// let the driver use as many threads as it wants
+	if(GLEW_KHR_parallel_shader_compile)
+	{
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	mDriver = (const char*)glGetString(GL_VENDOR);
+	mDriver += '/';
+	mDriver += (const char*)glGetString(GL_RENDERER);
+	mDriver += '/';
+	mDriver += (const char*)glGetString(GL_VERSION);
 }
 
 Context::~Context()
 {
 	glDeleteVertexArrays(1, &mUpdateVAO);
+	glDeleteVertexArrays(1, &mEmitVAO);
 	glDeleteBuffers(1, &mQuadBuff);
+	glDeleteProgram(mCompactProgram);
 }
 
 void Context::update(float dt)
 {
-	mTime += dt;
+	++mFrame;
 	mDt = dt;
 }
 
+void Context::setFixedStep(float step, size_t maxSteps)
+{
+	mFixedStep = step;
+	mMaxSteps = maxSteps;
+	mPendingSteps = 0;
+	mAccumulator = 0.0f;
+}
+
+void Context::advance(float dt)
+{
+	if(mFixedStep <= 0.0f) { return; }
+
+	mAccumulator += dt;
+	mPendingSteps = (size_t)(mAccumulator / mFixedStep);
+	if(mPendingSteps > mMaxSteps)
+	{
+		mAccumulator = std::fmod(mAccumulator, mFixedStep) + mMaxSteps * mFixedStep;
+		mPendingSteps = mMaxSteps;
+	}
+}
+
+bool Context::step()
+{
+	if(mPendingSteps == 0) { return false; }
+
+	--mPendingSteps;
+	mAccumulator = std::max(mAccumulator - mFixedStep, 0.0f);
+	update(mFixedStep);
+	return true;
+}
+
+float Context::getInterpolation() const
+{
+	if(mFixedStep <= 0.0f) { return 1.0f; }
+
+	return std::min(mAccumulator / mFixedStep, 1.0f);
+}
+
+void Context::setProgramCacheDirectory(const char* directory)
+{
+	mProgramCache.setDirectory(directory);
+}
+
+const ProgramCacheStats& Context::getProgramCacheStats() const
+{
+	return mProgramCache.getStats();
+}
+
 SystemDefinition* Context::load(const char* filename, std::ostream& err) const
 {
-	ifstream input(filename, ios::in);
+	ifstream input(filename, ios::in | ios::binary);
 	if(!input.good())
 	{
 		err << "Can't open '" << filename << "' for reading" << endl;
 		return NULL;
 	}
 
+	char magic[sizeof(gBinaryMagic)];
+	if(input.read(magic, sizeof(magic)) && memcmp(magic, gBinaryMagic, sizeof(magic)) == 0)
+	{
+		vector<char> data(gBinaryMagic, gBinaryMagic + sizeof(gBinaryMagic));
+		data.insert(data.end(), istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+		return loadBinary(data, err);
+	}
+	input.clear();
+	input.seekg(0);
+
 	SystemDefinition* def = new SystemDefinition();
 	input >> def->mNumTextures;
 	def->mContext = this;
@@ -87,18 +255,100 @@ SystemDefinition* Context::load(const char* filename, std::ostream& err) const
 	string progName;
 	while(getline(input, line))
 	{
-		if(line.length() > 0 && line[0] == '@')
+		if(progName.empty() && line.compare(0, 8, "texture ") == 0)
+		{
+			// header: storage format of each texture
+			string format = line.substr(8);
+			GLenum internalFormat;
+			if(format == "rgba32f") { internalFormat = GL_RGBA32F; }
+			else if(format == "rgba16f") { internalFormat = GL_RGBA16F; }
+			else if(format == "rgba8") { internalFormat = GL_RGBA8; }
+			else
+			{
+				err << "Unknown texture format '" << format << "'" << endl;
+				delete def;
+				return NULL;
+			}
+			def->mTextureFormats.push_back(internalFormat);
+		}
+		else if(progName.empty() && line.compare(0, 10, "attribute ") == 0)
 		{
+			// header: attribute name slot size
+			stringstream ss(line.substr(10));
+			string attrName;
+			AttributeLayout layout;
+			if(!(ss >> attrName >> layout.mSlot >> layout.mSize))
+			{
+				err << "Invalid attribute layout '" << line << "'" << endl;
+				delete def;
+				return NULL;
+			}
+			def->mAttributes.insert(make_pair(attrName, layout));
+		}
+		else if(progName.empty() && line == "atlas")
+		{
+			def->mAtlas = true;
+		}
+		else if(progName.empty() && line.compare(0, 6, "param ") == 0)
+		{
+			// header: section name slot size
+			stringstream ss(line.substr(6));
+			string section;
+			string paramName;
+			RegionParamLayout layout;
+			if(!(ss >> section >> paramName >> layout.mSlot >> layout.mSize))
+			{
+				err << "Invalid param layout '" << line << "'" << endl;
+				delete def;
+				return NULL;
+			}
+			def->mRegionParams[section].insert(make_pair(paramName, layout));
+		}
+		else if(progName.empty() && line.compare(0, 12, "drawbuffers ") == 0)
+		{
+			// header: most textures written by a pass
+			stringstream ss(line.substr(12));
+			if(!(ss >> def->mDrawBuffers) || def->mDrawBuffers == 0)
+			{
+				err << "Invalid draw buffer count '" << line << "'" << endl;
+				delete def;
+				return NULL;
+			}
+		}
+		else if(progName.empty() && line.compare(0, 8, "compute ") == 0)
+		{
+			// header: layout of the storage buffer of the compute backend
+			string layout = line.substr(8);
+			if(layout == "aos") { def->mStorageLayout = StorageLayout::Interleaved; }
+			else if(layout == "soa") { def->mStorageLayout = StorageLayout::Streams; }
+			else
+			{
+				err << "Unknown storage layout '" << layout << "'" << endl;
+				delete def;
+				return NULL;
+			}
+		}
+		else if(progName.empty() && line.compare(0, 7, "access ") == 0)
+		{
+			// header: section fetchMask writeMask
+			stringstream ss(line.substr(7));
+			string section;
+			SectionAccess access;
+			if(!(ss >> section >> access.mFetchMask >> access.mWriteMask))
+			{
+				err << "Invalid access '" << line << "'" << endl;
+				delete def;
+				return NULL;
+			}
+			def->mAccess.insert(make_pair(section, access));
+		}
+		else if(line.length() > 0 && line[0] == '@')
+		{
+			// shaders are compiled on first use, programs found in the
+			// cache don't need them at all
 			if(content.tellp() > 0 && progName.length() > 0)
 			{
-				GLenum shaderType = endsWith(progName, ".vsh") ? GL_VERTEX_SHADER : GL_FRAGMENT_SHADER;
-				GLuint shader = createShader(shaderType, content.str().c_str(), err);
-				if(shader == 0)
-				{
-					delete def;
-					return NULL;
-				}
-				def->mShaders.insert(make_pair(progName, shader));
+				def->mSources.insert(make_pair(progName, content.str()));
 
 				content.str("");
 				content.clear();
@@ -111,14 +361,146 @@ SystemDefinition* Context::load(const char* filename, std::ostream& err) const
 		}
 	}
 
-	GLenum shaderType = endsWith(progName, ".vsh") ? GL_VERTEX_SHADER : GL_FRAGMENT_SHADER;
-	GLuint shader = createShader(shaderType, content.str().c_str(), err);
-	if(shader <= 0)
+	// definitions without a header use full precision for everything and
+	// write every texture in a single pass
+	def->mTextureFormats.resize(def->mNumTextures, GL_RGBA32F);
+	if(def->mDrawBuffers == 0) { def->mDrawBuffers = def->mNumTextures; }
+
+	def->mSources.insert(make_pair(progName, content.str()));
+
+	return def;
+}
+
+SystemDefinition* Context::loadAsync(const char* filename, std::ostream& err) const
+{
+	SystemDefinition* def = load(filename, err);
+	if(def != NULL)
+	{
+		def->startLinking(Backend::Fragment);
+	}
+	return def;
+}
+
+SystemDefinition* Context::loadBinary(const vector<char>& data, std::ostream& err) const
+{
+	const BinaryHeader* header = (const BinaryHeader*)data.data();
+	if(data.size() < sizeof(BinaryHeader) || header->mVersion != gBinaryVersion)
+	{
+		err << "Unsupported binary definition" << endl;
+		return NULL;
+	}
+
+	// every table has to be inside of the file
+	const BinaryTable* tables[] = {
+		&header->mTextureFormats,
+		&header->mAttributes,
+		&header->mParams,
+		&header->mAccess,
+		&header->mSections,
+		&header->mPrograms,
+		&header->mStrings
+	};
+	const size_t entrySizes[] = {
+		sizeof(BinaryWord),
+		sizeof(BinaryAttribute),
+		sizeof(BinaryParam),
+		sizeof(BinaryAccess),
+		sizeof(BinarySection),
+		sizeof(BinaryProgram),
+		sizeof(char)
+	};
+	for(size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); ++i)
+	{
+		if(tables[i]->mOffset > data.size() || tables[i]->mCount > (data.size() - tables[i]->mOffset) / entrySizes[i])
+		{
+			err << "Corrupted binary definition" << endl;
+			return NULL;
+		}
+	}
+
+	const char* strings = data.data() + header->mStrings.mOffset;
+	size_t stringsSize = header->mStrings.mCount;
+	if(stringsSize == 0 || strings[stringsSize - 1] != '\0'
+	|| header->mDriver >= stringsSize
+	|| header->mDrawBuffers == 0)
 	{
-		delete def;
+		err << "Corrupted binary definition" << endl;
 		return NULL;
 	}
-	def->mShaders.insert(make_pair(progName, shader));
+
+	SystemDefinition* def = new SystemDefinition();
+	def->mContext = this;
+	def->mNumTextures = header->mNumTextures;
+	def->mDrawBuffers = header->mDrawBuffers;
+	def->mAtlas = (header->mFlags & BinaryFlag::Atlas) != 0;
+	def->mStorageLayout = (header->mFlags & BinaryFlag::StorageStreams) != 0
+		? StorageLayout::Streams
+		: StorageLayout::Interleaved;
+
+	const BinaryWord* formats = (const BinaryWord*)(data.data() + header->mTextureFormats.mOffset);
+	def->mTextureFormats.assign(formats, formats + header->mTextureFormats.mCount);
+	def->mTextureFormats.resize(def->mNumTextures, GL_RGBA32F);
+
+	const BinaryAttribute* attributes = (const BinaryAttribute*)(data.data() + header->mAttributes.mOffset);
+	for(BinaryWord i = 0; i < header->mAttributes.mCount; ++i)
+	{
+		if(attributes[i].mName >= stringsSize) { continue; }
+
+		AttributeLayout layout;
+		layout.mSlot = attributes[i].mSlot;
+		layout.mSize = attributes[i].mSize;
+		def->mAttributes.insert(make_pair(string(strings + attributes[i].mName), layout));
+	}
+
+	const BinaryParam* params = (const BinaryParam*)(data.data() + header->mParams.mOffset);
+	for(BinaryWord i = 0; i < header->mParams.mCount; ++i)
+	{
+		if(params[i].mSection >= stringsSize || params[i].mName >= stringsSize) { continue; }
+
+		RegionParamLayout layout;
+		layout.mSlot = params[i].mSlot;
+		layout.mSize = params[i].mSize;
+		def->mRegionParams[strings + params[i].mSection].insert(make_pair(string(strings + params[i].mName), layout));
+	}
+
+	const BinaryAccess* access = (const BinaryAccess*)(data.data() + header->mAccess.mOffset);
+	for(BinaryWord i = 0; i < header->mAccess.mCount; ++i)
+	{
+		if(access[i].mSection >= stringsSize) { continue; }
+
+		SectionAccess entry;
+		entry.mFetchMask = access[i].mFetchMask;
+		entry.mWriteMask = access[i].mWriteMask;
+		def->mAccess.insert(make_pair(string(strings + access[i].mSection), entry));
+	}
+
+	// shaders are compiled when a program can't be created from its binary
+	const BinarySection* sections = (const BinarySection*)(data.data() + header->mSections.mOffset);
+	for(BinaryWord i = 0; i < header->mSections.mCount; ++i)
+	{
+		if(sections[i].mName >= stringsSize || sections[i].mSource >= stringsSize) { continue; }
+
+		def->mSources.insert(make_pair(string(strings + sections[i].mName), string(strings + sections[i].mSource)));
+	}
+
+	// binaries from another driver would be rejected anyway
+	const BinaryProgram* programs = (const BinaryProgram*)(data.data() + header->mPrograms.mOffset);
+	bool sameDriver = mDriver == strings + header->mDriver;
+	for(BinaryWord i = 0; sameDriver && i < header->mPrograms.mCount; ++i)
+	{
+		const BinaryProgram& program = programs[i];
+		if(program.mSection >= stringsSize
+		|| program.mOffset > data.size()
+		|| program.mLength > data.size() - program.mOffset)
+		{
+			continue;
+		}
+
+		ProgramBinary binary;
+		binary.mFormat = program.mFormat;
+		binary.mData.assign(data.begin() + program.mOffset, data.begin() + program.mOffset + program.mLength);
+		def->mProgramBinaries.insert(make_pair(string(strings + program.mSection), binary));
+	}
 
 	return def;
 }
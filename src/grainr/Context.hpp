@@ -2,7 +2,10 @@
 #define GRAINR_CONTEXT_HPP
 
 #include <iosfwd>
+#include <string>
+#include <vector>
 #include <GL/gl.h>
+#include "Shader.hpp"
 
 namespace grainr
 {
@@ -13,24 +16,80 @@ class Program;
 
 class Context
 {
+	friend class SystemDefinition;
 	friend class ParticleSystem;
 	friend class Program;
+	friend class Emitter;
 public:
 	Context();
 	~Context();
 
+	// Reads either the output of grainc or a definition written by
+	// SystemDefinition::save
 	SystemDefinition* load(const char* filename, std::ostream& err) const;
+	// Same as load but the programs of the fragment backend start compiling
+	// and linking right away, in the background if the driver supports
+	// GL_KHR_parallel_shader_compile. Those of another backend start with
+	// the first system created for it. Poll SystemDefinition::isReady to
+	// create programs without stalling. Errors are reported by the create
+	// functions of ParticleSystem.
+	SystemDefinition* loadAsync(const char* filename, std::ostream& err) const;
 	void update(float dt);
 
+	// Fixed timestep: advance adds the time of a frame and step updates by
+	// step seconds while a whole one is left, at most maxSteps per frame.
+	// The time past maxSteps is dropped so that a slow frame doesn't make
+	// the next ones slower.
+	//     ctx->advance(frameTime);
+	//     while(ctx->step()) { run emitters and affectors }
+	void setFixedStep(float step, size_t maxSteps);
+	void advance(float dt);
+	bool step();
+	// Fraction of a step between the last update and the time advanced to,
+	// how far renderers of interpolated systems are past the previous
+	// state. It is 1 without a fixed step.
+	float getInterpolation() const;
+
+	// Programs linked from source are also stored in this directory and
+	// reused by later runs. Passing NULL disables the cache.
+	void setProgramCacheDirectory(const char* directory);
+	const ProgramCacheStats& getProgramCacheStats() const;
+
 private:
 	Context(Context& other);
 
+	SystemDefinition* loadBinary(const std::vector<char>& data, std::ostream& err) const;
+
+	// Uniforms of mCompactProgram, looked up once when it is linked
+	struct CompactLocations
+	{
+		GLint mLife;
+		GLint mLifeComponent;
+		GLint mLifeBase;
+		GLint mLifeStride;
+		GLint mTexWidth;
+		GLint mNumParticles;
+		GLint mCounter;
+		GLint mMaxCount;
+		GLint mCollectDead;
+	};
+
 	GLuint mQuadBuff;
 	GLuint mUpdateVAO;
+	GLuint mEmitVAO;
 	GLuint mUpdateVsh;
 	GLuint mQuadVsh;
-	float mTime;
+	GLuint mEmitVsh;
+	GLuint mCompactProgram;
+	CompactLocations mCompactLocations;
+	unsigned int mFrame; // number of updates, random numbers are keyed by it
 	float mDt;
+	float mFixedStep;
+	size_t mMaxSteps;
+	size_t mPendingSteps;
+	float mAccumulator; // time advanced but not stepped yet
+	std::string mDriver; // program binaries are only reused with the same driver
+	mutable ProgramCache mProgramCache;
 };
 
 }
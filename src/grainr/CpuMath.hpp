@@ -0,0 +1,225 @@
+#ifndef GRAINR_CPU_MATH_HPP
+#define GRAINR_CPU_MATH_HPP
+
+#include <cmath>
+#include <cstddef>
+
+namespace grainr
+{
+
+// A subset of GLSL's types and built-in functions so that Grain scripts can be
+// compiled as C++ by grainc for the CPU backend
+namespace glsl
+{
+
+using std::sin;
+using std::cos;
+using std::tan;
+using std::asin;
+using std::acos;
+using std::atan;
+using std::exp;
+using std::log;
+using std::sqrt;
+using std::pow;
+using std::floor;
+using std::ceil;
+
+struct vec2
+{
+	enum { Size = 2 };
+
+	vec2() {}
+	explicit vec2(float s): x(s), y(s) {}
+	vec2(float x_, float y_): x(x_), y(y_) {}
+
+	float& operator[](size_t i) { return (&x)[i]; }
+	const float& operator[](size_t i) const { return (&x)[i]; }
+
+	float x, y;
+};
+
+struct vec3
+{
+	enum { Size = 3 };
+
+	vec3() {}
+	explicit vec3(float s): x(s), y(s), z(s) {}
+	vec3(float x_, float y_, float z_): x(x_), y(y_), z(z_) {}
+	vec3(const vec2& xy, float z_): x(xy.x), y(xy.y), z(z_) {}
+	vec3(float x_, const vec2& yz): x(x_), y(yz.x), z(yz.y) {}
+
+	float& operator[](size_t i) { return (&x)[i]; }
+	const float& operator[](size_t i) const { return (&x)[i]; }
+
+	float x, y, z;
+};
+
+struct vec4
+{
+	enum { Size = 4 };
+
+	vec4() {}
+	explicit vec4(float s): x(s), y(s), z(s), w(s) {}
+	vec4(float x_, float y_, float z_, float w_): x(x_), y(y_), z(z_), w(w_) {}
+	vec4(const vec2& xy, float z_, float w_): x(xy.x), y(xy.y), z(z_), w(w_) {}
+	vec4(const vec2& xy, const vec2& zw): x(xy.x), y(xy.y), z(zw.x), w(zw.y) {}
+	vec4(const vec3& xyz, float w_): x(xyz.x), y(xyz.y), z(xyz.z), w(w_) {}
+
+	float& operator[](size_t i) { return (&x)[i]; }
+	const float& operator[](size_t i) const { return (&x)[i]; }
+
+	float x, y, z, w;
+};
+
+inline float abs(float x) { return std::fabs(x); }
+inline float sign(float x) { return x > 0.0f ? 1.0f : (x < 0.0f ? -1.0f : 0.0f); }
+inline float fract(float x) { return x - std::floor(x); }
+inline float mod(float x, float y) { return x - y * std::floor(x / y); }
+inline float min(float x, float y) { return y < x ? y : x; }
+inline float max(float x, float y) { return x < y ? y : x; }
+inline float clamp(float x, float minVal, float maxVal) { return min(max(x, minVal), maxVal); }
+inline float mix(float x, float y, float a) { return x * (1.0f - a) + y * a; }
+inline float step(float edge, float x) { return x < edge ? 0.0f : 1.0f; }
+inline float smoothstep(float edge0, float edge1, float x)
+{
+	float t = clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+	return t * t * (3.0f - 2.0f * t);
+}
+inline float radians(float degrees) { return degrees * 0.017453292519943295f; }
+inline float degrees(float radians) { return radians * 57.295779513082323f; }
+inline float atan(float y, float x) { return std::atan2(y, x); }
+inline float inversesqrt(float x) { return 1.0f / std::sqrt(x); }
+inline float dot(float x, float y) { return x * y; }
+inline float length(float x) { return std::fabs(x); }
+
+// Component-wise operations, defined the same way for every vector type
+#define GRAINR_GLSL_COMPONENT_WISE(TYPE, EXPR) \
+	TYPE result; \
+	for(size_t i = 0; i < TYPE::Size; ++i) { result[i] = (EXPR); } \
+	return result;
+
+#define GRAINR_GLSL_DEFINE_VEC_FUNCTIONS(TYPE) \
+	inline TYPE operator-(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, -a[i]) } \
+	inline TYPE operator+(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] + b[i]) } \
+	inline TYPE operator-(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] - b[i]) } \
+	inline TYPE operator*(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] * b[i]) } \
+	inline TYPE operator/(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] / b[i]) } \
+	inline TYPE operator+(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] + b) } \
+	inline TYPE operator-(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] - b) } \
+	inline TYPE operator*(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] * b) } \
+	inline TYPE operator/(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a[i] / b) } \
+	inline TYPE operator+(float a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a + b[i]) } \
+	inline TYPE operator-(float a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a - b[i]) } \
+	inline TYPE operator*(float a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a * b[i]) } \
+	inline TYPE operator/(float a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, a / b[i]) } \
+	inline TYPE& operator+=(TYPE& a, const TYPE& b) { return a = a + b; } \
+	inline TYPE& operator-=(TYPE& a, const TYPE& b) { return a = a - b; } \
+	inline TYPE& operator*=(TYPE& a, const TYPE& b) { return a = a * b; } \
+	inline TYPE& operator/=(TYPE& a, const TYPE& b) { return a = a / b; } \
+	inline TYPE& operator+=(TYPE& a, float b) { return a = a + b; } \
+	inline TYPE& operator-=(TYPE& a, float b) { return a = a - b; } \
+	inline TYPE& operator*=(TYPE& a, float b) { return a = a * b; } \
+	inline TYPE& operator/=(TYPE& a, float b) { return a = a / b; } \
+	inline bool operator==(const TYPE& a, const TYPE& b) \
+	{ \
+		for(size_t i = 0; i < TYPE::Size; ++i) { if(a[i] != b[i]) { return false; } } \
+		return true; \
+	} \
+	inline bool operator!=(const TYPE& a, const TYPE& b) { return !(a == b); } \
+	inline TYPE abs(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, abs(a[i])) } \
+	inline TYPE sign(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, sign(a[i])) } \
+	inline TYPE floor(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, std::floor(a[i])) } \
+	inline TYPE ceil(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, std::ceil(a[i])) } \
+	inline TYPE fract(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, fract(a[i])) } \
+	inline TYPE sin(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, std::sin(a[i])) } \
+	inline TYPE cos(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, std::cos(a[i])) } \
+	inline TYPE sqrt(const TYPE& a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, std::sqrt(a[i])) } \
+	inline TYPE mod(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, mod(a[i], b)) } \
+	inline TYPE mod(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, mod(a[i], b[i])) } \
+	inline TYPE min(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, min(a[i], b)) } \
+	inline TYPE min(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, min(a[i], b[i])) } \
+	inline TYPE max(const TYPE& a, float b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, max(a[i], b)) } \
+	inline TYPE max(const TYPE& a, const TYPE& b) { GRAINR_GLSL_COMPONENT_WISE(TYPE, max(a[i], b[i])) } \
+	inline TYPE clamp(const TYPE& x, float minVal, float maxVal) \
+	{ GRAINR_GLSL_COMPONENT_WISE(TYPE, clamp(x[i], minVal, maxVal)) } \
+	inline TYPE clamp(const TYPE& x, const TYPE& minVal, const TYPE& maxVal) \
+	{ GRAINR_GLSL_COMPONENT_WISE(TYPE, clamp(x[i], minVal[i], maxVal[i])) } \
+	inline TYPE mix(const TYPE& x, const TYPE& y, float a) { GRAINR_GLSL_COMPONENT_WISE(TYPE, mix(x[i], y[i], a)) } \
+	inline TYPE mix(const TYPE& x, const TYPE& y, const TYPE& a) \
+	{ GRAINR_GLSL_COMPONENT_WISE(TYPE, mix(x[i], y[i], a[i])) } \
+	inline TYPE step(float edge, const TYPE& x) { GRAINR_GLSL_COMPONENT_WISE(TYPE, step(edge, x[i])) } \
+	inline TYPE step(const TYPE& edge, const TYPE& x) { GRAINR_GLSL_COMPONENT_WISE(TYPE, step(edge[i], x[i])) } \
+	inline float dot(const TYPE& a, const TYPE& b) \
+	{ \
+		float result = 0.0f; \
+		for(size_t i = 0; i < TYPE::Size; ++i) { result += a[i] * b[i]; } \
+		return result; \
+	} \
+	inline float length(const TYPE& a) { return std::sqrt(dot(a, a)); } \
+	inline float distance(const TYPE& a, const TYPE& b) { return length(a - b); } \
+	inline TYPE normalize(const TYPE& a) { return a / length(a); } \
+	inline TYPE reflect(const TYPE& i, const TYPE& n) { return i - 2.0f * dot(n, i) * n; } \
+	inline TYPE faceforward(const TYPE& n, const TYPE& i, const TYPE& nref) \
+	{ return dot(nref, i) < 0.0f ? n : -n; }
+
+GRAINR_GLSL_DEFINE_VEC_FUNCTIONS(vec2)
+GRAINR_GLSL_DEFINE_VEC_FUNCTIONS(vec3)
+GRAINR_GLSL_DEFINE_VEC_FUNCTIONS(vec4)
+
+#undef GRAINR_GLSL_DEFINE_VEC_FUNCTIONS
+#undef GRAINR_GLSL_COMPONENT_WISE
+
+inline vec3 cross(const vec3& a, const vec3& b)
+{
+	return vec3(
+		a.y * b.z - a.z * b.y,
+		a.z * b.x - a.x * b.z,
+		a.x * b.y - a.y * b.x
+	);
+}
+
+}
+
+}
+
+// Brings GLSL's names into the current namespace. Using-declarations are needed
+// (instead of a using-directive) so that they hide the C library's overloads.
+#define GRAINR_GLSL_IMPORT \
+	using grainr::glsl::vec2; \
+	using grainr::glsl::vec3; \
+	using grainr::glsl::vec4; \
+	using grainr::glsl::sin; \
+	using grainr::glsl::cos; \
+	using grainr::glsl::tan; \
+	using grainr::glsl::asin; \
+	using grainr::glsl::acos; \
+	using grainr::glsl::atan; \
+	using grainr::glsl::exp; \
+	using grainr::glsl::log; \
+	using grainr::glsl::sqrt; \
+	using grainr::glsl::inversesqrt; \
+	using grainr::glsl::pow; \
+	using grainr::glsl::abs; \
+	using grainr::glsl::sign; \
+	using grainr::glsl::floor; \
+	using grainr::glsl::ceil; \
+	using grainr::glsl::fract; \
+	using grainr::glsl::mod; \
+	using grainr::glsl::min; \
+	using grainr::glsl::max; \
+	using grainr::glsl::clamp; \
+	using grainr::glsl::mix; \
+	using grainr::glsl::step; \
+	using grainr::glsl::smoothstep; \
+	using grainr::glsl::radians; \
+	using grainr::glsl::degrees; \
+	using grainr::glsl::dot; \
+	using grainr::glsl::length; \
+	using grainr::glsl::distance; \
+	using grainr::glsl::normalize; \
+	using grainr::glsl::reflect; \
+	using grainr::glsl::faceforward; \
+	using grainr::glsl::cross;
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef GRAINR_CPU_MODULE_HPP
+#define GRAINR_CPU_MODULE_HPP
+
+#include <cstddef>
+#include "CpuMath.hpp"
+
+// Hint that iterations of a kernel's loop are independent so that the compiler
+// can vectorize it over the SoA streams
+#if defined(__GNUC__) && !defined(__clang__)
+#	define GRAINR_CPU_VECTORIZE _Pragma("GCC ivdep")
+#elif defined(__clang__)
+#	define GRAINR_CPU_VECTORIZE _Pragma("clang loop vectorize(enable)")
+#else
+#	define GRAINR_CPU_VECTORIZE
+#endif
+
+namespace grainr
+{
+
+// Mirrors the random number generator in grainc's builtins.glsl bit for bit,
+// unsigned int is 32 bits wide like a GLSL uint. Numbers come out in call
+// order but C++ doesn't specify the order in which the arguments of a call
+// are evaluated, a script draws into variables to get the same particles on
+// both backends.
+class CpuRandom
+{
+public:
+	// Seeding is a few multiplies, it is done right away so that next()
+	// has no branch and kernel loops vectorize
+	CpuRandom(size_t x, size_t y, unsigned int frame, unsigned int stream)
+	{
+		mSeed[0] = (unsigned int)x;
+		mSeed[1] = (unsigned int)y;
+		mSeed[2] = frame;
+		mSeed[3] = stream;
+		pcg4d(mSeed);
+		mSeed[3] = 0;
+	}
+
+	// FNV-1a of the section name of a modifier, e.g. "rain.emitter"
+	static unsigned int hashName(const char* name, unsigned int hash = 2166136261u)
+	{
+		for(; *name != '\0'; ++name)
+		{
+			hash = (hash ^ (unsigned char)*name) * 16777619u;
+		}
+		return hash;
+	}
+
+	// Each modifier of a system draws its own numbers, even in the same frame
+	static unsigned int stream(unsigned int nameHash, unsigned int systemSeed)
+	{
+		return nameHash ^ systemSeed * 2654435761u;
+	}
+
+	float next()
+	{
+		unsigned int bits[4] = { mSeed[0], mSeed[1], mSeed[2], mSeed[3] };
+		pcg4d(bits);
+		++mSeed[3];
+		return (float)(bits[0] >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	static void pcg4d(unsigned int* v)
+	{
+		for(size_t i = 0; i < 4; ++i) { v[i] = v[i] * 1664525u + 1013904223u; }
+		v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+		for(size_t i = 0; i < 4; ++i) { v[i] ^= v[i] >> 16; }
+		v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+	}
+
+	// key of the particle's stream in the first 3 words, draws in the last
+	unsigned int mSeed[4];
+};
+
+// Everything below is referenced by kernels generated by grainc (-k option)
+
+struct CpuKernelArgs
+{
+	float* const* mStreams;
+	size_t mBegin;
+	size_t mEnd;
+	size_t mWidth;
+	unsigned int mFrame;
+	unsigned int mStream;
+	float mDt;
+	float mChance;
+	const void* mParams;
+};
+
+typedef void (*CpuKernelFn)(const CpuKernelArgs& args);
+
+namespace CpuKernelType
+{
+	enum Enum
+	{
+		Emitter,
+		Affector
+	};
+}
+
+struct CpuParam
+{
+	const char* mName;
+	size_t mOffset;
+	size_t mSize;
+};
+
+struct CpuKernel
+{
+	const char* mName;
+	CpuKernelType::Enum mType;
+	size_t mParamsSize;
+	const CpuParam* mParams;
+	CpuKernelFn mRun;
+};
+
+struct CpuAttribute
+{
+	const char* mName;
+	size_t mOffset;
+	size_t mSize;
+};
+
+struct CpuModule
+{
+	size_t mNumStreams;
+	const CpuAttribute* mAttributes;
+	const CpuKernel* mKernels;
+};
+
+}
+
+#endif
@@ -0,0 +1,257 @@
+#include "CpuParticleSystem.hpp"
+#include "CpuThreadPool.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace grainr
+{
+
+namespace
+{
+
+// Streams are padded and aligned to a whole number of AVX registers
+const size_t gStreamAlignment = 8;
+
+// A block's streams should fit in a typical per-core L2 cache
+const size_t gBlockBytes = 256 * 1024;
+const size_t gMinBlockSize = 1024;
+
+struct BlockTask
+{
+	CpuKernelArgs mArgs;
+	CpuKernelFn mRun;
+};
+
+void runBlock(void* userData, size_t begin, size_t end)
+{
+	const BlockTask& task = *static_cast<const BlockTask*>(userData);
+	CpuKernelArgs args = task.mArgs;
+	args.mBegin = begin;
+	args.mEnd = end;
+	task.mRun(args);
+}
+
+}
+
+CpuParticleSystem* CpuParticleSystem::create(
+	const CpuModule& module,
+	size_t width,
+	size_t height,
+	CpuThreadPool* threadPool
+)
+{
+	return new CpuParticleSystem(module, width, height, threadPool);
+}
+
+CpuParticleSystem::CpuParticleSystem(
+	const CpuModule& module,
+	size_t width,
+	size_t height,
+	CpuThreadPool* threadPool
+)
+	:mModule(module)
+	,mThreadPool(threadPool)
+	,mWidth(width)
+	,mHeight(height)
+	,mFrame(0)
+	,mSeed(0)
+	,mDt(0.0f)
+{
+	size_t capacity = width * height;
+	size_t stride = (capacity + gStreamAlignment - 1) / gStreamAlignment * gStreamAlignment;
+	mStorage = new float[module.mNumStreams * stride + gStreamAlignment];
+
+	size_t alignmentBytes = gStreamAlignment * sizeof(float);
+	size_t misalignment = (size_t)mStorage % alignmentBytes;
+	float* base = mStorage + (misalignment == 0 ? 0 : (alignmentBytes - misalignment) / sizeof(float));
+
+	// same initial state as the textures of ParticleSystem
+	std::fill_n(base, module.mNumStreams * stride, -20.0f);
+	for(size_t i = 0; i < module.mNumStreams; ++i)
+	{
+		mStreams.push_back(base + i * stride);
+	}
+
+	// Blocks start on an aligned boundary so that they never share a cache line
+	size_t streamsBytes = (module.mNumStreams == 0 ? 1 : module.mNumStreams) * sizeof(float);
+	mBlockSize = std::max(gBlockBytes / streamsBytes, gMinBlockSize) / gStreamAlignment * gStreamAlignment;
+}
+
+CpuParticleSystem::~CpuParticleSystem()
+{
+	delete[] mStorage;
+}
+
+void CpuParticleSystem::destroy()
+{
+	delete this;
+}
+
+const CpuKernel* CpuParticleSystem::findKernel(const char* name, CpuKernelType::Enum type) const
+{
+	for(const CpuKernel* kernel = mModule.mKernels; kernel->mName != NULL; ++kernel)
+	{
+		if(kernel->mType == type && strcmp(kernel->mName, name) == 0)
+		{
+			return kernel;
+		}
+	}
+
+	return NULL;
+}
+
+CpuEmitter* CpuParticleSystem::createEmitter(const char* name, std::ostream& err)
+{
+	const CpuKernel* kernel = findKernel(name, CpuKernelType::Emitter);
+	if(kernel == NULL)
+	{
+		err << "Cannot find emitter '" << name << "'" << endl;
+		return NULL;
+	}
+
+	CpuEmitter* result = new CpuEmitter;
+	result->mKernel = kernel;
+	result->mNameHash = CpuRandom::hashName(".emitter", CpuRandom::hashName(name));
+	result->mSystem = this;
+	result->mParams.resize(kernel->mParamsSize, 0);
+	return result;
+}
+
+CpuAffector* CpuParticleSystem::createAffector(const char* name, std::ostream& err)
+{
+	const CpuKernel* kernel = findKernel(name, CpuKernelType::Affector);
+	if(kernel == NULL)
+	{
+		err << "Cannot find affector '" << name << "'" << endl;
+		return NULL;
+	}
+
+	CpuAffector* result = new CpuAffector;
+	result->mKernel = kernel;
+	result->mNameHash = CpuRandom::hashName(".affector", CpuRandom::hashName(name));
+	result->mSystem = this;
+	result->mParams.resize(kernel->mParamsSize, 0);
+	return result;
+}
+
+void CpuParticleSystem::update(float dt)
+{
+	++mFrame;
+	mDt = dt;
+}
+
+void CpuParticleSystem::setSeed(unsigned int seed)
+{
+	mSeed = seed;
+}
+
+size_t CpuParticleSystem::getCapacity() const
+{
+	return mWidth * mHeight;
+}
+
+const float* CpuParticleSystem::getStream(const char* attribute, size_t component) const
+{
+	for(const CpuAttribute* attr = mModule.mAttributes; attr->mName != NULL; ++attr)
+	{
+		if(strcmp(attr->mName, attribute) == 0)
+		{
+			return component < attr->mSize ? mStreams[attr->mOffset + component] : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+CpuProgram::CpuProgram()
+	:mNameHash(0)
+	,mChance(0.0f)
+{}
+
+CpuProgram::~CpuProgram()
+{}
+
+void CpuProgram::destroy()
+{
+	delete this;
+}
+
+void CpuProgram::setParam(const char* name, const float* value, size_t size)
+{
+	for(const CpuParam* param = mKernel->mParams; param->mName != NULL; ++param)
+	{
+		if(param->mSize == size && strcmp(param->mName, name) == 0)
+		{
+			memcpy(&mParams[param->mOffset], value, size * sizeof(float));
+			return;
+		}
+	}
+}
+
+void CpuProgram::setParamFloat(const char* name, float value)
+{
+	setParam(name, &value, 1);
+}
+
+void CpuProgram::setParamVec2(const char* name, const float* vec)
+{
+	setParam(name, vec, 2);
+}
+
+void CpuProgram::setParamVec3(const char* name, const float* vec)
+{
+	setParam(name, vec, 3);
+}
+
+void CpuProgram::setParamVec4(const char* name, const float* vec)
+{
+	setParam(name, vec, 4);
+}
+
+void CpuProgram::run()
+{
+	CpuKernelArgs args;
+	args.mStreams = mSystem->mStreams.data();
+	args.mBegin = 0;
+	args.mEnd = mSystem->getCapacity();
+	args.mWidth = mSystem->mWidth;
+	args.mFrame = mSystem->mFrame;
+	args.mStream = CpuRandom::stream(mNameHash, mSystem->mSeed);
+	args.mDt = mSystem->mDt;
+	args.mChance = mChance;
+	args.mParams = mParams.data();
+
+	if(mSystem->mThreadPool != NULL)
+	{
+		BlockTask task;
+		task.mArgs = args;
+		task.mRun = mKernel->mRun;
+		mSystem->mThreadPool->parallelFor(args.mEnd, mSystem->mBlockSize, &runBlock, &task);
+	}
+	else
+	{
+		mKernel->mRun(args);
+	}
+}
+
+CpuEmitter::CpuEmitter()
+{}
+
+CpuEmitter::~CpuEmitter()
+{}
+
+void CpuEmitter::setRate(float rate)
+{
+	mChance = rate;
+}
+
+CpuAffector::CpuAffector()
+{}
+
+CpuAffector::~CpuAffector()
+{}
+
+}
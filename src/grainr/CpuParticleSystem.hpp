@@ -0,0 +1,105 @@
+#ifndef GRAINR_CPU_PARTICLE_SYSTEM_HPP
+#define GRAINR_CPU_PARTICLE_SYSTEM_HPP
+
+#include <iosfwd>
+#include <vector>
+#include "CpuModule.hpp"
+
+namespace grainr
+{
+
+class CpuEmitter;
+class CpuAffector;
+class CpuThreadPool;
+
+// Runs kernels generated by grainc on the CPU. Attributes are stored as one
+// float stream per component (SoA) and no OpenGL context is needed.
+// When a thread pool is given, particles are processed in cache-sized blocks
+// spread over its threads.
+class CpuParticleSystem
+{
+	friend class CpuProgram;
+public:
+	static CpuParticleSystem* create(
+		const CpuModule& module,
+		size_t width,
+		size_t height,
+		CpuThreadPool* threadPool = NULL
+	);
+	void destroy();
+
+	CpuEmitter* createEmitter(const char* name, std::ostream& err);
+	CpuAffector* createAffector(const char* name, std::ostream& err);
+	void update(float dt);
+	// Keys the random numbers of the system along with the frame, systems
+	// with the same seed draw the same numbers
+	void setSeed(unsigned int seed);
+
+	size_t getCapacity() const;
+	const float* getStream(const char* attribute, size_t component) const;
+
+private:
+	CpuParticleSystem(const CpuModule& module, size_t width, size_t height, CpuThreadPool* threadPool);
+	~CpuParticleSystem();
+	CpuParticleSystem(CpuParticleSystem& other);
+
+	const CpuKernel* findKernel(const char* name, CpuKernelType::Enum type) const;
+
+	const CpuModule& mModule;
+	std::vector<float*> mStreams;
+	float* mStorage;
+	CpuThreadPool* mThreadPool;
+	size_t mBlockSize;
+	size_t mWidth;
+	size_t mHeight;
+	unsigned int mFrame;
+	unsigned int mSeed;
+	float mDt;
+};
+
+class CpuProgram
+{
+	friend class CpuParticleSystem;
+public:
+	void setParamFloat(const char* name, float value);
+	void setParamVec2(const char* name, const float* vec);
+	void setParamVec3(const char* name, const float* vec);
+	void setParamVec4(const char* name, const float* vec);
+	void run();
+	void destroy();
+
+protected:
+	CpuProgram();
+	virtual ~CpuProgram();
+
+	void setParam(const char* name, const float* value, size_t size);
+
+	const CpuKernel* mKernel;
+	CpuParticleSystem* mSystem;
+	std::vector<char> mParams;
+	unsigned int mNameHash;
+	float mChance;
+};
+
+class CpuEmitter: public CpuProgram
+{
+	friend class CpuParticleSystem;
+public:
+	void setRate(float rate);
+
+private:
+	CpuEmitter();
+	virtual ~CpuEmitter();
+};
+
+class CpuAffector: public CpuProgram
+{
+	friend class CpuParticleSystem;
+private:
+	CpuAffector();
+	virtual ~CpuAffector();
+};
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include "CpuThreadPool.hpp"
+
+namespace grainr
+{
+
+CpuThreadPool* CpuThreadPool::create(size_t numThreads)
+{
+	if(numThreads == 0)
+	{
+		numThreads = std::thread::hardware_concurrency();
+	}
+
+	return new CpuThreadPool(numThreads == 0 ? 1 : numThreads);
+}
+
+CpuThreadPool::CpuThreadPool(size_t numThreads)
+	:mNumPendingBlocks(0)
+	,mGeneration(0)
+	,mQuit(false)
+{
+	// Queue 0 belongs to the thread calling parallelFor
+	for(size_t i = 0; i < numThreads; ++i)
+	{
+		mQueues.push_back(new Queue);
+	}
+
+	for(size_t i = 1; i < numThreads; ++i)
+	{
+		mThreads.push_back(std::thread(&CpuThreadPool::workerLoop, this, i));
+	}
+}
+
+CpuThreadPool::~CpuThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWakeUp.notify_all();
+
+	for(std::vector<std::thread>::iterator itr = mThreads.begin(); itr != mThreads.end(); ++itr)
+	{
+		itr->join();
+	}
+
+	for(std::vector<Queue*>::iterator itr = mQueues.begin(); itr != mQueues.end(); ++itr)
+	{
+		delete *itr;
+	}
+}
+
+void CpuThreadPool::destroy()
+{
+	delete this;
+}
+
+size_t CpuThreadPool::getNumThreads() const
+{
+	return mQueues.size();
+}
+
+void CpuThreadPool::parallelFor(size_t count, size_t blockSize, TaskFn fn, void* userData)
+{
+	if(count == 0) { return; }
+	if(blockSize == 0) { blockSize = count; }
+
+	size_t numBlocks = (count + blockSize - 1) / blockSize;
+	size_t numQueues = mQueues.size();
+	mNumPendingBlocks = numBlocks;
+
+	// Deal contiguous runs of blocks to each queue so that a thread mostly
+	// works on neighbouring memory, stealing takes care of the imbalance
+	for(size_t i = 0; i < numQueues; ++i)
+	{
+		size_t firstBlock = numBlocks * i / numQueues;
+		size_t lastBlock = numBlocks * (i + 1) / numQueues;
+
+		Queue& queue = *mQueues[i];
+		std::lock_guard<std::mutex> lock(queue.mMutex);
+		for(size_t j = firstBlock; j < lastBlock; ++j)
+		{
+			Block block;
+			block.mFn = fn;
+			block.mUserData = userData;
+			block.mBegin = j * blockSize;
+			block.mEnd = block.mBegin + blockSize < count ? block.mBegin + blockSize : count;
+			queue.mBlocks.push_back(block);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		++mGeneration;
+	}
+	mWakeUp.notify_all();
+
+	runBlocks(0);
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(mNumPendingBlocks != 0)
+	{
+		mDone.wait(lock);
+	}
+}
+
+void CpuThreadPool::workerLoop(size_t index)
+{
+	size_t generation = 0;
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			while(!mQuit && generation == mGeneration)
+			{
+				mWakeUp.wait(lock);
+			}
+
+			if(mQuit) { return; }
+			generation = mGeneration;
+		}
+
+		runBlocks(index);
+	}
+}
+
+void CpuThreadPool::runBlocks(size_t index)
+{
+	Block block;
+	while(pop(index, block) || steal(index, block))
+	{
+		block.mFn(block.mUserData, block.mBegin, block.mEnd);
+
+		if(--mNumPendingBlocks == 0)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mDone.notify_all();
+		}
+	}
+}
+
+bool CpuThreadPool::pop(size_t index, Block& block)
+{
+	Queue& queue = *mQueues[index];
+	std::lock_guard<std::mutex> lock(queue.mMutex);
+	if(queue.mBlocks.empty()) { return false; }
+
+	block = queue.mBlocks.front();
+	queue.mBlocks.pop_front();
+	return true;
+}
+
+bool CpuThreadPool::steal(size_t index, Block& block)
+{
+	// Take from the far end of a victim's queue to stay out of its way
+	size_t numQueues = mQueues.size();
+	for(size_t i = 1; i < numQueues; ++i)
+	{
+		Queue& queue = *mQueues[(index + i) % numQueues];
+		std::lock_guard<std::mutex> lock(queue.mMutex);
+		if(queue.mBlocks.empty()) { continue; }
+
+		block = queue.mBlocks.back();
+		queue.mBlocks.pop_back();
+		return true;
+	}
+
+	return false;
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef GRAINR_CPU_THREAD_POOL_HPP
+#define GRAINR_CPU_THREAD_POOL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace grainr
+{
+
+// Splits a range into blocks which are spread over per-thread queues. A thread
+// which runs out of blocks steals from the others.
+class CpuThreadPool
+{
+public:
+	typedef void (*TaskFn)(void* userData, size_t begin, size_t end);
+
+	// numThreads = 0 uses every hardware thread
+	static CpuThreadPool* create(size_t numThreads = 0);
+	void destroy();
+
+	size_t getNumThreads() const;
+
+	// Runs fn over [0, count) in blocks of blockSize, the calling thread helps
+	// and only returns once every block is done
+	void parallelFor(size_t count, size_t blockSize, TaskFn fn, void* userData);
+
+private:
+	struct Block
+	{
+		TaskFn mFn;
+		void* mUserData;
+		size_t mBegin;
+		size_t mEnd;
+	};
+
+	struct Queue
+	{
+		std::mutex mMutex;
+		std::deque<Block> mBlocks;
+	};
+
+	CpuThreadPool(size_t numThreads);
+	~CpuThreadPool();
+	CpuThreadPool(CpuThreadPool& other);
+
+	void workerLoop(size_t index);
+	void runBlocks(size_t index);
+	bool pop(size_t index, Block& block);
+	bool steal(size_t index, Block& block);
+
+	std::vector<Queue*> mQueues;
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mWakeUp;
+	std::condition_variable mDone;
+	std::atomic<size_t> mNumPendingBlocks;
+	size_t mGeneration;
+	bool mQuit;
+};
+
+}
+
+#endif
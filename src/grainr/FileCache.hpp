@@ -0,0 +1,86 @@
+#ifndef GRAINR_FILE_CACHE_HPP
+#define GRAINR_FILE_CACHE_HPP
+
+// Header only, shared by the program cache of grainr and the result cache of
+// grainc. Entries are files named after the hash of what produced them.
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace grainr
+{
+
+// 64 bit FNV-1a
+class Hash
+{
+public:
+	Hash()
+		:mValue(14695981039346656037ULL)
+	{}
+
+	void add(const char* data, size_t size)
+	{
+		for(size_t i = 0; i < size; ++i)
+		{
+			mValue ^= (unsigned char)data[i];
+			mValue *= 1099511628211ULL;
+		}
+	}
+
+	void add(const std::string& str)
+	{
+		// the terminator separates consecutive strings
+		add(str.c_str(), str.size() + 1);
+	}
+
+	std::string hex() const
+	{
+		std::stringstream ss;
+		ss << std::hex;
+		ss.width(16);
+		ss.fill('0');
+		ss << mValue;
+		return ss.str();
+	}
+
+private:
+	unsigned long long mValue;
+};
+
+// Creates an empty temporary file next to filename for an entry to be written
+// to, its name is unique across threads and processes sharing the directory
+inline bool createTempFile(const std::string& filename, std::string& tempFilename)
+{
+	std::string pattern = filename + ".tmpXXXXXX";
+	std::vector<char> name(pattern.begin(), pattern.end());
+	name.push_back('\0');
+	int fd = mkstemp(&name[0]);
+	if(fd < 0) { return false; }
+
+	// mkstemp leaves the file to its owner only, entries stay readable as
+	// they were when written directly
+	fchmod(fd, 0644);
+	close(fd);
+	tempFilename = &name[0];
+	return true;
+}
+
+// Moves an entry written completely to tempFilename in place. rename replaces
+// an existing entry atomically, readers see either one or the other, never a
+// partial file or none at all.
+inline void replaceFile(const std::string& tempFilename, const std::string& filename)
+{
+	if(std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+	{
+		std::remove(tempFilename.c_str());
+	}
+}
+
+}
+
+#endif
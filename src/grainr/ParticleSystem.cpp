@@ -1,5 +1,6 @@
 #include <GL/glew.h>
 #include <iostream>
+#include <sstream>
 #include <algorithm>
 #include "ParticleSystem.hpp"
 #include "SystemDefinition.hpp"
@@ -15,7 +16,7 @@ namespace grainr
 namespace
 {
 
-GLuint createTexture(GLsizei width, GLsizei height, void* data)
+GLuint createTexture(GLenum internalFormat, GLsizei width, GLsizei height, void* data)
 {
 	GLuint handle;
 	glGenTextures(1, &handle);
@@ -24,56 +25,239 @@ GLuint createTexture(GLsizei width, GLsizei height, void* data)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, data);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_FLOAT, data);
 	return handle;
 }
 
-GLuint findShader(const char* name, const char* ext, const map<string, GLuint>& shaders)
+// Uploads outside of passes go through the active unit, the caller's
+// texture is bound back on it afterwards
+class TextureBinding
 {
-	string fullName(name);
-	fullName += '.';
-	fullName += ext;
-	map<string, GLuint>::const_iterator itr = shaders.find(fullName);
-	return itr == shaders.end() ? 0 : itr->second;
+public:
+	TextureBinding()
+	{
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &mPrevious);
+	}
+
+	~TextureBinding()
+	{
+		glBindTexture(GL_TEXTURE_2D, mPrevious);
+	}
+
+private:
+	GLint mPrevious;
+};
+
+// Bindings of the buffers declared by the compute kernels of grainc, the
+// compaction shader reads the storage buffer too
+const GLuint gStorageBinding = 2;
+const GLuint gEmissionBinding = 3;
+
+// Section suffix and origin of the variants compiled for each backend
+const char* variantSuffix(Backend::Enum backend)
+{
+	switch(backend)
+	{
+		case Backend::TransformFeedback:
+			return ".feedback";
+		case Backend::Compute:
+			return ".compute";
+		default:
+			return "";
+	}
+}
+
+const char* variantOption(Backend::Enum backend)
+{
+	return backend == Backend::TransformFeedback ? "transform feedback (grainc -f)" : "compute (grainc -c)";
 }
 
 }
 
-ParticleSystem::ParticleSystem(const SystemDefinition* def, size_t width, size_t height)
-	:mFlipFlag(true)
+ParticleSystem::ParticleSystem(const SystemDefinition* def, size_t width, size_t height, Backend::Enum backend)
+	:mFbo(0)
 	,mTexWidth(width)
 	,mTexHeight(height)
+	,mCurrentBuffer(0)
+	,mStorageBuffer(0)
+	,mStorageTexture(0)
+	,mEmitCounter(0)
+	,mBackend(backend)
+	,mSeed(0)
+	,mFrameOffset(0u - def->mContext->mFrame)
+	,mInterpolation(false)
+	,mPreviousFrame(0)
+	,mPreviousBuffer(0)
+	,mPreviousTexture(0)
+	,mCopyFbo(0)
+	,mPreviousWeightLocation(-1)
+	,mAtlas(width, height)
+	,mRegionTexture(0)
 	,mDef(def)
+{
+	mBuffers[0] = mBuffers[1] = 0;
+	mBufferArrays[0] = mBufferArrays[1] = 0;
+	switch(backend)
+	{
+		case Backend::Fragment:
+			createTextures();
+			break;
+		case Backend::TransformFeedback:
+			createBuffers();
+			break;
+		case Backend::Compute:
+			createStorage();
+			break;
+	}
+
+	// list of particles to render, read by vertex shaders through a buffer texture
+	glGenBuffers(1, &mIndexBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, mIndexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, width * height * sizeof(GLint), NULL, GL_DYNAMIC_DRAW);
+	glGenTextures(1, &mIndexTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, mIndexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, mIndexBuffer);
+
+	// dead slots to fill with exactly emitted particles
+	glGenBuffers(1, &mFreeBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, mFreeBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, width * height * sizeof(GLint), NULL, GL_DYNAMIC_DRAW);
+	glGenTextures(1, &mFreeTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, mFreeTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, mFreeBuffer);
+
+	mDrawCommand = 0;
+	if(def->mContext->mCompactProgram != 0)
+	{
+		glGenBuffers(1, &mDrawCommand);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mDrawCommand);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, 4 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	// region of each particle, -1 outside of any region
+	if(def->mAtlas)
+	{
+		vector<GLint> regions(width * height, -1);
+		glGenTextures(1, &mRegionTexture);
+		glBindTexture(GL_TEXTURE_2D, mRegionTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32I, width, height, 0, GL_RED_INTEGER, GL_INT, regions.data());
+	}
+
+	mCompaction = Compaction::None;
+	resetIndices();
+	setCompaction(Compaction::Gpu);
+}
+
+void ParticleSystem::createTextures()
 {
 	glGenFramebuffers(1, &mFbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
 
-	float* data = new float[4 * width * height];
-	std::fill_n(data, 4 * width * height, -20.0f);
-	for(size_t i = 0; i < def->mNumTextures; ++i)
+	float* data = new float[4 * mTexWidth * mTexHeight];
+	std::fill_n(data, 4 * mTexWidth * mTexHeight, -20.0f);
+	for(size_t i = 0; i < mDef->mNumTextures; ++i)
 	{
-		GLuint evenTexture = createTexture(width, height, data);
-		GLenum evenTarget = GL_COLOR_ATTACHMENT0 + i;
-		glFramebufferTexture2D(GL_FRAMEBUFFER, evenTarget, GL_TEXTURE_2D, evenTexture, 0);
-		mEvenTargets.push_back(evenTarget);
-		mEvenTextures.push_back(evenTexture);
-
-		GLuint oddTexture = createTexture(width, height, data);
-		GLenum oddTarget = GL_COLOR_ATTACHMENT0 + def->mNumTextures + i;
-		glFramebufferTexture2D(GL_FRAMEBUFFER, oddTarget, GL_TEXTURE_2D, oddTexture, 0);
-		mOddTargets.push_back(oddTarget);
-		mOddTextures.push_back(oddTexture);
+		GLenum internalFormat = mDef->mTextureFormats[i];
+		mEvenTextures.push_back(createTexture(internalFormat, mTexWidth, mTexHeight, data));
+		mOddTextures.push_back(createTexture(internalFormat, mTexWidth, mTexHeight, data));
 	}
+	mOddCurrent.resize(mDef->mNumTextures, true);
 	delete[] data;
 
+	// textures are attached by the passes which write them
+	size_t numBuffers = std::min(mDef->mDrawBuffers, mDef->mNumTextures);
+	for(size_t i = 0; i < numBuffers; ++i)
+	{
+		mDrawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+	}
+	mAttachments.resize(numBuffers, 0);
+
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// A particle is a vertex made of the texels it would have in every texture,
+// always stored at full precision
+void ParticleSystem::createBuffers()
+{
+	size_t numFloats = 4 * mDef->mNumTextures * mTexWidth * mTexHeight;
+	vector<float> data(numFloats, -20.0f);
+	GLsizei stride = 4 * mDef->mNumTextures * sizeof(float);
+
+	for(size_t i = 0; i < mDef->mNumTextures; ++i)
+	{
+		mStreamLocations.push_back(streamLocation(i, mDef->mNumTextures));
+	}
+
+	glGenBuffers(2, mBuffers);
+	glGenVertexArrays(2, mBufferArrays);
+	for(size_t i = 0; i < 2; ++i)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, mBuffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, numFloats * sizeof(float), data.data(), GL_DYNAMIC_COPY);
+
+		glBindVertexArray(mBufferArrays[i]);
+		for(size_t j = 0; j < mDef->mNumTextures; ++j)
+		{
+			glEnableVertexAttribArray(mStreamLocations[j]);
+			glVertexAttribPointer(mStreamLocations[j], 4, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(4 * j * sizeof(float)));
+		}
+	}
+	glBindVertexArray(0);
+}
+
+void ParticleSystem::createStorage()
+{
+	size_t numFloats = 4 * mDef->mNumTextures * mTexWidth * mTexHeight;
+	vector<float> data(numFloats, -20.0f);
+
+	glGenBuffers(1, &mStorageBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mStorageBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numFloats * sizeof(float), data.data(), GL_DYNAMIC_COPY);
+
+	glGenTextures(1, &mStorageTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, mStorageTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, mStorageBuffer);
+
+	glGenBuffers(1, &mEmitCounter);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mEmitCounter);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void ParticleSystem::storageLayout(size_t slot, size_t& base, size_t& stride) const
+{
+	if(mDef->mStorageLayout == StorageLayout::Streams)
+	{
+		base = slot * mTexWidth * mTexHeight;
+		stride = 1;
+	}
+	else
+	{
+		base = slot;
+		stride = 4 * mDef->mNumTextures;
+	}
+}
+
 ParticleSystem::~ParticleSystem()
 {
 	glDeleteFramebuffers(1, &mFbo);
-	glDeleteTextures(mDef->mNumTextures, mEvenTextures.data());
-	glDeleteTextures(mDef->mNumTextures, mOddTextures.data());
+	glDeleteTextures(mEvenTextures.size(), mEvenTextures.data());
+	glDeleteTextures(mOddTextures.size(), mOddTextures.data());
+	glDeleteVertexArrays(2, mBufferArrays);
+	glDeleteBuffers(2, mBuffers);
+	glDeleteTextures(1, &mStorageTexture);
+	glDeleteBuffers(1, &mStorageBuffer);
+	glDeleteBuffers(1, &mEmitCounter);
+	glDeleteTextures(1, &mIndexTexture);
+	glDeleteBuffers(1, &mIndexBuffer);
+	glDeleteTextures(1, &mFreeTexture);
+	glDeleteBuffers(1, &mFreeBuffer);
+	glDeleteBuffers(1, &mDrawCommand);
+	glDeleteTextures(1, &mRegionTexture);
+	setInterpolation(false);
 }
 
 void ParticleSystem::destroy()
@@ -81,96 +265,771 @@ void ParticleSystem::destroy()
 	delete this;
 }
 
-Emitter* ParticleSystem::createEmitter(const char* name, std::ostream& err)
+Emitter* ParticleSystem::createEmitter(
+	const char* name,
+	std::ostream& err,
+	Emission::Enum emission
+)
 {
-	GLuint shader = findShader(name, "emitter", mDef->mShaders);
-	if(shader == 0)
+	bool isExact = emission == Emission::Exact;
+	string section = string(name) + (isExact ? ".emitter.exact" : ".emitter");
+	if(!mDef->hasSection(section))
 	{
 		err << "Cannot find emitter '" << name << "'" << endl;
 		return NULL;
 	}
 
-	GLuint prog = createProgram(mDef->mContext->mQuadVsh, shader, mDef->mNumTextures, err);
+	if(isExact && mDef->mAttributes.find("life") == mDef->mAttributes.end())
+	{
+		err << "Exact emission needs the attribute layout of the definition" << endl;
+		return NULL;
+	}
+
+	// particles are written in order by transform feedback, they can't be
+	// scattered to dead slots
+	if(isExact && mBackend == Backend::TransformFeedback)
+	{
+		err << "Exact emission is not supported by the transform feedback backend" << endl;
+		return NULL;
+	}
+
+	GLuint prog = linkModifier(section, err);
 	if(prog == 0) return NULL;
 
-	Emitter* result = new Emitter;
-	result->mHandle = prog;
-	result->mSystem = this;
+	Emitter* result = new Emitter(emission);
+	result->init(prog, this, string(name) + ".emitter");
+	if(isExact)
+	{
+		result->prepare();
+		glUniform1i(glGetUniformLocation(prog, "_gr_texWidth"), mTexWidth);
+		glUniform1i(glGetUniformLocation(prog, "_gr_texHeight"), mTexHeight);
+		glUniform1i(glGetUniformLocation(prog, "_gr_free"), mDef->mNumTextures);
+	}
 	return result;
 }
 
 Affector* ParticleSystem::createAffector(const char* name, std::ostream& err)
 {
-	GLuint shader = findShader(name, "affector", mDef->mShaders);
-	if(shader == 0)
+	string section = string(name) + ".affector";
+	if(!mDef->hasSection(section))
 	{
 		err << "Cannot find affector '" << name << "'" << endl;
 		return NULL;
 	}
 
-	GLuint prog = createProgram(mDef->mContext->mQuadVsh, shader, mDef->mNumTextures, err);
+	GLuint prog = linkModifier(section, err);
 	if(prog == 0) return NULL;
 
 	Affector* result = new Affector;
-	result->mHandle = prog;
-	result->mSystem = this;
+	result->init(prog, this, section);
+	return result;
+}
+
+Pipeline* ParticleSystem::createPipeline(const char* name, std::ostream& err)
+{
+	string section = string(name) + ".pipeline";
+	if(!mDef->hasSection(section))
+	{
+		err << "Cannot find pipeline '" << name << "'" << endl;
+		return NULL;
+	}
+
+	GLuint prog = linkModifier(section, err);
+	if(prog == 0) return NULL;
+
+	Pipeline* result = new Pipeline;
+	result->init(prog, this, section);
 	return result;
 }
 
 Renderer* ParticleSystem::createRenderer(const char* name, std::ostream& err)
 {
-	GLuint vsh = findShader(name, "vsh", mDef->mShaders);
-	GLuint fsh = findShader(name, "fsh", mDef->mShaders);
+	string vshSection = string(name) + ".vsh";
+	string fshSection = string(name) + ".fsh";
 
-	if(vsh == 0)
+	if(!mDef->hasSection(vshSection))
 	{
 		err << "Cannot find vertex shader '" << name << "'" << endl;
 		return NULL;
 	}
 
-	if(fsh == 0)
+	if(!mDef->hasSection(fshSection))
 	{
 		err << "Cannot find fragment shader '" << name << "'" << endl;
 		return NULL;
 	}
 
-	GLuint prog = createProgram(vsh, fsh, mDef->mNumTextures, err);
+	// other backends read particles with their own vertex shader
+	string variantSection = vshSection + variantSuffix(mBackend);
+	if(mBackend != Backend::Fragment && !mDef->hasSection(variantSection))
+	{
+		err << "Vertex shader '" << name << "' was not compiled for " << variantOption(mBackend) << endl;
+		return NULL;
+	}
+
+	GLuint prog = mDef->linkProgram(mBackend == Backend::Fragment ? fshSection : variantSection, err);
 	if(prog == 0) return NULL;
 
 	Renderer* result = new Renderer;
-	result->mHandle = prog;
-	result->mSystem = this;
+	result->init(prog, this, vshSection);
+	result->mPreviousWeightLocation = glGetUniformLocation(prog, "_gr_previousWeight");
 	result->prepare();
 	glUniform1i(glGetUniformLocation(prog, "_gr_texWidth"), mTexWidth);
 	glUniform1i(glGetUniformLocation(prog, "_gr_texHeight"), mTexHeight);
+	glUniform1i(glGetUniformLocation(prog, "_gr_indices"), mDef->mNumTextures);
+	glUniform1i(glGetUniformLocation(prog, "_gr_previousParticles"), mDef->mNumTextures + 1);
+	for(size_t i = 0; i < mDef->mNumTextures; ++i)
+	{
+		stringstream ss;
+		ss << "_gr_previousTex[" << i << ']';
+		glUniform1i(glGetUniformLocation(prog, ss.str().c_str()), mDef->mNumTextures + 1 + i);
+	}
+	glUniform1i(glGetUniformLocation(prog, "_gr_particles"), 0);
+	glUniform1i(glGetUniformLocation(prog, "_gr_numParticles"), mTexWidth * mTexHeight);
 	return result;
 }
 
 void ParticleSystem::render(GLenum primType, GLsizei count)
 {
-	vector<GLuint>& inputTexs = mFlipFlag ? mOddTextures : mEvenTextures;
+	if(mBackend == Backend::TransformFeedback)
+	{
+		GLsizei stride = 4 * mDef->mNumTextures * sizeof(float);
+		glBindBuffer(GL_ARRAY_BUFFER, mBuffers[mCurrentBuffer]);
+		for(size_t i = 0; i < mDef->mNumTextures; ++i)
+		{
+			glEnableVertexAttribArray(mStreamLocations[i]);
+			glVertexAttribPointer(mStreamLocations[i], 4, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(4 * i * sizeof(float)));
+			glVertexAttribDivisor(mStreamLocations[i], 1);
+		}
+		glDrawArraysInstanced(primType, 0, count, mTexWidth * mTexHeight);
+		return;
+	}
+
+	if(mBackend == Backend::Compute)
+	{
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_BUFFER, mStorageTexture);
+	}
+	else
+	{
+		for(size_t i = 0; i < mDef->mNumTextures; ++i)
+		{
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, currentTexture(i));
+		}
+	}
+	glActiveTexture(GL_TEXTURE0 + mDef->mNumTextures);
+	glBindTexture(GL_TEXTURE_BUFFER, mIndexTexture);
+
+	// the previous particles follow the index list
+	float previousWeight = 0.0f;
+	if(mInterpolation)
+	{
+		previousWeight = 1.0f - mDef->mContext->getInterpolation();
+		if(mBackend == Backend::Compute)
+		{
+			glActiveTexture(GL_TEXTURE0 + mDef->mNumTextures + 1);
+			glBindTexture(GL_TEXTURE_BUFFER, mPreviousTexture);
+		}
+		else
+		{
+			for(size_t i = 0; i < mDef->mNumTextures; ++i)
+			{
+				glActiveTexture(GL_TEXTURE0 + mDef->mNumTextures + 1 + i);
+				glBindTexture(GL_TEXTURE_2D, mPreviousTextures[i]);
+			}
+		}
+	}
+	glUniform1f(mPreviousWeightLocation, previousWeight);
+
+	switch(mCompaction)
+	{
+		case Compaction::None:
+			glDrawArraysInstanced(primType, 0, count, mTexWidth * mTexHeight);
+			break;
+		case Compaction::Cpu:
+			glDrawArraysInstanced(primType, 0, count, compactCpu());
+			break;
+		case Compaction::Gpu:
+			compactGpu(count);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mDrawCommand);
+			glDrawArraysIndirect(primType, 0);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			break;
+	}
+}
+
+bool ParticleSystem::setInterpolation(bool enabled)
+{
+	if(enabled && mBackend == Backend::TransformFeedback) { return false; }
+	if(enabled == mInterpolation) { return true; }
+
+	mInterpolation = enabled;
+	if(!enabled)
+	{
+		glDeleteTextures(mPreviousTextures.size(), mPreviousTextures.data());
+		glDeleteTextures(1, &mPreviousTexture);
+		glDeleteBuffers(1, &mPreviousBuffer);
+		glDeleteFramebuffers(1, &mCopyFbo);
+		mPreviousTextures.clear();
+		mPreviousTexture = 0;
+		mPreviousBuffer = 0;
+		mCopyFbo = 0;
+		return true;
+	}
+
+	if(mBackend == Backend::Compute)
+	{
+		size_t numFloats = 4 * mDef->mNumTextures * mTexWidth * mTexHeight;
+		glGenBuffers(1, &mPreviousBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, mPreviousBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, numFloats * sizeof(float), NULL, GL_DYNAMIC_COPY);
+
+		glGenTextures(1, &mPreviousTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, mPreviousTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, mPreviousBuffer);
+	}
+	else
+	{
+		TextureBinding binding;
+		for(size_t i = 0; i < mDef->mNumTextures; ++i)
+		{
+			mPreviousTextures.push_back(createTexture(mDef->mTextureFormats[i], mTexWidth, mTexHeight, NULL));
+		}
+		glGenFramebuffers(1, &mCopyFbo);
+	}
+
+	// the particles don't move until the next update
+	mPreviousFrame = getFrame() - 1;
+	keepPrevious();
+
+	return true;
+}
+
+void ParticleSystem::keepPrevious()
+{
+	if(!mInterpolation || mPreviousFrame == getFrame()) { return; }
+
+	mPreviousFrame = getFrame();
+	if(mBackend == Backend::Compute)
+	{
+		GLsizeiptr size = 4 * mDef->mNumTextures * mTexWidth * mTexHeight * sizeof(float);
+		glBindBuffer(GL_COPY_READ_BUFFER, mStorageBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, mPreviousBuffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+		return;
+	}
+
+	TextureBinding binding;
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, mCopyFbo);
+	for(size_t i = 0; i < mDef->mNumTextures; ++i)
+	{
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, currentTexture(i), 0);
+		glBindTexture(GL_TEXTURE_2D, mPreviousTextures[i]);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, mTexWidth, mTexHeight);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+bool ParticleSystem::setCompaction(Compaction::Enum mode)
+{
+	bool hasLife = mDef->mAttributes.find("life") != mDef->mAttributes.end();
+	if(mode != Compaction::None && !hasLife) { return false; }
+	if(mode != Compaction::None && mBackend == Backend::TransformFeedback) { return false; }
+	if(mode == Compaction::Gpu && mDef->mContext->mCompactProgram == 0) { return false; }
+
+	if(mode == Compaction::None && mCompaction != Compaction::None)
+	{
+		resetIndices();
+	}
+	mCompaction = mode;
+
+	return true;
+}
+
+void ParticleSystem::setSeed(unsigned int seed)
+{
+	mSeed = seed;
+}
+
+unsigned int ParticleSystem::getFrame() const
+{
+	return mDef->mContext->mFrame + mFrameOffset;
+}
+
+void ParticleSystem::snapshot(ParticleSnapshot& snapshot) const
+{
+	snapshot.mBackend = mBackend;
+	snapshot.mSeed = mSeed;
+	snapshot.mFrame = getFrame();
+
+	// every backend stores 4 floats per texture and particle
+	size_t texelsSize = 4 * mTexWidth * mTexHeight;
+	snapshot.mData.resize(mDef->mNumTextures * texelsSize);
+	GLsizeiptr dataSize = snapshot.mData.size() * sizeof(float);
+	switch(mBackend)
+	{
+		case Backend::Fragment:
+		{
+			TextureBinding binding;
+			for(size_t i = 0; i < mDef->mNumTextures; ++i)
+			{
+				glBindTexture(GL_TEXTURE_2D, currentTexture(i));
+				glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &snapshot.mData[i * texelsSize]);
+			}
+			break;
+		}
+		case Backend::TransformFeedback:
+			glBindBuffer(GL_ARRAY_BUFFER, mBuffers[mCurrentBuffer]);
+			glGetBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, snapshot.mData.data());
+			break;
+		case Backend::Compute:
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, mStorageBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dataSize, snapshot.mData.data());
+			break;
+	}
+}
+
+bool ParticleSystem::restore(const ParticleSnapshot& snapshot)
+{
+	size_t texelsSize = 4 * mTexWidth * mTexHeight;
+	if(snapshot.mBackend != mBackend || snapshot.mData.size() != mDef->mNumTextures * texelsSize)
+	{
+		return false;
+	}
+
+	mSeed = snapshot.mSeed;
+	mFrameOffset = snapshot.mFrame - mDef->mContext->mFrame;
+
+	GLsizeiptr dataSize = snapshot.mData.size() * sizeof(float);
+	switch(mBackend)
+	{
+		case Backend::Fragment:
+		{
+			TextureBinding binding;
+			for(size_t i = 0; i < mDef->mNumTextures; ++i)
+			{
+				glBindTexture(GL_TEXTURE_2D, currentTexture(i));
+				glTexSubImage2D(
+					GL_TEXTURE_2D, 0,
+					0, 0, mTexWidth, mTexHeight,
+					GL_RGBA, GL_FLOAT, &snapshot.mData[i * texelsSize]
+				);
+			}
+			break;
+		}
+		case Backend::TransformFeedback:
+			glBindBuffer(GL_ARRAY_BUFFER, mBuffers[mCurrentBuffer]);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, dataSize, snapshot.mData.data());
+			break;
+		case Backend::Compute:
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, mStorageBuffer);
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dataSize, snapshot.mData.data());
+			break;
+	}
+
+	// no motion to interpolate from whatever was there before
+	mPreviousFrame = getFrame() - 1;
+	keepPrevious();
+
+	return true;
+}
+
+unsigned int ParticleSnapshot::hash() const
+{
+	unsigned int words[] = { (unsigned int)mBackend, mSeed, mFrame };
+	const unsigned char* bytes[] = { (const unsigned char*)words, (const unsigned char*)mData.data() };
+	size_t sizes[] = { sizeof(words), mData.size() * sizeof(float) };
+
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < 2; ++i)
+	{
+		for(size_t j = 0; j < sizes[i]; ++j)
+		{
+			hash = (hash ^ bytes[i][j]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+void ParticleSystem::resetIndices()
+{
+	size_t capacity = mTexWidth * mTexHeight;
+	mIndices.resize(capacity);
+	for(size_t i = 0; i < capacity; ++i)
+	{
+		mIndices[i] = i;
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, mIndexBuffer);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, capacity * sizeof(GLint), mIndices.data());
+}
+
+void ParticleSystem::compactGpu(GLsizei count)
+{
+	// count, instanceCount, first, baseInstance
+	GLuint command[] = { (GLuint)count, 0, 0, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mDrawCommand);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(command), command);
+
+	collectGpu(false, 1, mIndexBuffer, mTexWidth * mTexHeight);
+}
+
+GLsizei ParticleSystem::compactCpu()
+{
+	return collectCpu(false, mIndexBuffer, mTexWidth * mTexHeight);
+}
+
+void ParticleSystem::collectGpu(bool dead, size_t counter, GLuint indexBuffer, GLsizei maxCount)
+{
+	const AttributeLayout& life = mDef->mAttributes.find("life")->second;
+	GLuint prog = mDef->mContext->mCompactProgram;
+	const Context::CompactLocations& locations = mDef->mContext->mCompactLocations;
+	GLsizei capacity = mTexWidth * mTexHeight;
+
+	// life is read from the storage buffer of the compute backend
+	size_t lifeBase = 0;
+	size_t lifeStride = 0;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mDrawCommand);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, indexBuffer);
+	if(mBackend == Backend::Compute)
+	{
+		storageLayout(life.mSlot, lifeBase, lifeStride);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, gStorageBinding, mStorageBuffer);
+	}
+	else
+	{
+		glActiveTexture(GL_TEXTURE0 + life.mSlot / 4);
+		glBindTexture(GL_TEXTURE_2D, currentTexture(life.mSlot / 4));
+	}
+
+	// the caller's program has to be restored
+	GLint prevProg;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &prevProg);
+
+	glUseProgram(prog);
+	glUniform1i(locations.mLife, life.mSlot / 4);
+	glUniform1i(locations.mLifeComponent, life.mSlot % 4);
+	glUniform1i(locations.mLifeBase, lifeBase);
+	glUniform1i(locations.mLifeStride, lifeStride);
+	glUniform1i(locations.mTexWidth, mTexWidth);
+	glUniform1i(locations.mNumParticles, capacity);
+	glUniform1i(locations.mCounter, counter);
+	glUniform1i(locations.mMaxCount, maxCount);
+	glUniform1i(locations.mCollectDead, dead);
+	glDispatchCompute((capacity + 255) / 256, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	glUseProgram(prevProg);
+}
+
+GLsizei ParticleSystem::collectCpu(bool dead, GLuint indexBuffer, GLsizei maxCount)
+{
+	const AttributeLayout& life = mDef->mAttributes.find("life")->second;
+	size_t capacity = mTexWidth * mTexHeight;
+
+	// life of particle i is at base + i * stride in the read back data
+	size_t base = life.mSlot % 4;
+	size_t stride = 4;
+	if(mBackend == Backend::Compute)
+	{
+		// only the stream of life is read when particles are not interleaved
+		storageLayout(life.mSlot, base, stride);
+		size_t offset = stride == 1 ? base : 0;
+		mReadback.resize(stride * capacity);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mStorageBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(float), mReadback.size() * sizeof(float), mReadback.data());
+		base -= offset;
+	}
+	else
+	{
+		mReadback.resize(4 * capacity);
+		glActiveTexture(GL_TEXTURE0 + life.mSlot / 4);
+		glBindTexture(GL_TEXTURE_2D, currentTexture(life.mSlot / 4));
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, mReadback.data());
+	}
+
+	mIndices.clear();
+	for(size_t i = 0; i < capacity && mIndices.size() < (size_t)maxCount; ++i)
+	{
+		bool alive = mReadback[base + i * stride] > 0.0f;
+		if(alive != dead)
+		{
+			mIndices.push_back(i);
+		}
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, mIndices.size() * sizeof(GLint), mIndices.data());
+
+	return mIndices.size();
+}
+
+void ParticleSystem::emit(const Program& program, GLsizei count)
+{
+	GLsizei capacity = mTexWidth * mTexHeight;
+	count = std::min(count, capacity);
+	if(count <= 0) { return; }
+
+	keepPrevious();
+
+	// the kernel runs over every particle, dead ones take tickets from the
+	// counter until count of them are filled
+	if(mBackend == Backend::Compute)
+	{
+		glUniform1i(program.mEmitCountLocation, count);
+
+		GLuint tickets = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mEmitCounter);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(tickets), &tickets);
+		runPass(program, ~(GLbitfield)0, ~(GLbitfield)0);
+		return;
+	}
+
+	if(mCompaction == Compaction::Gpu)
+	{
+		// entries past the number of dead slots stay negative and are culled
+		GLint none = -1;
+		glBindBuffer(GL_TEXTURE_BUFFER, mFreeBuffer);
+		glClearBufferSubData(GL_TEXTURE_BUFFER, GL_R32I, 0, count * sizeof(GLint), GL_RED_INTEGER, GL_INT, &none);
+
+		// the draw command is only used as a counter until the next render
+		GLuint counters[] = { 0, 0, 0, 0 };
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mDrawCommand);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+		collectGpu(true, 0, mFreeBuffer, count);
+	}
+	else
+	{
+		count = collectCpu(true, mFreeBuffer, count);
+	}
+
+	// Only the filled slots are written and nothing is read back so the
+	// current textures are updated in place, without a flip
+	glActiveTexture(GL_TEXTURE0 + mDef->mNumTextures);
+	glBindTexture(GL_TEXTURE_BUFFER, mFreeTexture);
+	glBindVertexArray(mDef->mContext->mEmitVAO);
+	drawPasses(program, ~(GLbitfield)0, true, GL_POINTS, count);
+}
+
+int ParticleSystem::allocateRegion(size_t width, size_t height)
+{
+	if(mRegionTexture == 0) { return -1; }
+
+	int region = mAtlas.allocate(width, height);
+	if(region >= 0)
+	{
+		fillRegion(mAtlas.getRect(region), region);
+	}
+	return region;
+}
+
+void ParticleSystem::releaseRegion(int region)
+{
+	if(!mAtlas.isAllocated(region)) { return; }
+
+	const AtlasRect& rect = mAtlas.getRect(region);
+	mAtlas.release(region);
+	fillRegion(rect, -1);
+
+	// same initial state as a new system
+	if(mBackend != Backend::Fragment)
+	{
+		// a row of the region is a range of particles, or a range of each
+		// stream when they are not interleaved
+		bool streams = mBackend == Backend::Compute && mDef->mStorageLayout == StorageLayout::Streams;
+		size_t numStreams = streams ? 4 * mDef->mNumTextures : 1;
+		size_t particleSize = (streams ? 1 : 4 * mDef->mNumTextures) * sizeof(float);
+		size_t streamSize = mTexWidth * mTexHeight * particleSize;
+		vector<float> data(rect.mWidth * particleSize / sizeof(float), -20.0f);
+		GLuint buffers[] = { mBuffers[0], mBuffers[1], mStorageBuffer };
+		for(size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+		{
+			if(buffers[i] == 0) { continue; }
+
+			glBindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+			for(size_t stream = 0; stream < numStreams; ++stream)
+			{
+				for(size_t y = rect.mY; y < rect.mY + rect.mHeight; ++y)
+				{
+					GLintptr offset = stream * streamSize + (y * mTexWidth + rect.mX) * particleSize;
+					glBufferSubData(GL_ARRAY_BUFFER, offset, rect.mWidth * particleSize, data.data());
+				}
+			}
+		}
+		return;
+	}
+
+	TextureBinding binding;
+	vector<float> data(4 * rect.mWidth * rect.mHeight, -20.0f);
 	for(size_t i = 0; i < mDef->mNumTextures; ++i)
 	{
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(GL_TEXTURE_2D, inputTexs[i]);
+		GLuint textures[] = { mEvenTextures[i], mOddTextures[i] };
+		for(size_t j = 0; j < 2; ++j)
+		{
+			glBindTexture(GL_TEXTURE_2D, textures[j]);
+			glTexSubImage2D(
+				GL_TEXTURE_2D, 0,
+				rect.mX, rect.mY, rect.mWidth, rect.mHeight,
+				GL_RGBA, GL_FLOAT, data.data()
+			);
+		}
 	}
-	glDrawArraysInstanced(primType, 0, count, mTexWidth * mTexHeight);
 }
 
-void ParticleSystem::flip()
+void ParticleSystem::fillRegion(const AtlasRect& rect, GLint id)
+{
+	TextureBinding binding;
+	vector<GLint> ids(rect.mWidth * rect.mHeight, id);
+	glBindTexture(GL_TEXTURE_2D, mRegionTexture);
+	glTexSubImage2D(
+		GL_TEXTURE_2D, 0,
+		rect.mX, rect.mY, rect.mWidth, rect.mHeight,
+		GL_RED_INTEGER, GL_INT, ids.data()
+	);
+}
+
+GLuint ParticleSystem::linkModifier(const string& section, std::ostream& err)
 {
-	vector<GLuint>& inputTexs = mFlipFlag ? mOddTextures : mEvenTextures;
-	vector<GLuint>& renderTargets = mFlipFlag ? mEvenTargets : mOddTargets;
-	mFlipFlag = !mFlipFlag;
+	if(mBackend == Backend::Fragment)
+	{
+		// grainc -b decided how many textures a pass writes at most
+		GLint maxDrawBuffers;
+		GLint maxAttachments;
+		glGetIntegerv(GL_MAX_DRAW_BUFFERS, &maxDrawBuffers);
+		glGetIntegerv(GL_MAX_COLOR_ATTACHMENTS, &maxAttachments);
+		size_t supported = std::min(maxDrawBuffers, maxAttachments);
+		if(mDrawBuffers.size() > supported)
+		{
+			err << "'" << section << "' was compiled for passes of " << mDrawBuffers.size()
+			    << " draw buffers but the driver has " << supported
+			    << ", compile it with grainc -b " << supported << endl;
+			return 0;
+		}
+		return mDef->linkProgram(section, err);
+	}
+
+	string variantSection = section + variantSuffix(mBackend);
+	if(!mDef->hasSection(variantSection))
+	{
+		err << "'" << section << "' was not compiled for " << variantOption(mBackend) << endl;
+		return 0;
+	}
+
+	// particles are numbered by vertex or invocation, their texel is needed
+	// by rand()
+	GLuint prog = mDef->linkProgram(variantSection, err);
+	if(prog != 0)
+	{
+		glUseProgram(prog);
+		glUniform1i(glGetUniformLocation(prog, "_gr_texWidth"), mTexWidth);
+		glUniform1i(glGetUniformLocation(prog, "_gr_numParticles"), mTexWidth * mTexHeight);
+	}
+	return prog;
+}
+
+void ParticleSystem::runPass(const Program& program, GLbitfield fetchMask, GLbitfield writeMask)
+{
+	keepPrevious();
+
+	const Context* context = mDef->mContext;
+	if(mBackend == Backend::Fragment)
+	{
+		for(size_t i = 0; i < mDef->mNumTextures; ++i)
+		{
+			if(fetchMask & ((GLbitfield)1 << i))
+			{
+				glActiveTexture(GL_TEXTURE0 + i);
+				glBindTexture(GL_TEXTURE_2D, currentTexture(i));
+			}
+		}
+		glBindVertexArray(context->mUpdateVAO);
+		drawPasses(program, writeMask, false, GL_TRIANGLE_FAN, 4);
+		flip(writeMask);
+		return;
+	}
+
+	if(mBackend == Backend::Compute)
+	{
+		// the work group size was chosen by grainc
+		GLint groupSize[3];
+		glGetProgramiv(program.mHandle, GL_COMPUTE_WORK_GROUP_SIZE, groupSize);
+
+		GLsizei capacity = mTexWidth * mTexHeight;
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, gStorageBinding, mStorageBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, gEmissionBinding, mEmitCounter);
+		glDispatchCompute((capacity + groupSize[0] - 1) / groupSize[0], 1, 1);
+		// read by the next kernel and by renderers through the buffer texture
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+		return;
+	}
+
+	// every particle is copied to the other buffer
+	size_t next = 1 - mCurrentBuffer;
+	glBindVertexArray(mBufferArrays[mCurrentBuffer]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mBuffers[next]);
+	glEnable(GL_RASTERIZER_DISCARD);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, mTexWidth * mTexHeight);
+	glEndTransformFeedback();
+	glDisable(GL_RASTERIZER_DISCARD);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	mCurrentBuffer = next;
+}
+
+// The outputs of a program are the written textures in order. Every pass
+// of a split program reads the same state, nothing flips until the last one.
+void ParticleSystem::drawPasses(const Program& program, GLbitfield writeMask, bool inPlace, GLenum mode, GLsizei count)
+{
+	mPassTargets.clear();
+	for(size_t i = 0; i < mDef->mNumTextures; ++i)
+	{
+		if(writeMask & ((GLbitfield)1 << i))
+		{
+			mPassTargets.push_back(inPlace ? currentTexture(i) : nextTexture(i));
+		}
+	}
 
 	glBindFramebuffer(GL_FRAMEBUFFER, mFbo);
+	glViewport(0, 0, mTexWidth, mTexHeight);
+	for(size_t first = 0, pass = 0; first < mPassTargets.size(); first += mDrawBuffers.size(), ++pass)
+	{
+		size_t numBuffers = std::min(mPassTargets.size() - first, mDrawBuffers.size());
+		for(size_t i = 0; i < numBuffers; ++i)
+		{
+			GLuint texture = mPassTargets[first + i];
+			if(mAttachments[i] != texture)
+			{
+				glFramebufferTexture2D(GL_FRAMEBUFFER, mDrawBuffers[i], GL_TEXTURE_2D, texture, 0);
+				mAttachments[i] = texture;
+			}
+		}
+		glDrawBuffers(numBuffers, mDrawBuffers.data());
+		glUniform1i(program.mPassLocation, pass);
+		glDrawArrays(mode, 0, count);
+	}
+}
 
+// Only the written textures flip, the others stay current as they are
+void ParticleSystem::flip(GLbitfield writeMask)
+{
 	for(size_t i = 0; i < mDef->mNumTextures; ++i)
 	{
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(GL_TEXTURE_2D, inputTexs[i]);
+		if(writeMask & ((GLbitfield)1 << i))
+		{
+			mOddCurrent[i] = !mOddCurrent[i];
+		}
 	}
-	glDrawBuffers(mDef->mNumTextures, renderTargets.data());
+}
+
+GLuint ParticleSystem::currentTexture(size_t texture) const
+{
+	return mOddCurrent[texture] ? mOddTextures[texture] : mEvenTextures[texture];
+}
+
+GLuint ParticleSystem::nextTexture(size_t texture) const
+{
+	return mOddCurrent[texture] ? mEvenTextures[texture] : mOddTextures[texture];
 }
 
 }
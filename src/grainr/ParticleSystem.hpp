@@ -4,41 +4,176 @@
 #include <iosfwd>
 #include <vector>
 #include <GL/gl.h>
+#include "Program.hpp"
+#include "Atlas.hpp"
+#include "SystemDefinition.hpp"
 
 namespace grainr
 {
 
-class SystemDefinition;
-class Emitter;
-class Affector;
-class Renderer;
+namespace Compaction
+{
+	enum Enum
+	{
+		None, // draw every particle in the pool, dead ones included
+		Cpu,  // read back life and build the list of live particles on the CPU
+		Gpu   // build the list with a compute shader and draw it indirectly
+	};
+}
+
+// Particles of a system at a frame, in the storage layout of its backend.
+// Restoring it in a system of the same definition, backend and size then
+// updating it with the same calls gives the same particles bit for bit.
+struct ParticleSnapshot
+{
+	Backend::Enum mBackend;
+	unsigned int mSeed;
+	unsigned int mFrame;
+	std::vector<float> mData;
+
+	// FNV-1a of the whole state, to compare runs without keeping the data
+	unsigned int hash() const;
+};
 
 class ParticleSystem
 {
 	friend class SystemDefinition;
 	friend class Program;
 	friend class Emitter;
+	friend class Renderer;
 public:
 	void destroy();
 
-	Emitter* createEmitter(const char* name, std::ostream& err);
+	Emitter* createEmitter(
+		const char* name,
+		std::ostream& err,
+		Emission::Enum emission = Emission::Random
+	);
 	Affector* createAffector(const char* name, std::ostream& err);
+	Pipeline* createPipeline(const char* name, std::ostream& err);
 	Renderer* createRenderer(const char* name, std::ostream& err);
+	// Draws with the renderer prepared last. With the transform feedback
+	// backend, the particles are instanced attributes enabled on the vertex
+	// array bound by the caller.
 	void render(GLenum primType, GLsizei count);
+
+	// Choose how dead particles are skipped when rendering. Gpu is the default
+	// when compute shaders are supported. Returns false if the mode is not
+	// available, the current mode is kept in that case. The transform
+	// feedback backend only supports None.
+	bool setCompaction(Compaction::Enum mode);
+
+	// Keeps the particles as they were before the last update so that
+	// renderers draw them Context::getInterpolation of the way from there,
+	// smoothing motion when the context runs at a fixed step. Particles
+	// whose life went up were emitted since and are drawn as they are.
+	// Costs a copy of the particles per update. Returns false with the
+	// transform feedback backend.
+	bool setInterpolation(bool enabled);
+
+	// Keys the random numbers of the system along with its own frame, see
+	// getFrame. Systems with the same seed draw the same numbers at the
+	// same frame, and so does the CPU backend.
+	void setSeed(unsigned int seed);
+	// Frames are counted from the creation of the system, each
+	// Context::update is one
+	unsigned int getFrame() const;
+
+	// Reads back the state of every particle. Not included are the regions
+	// of an atlas and the fraction of a particle carried over by exact
+	// emitters. Exact emission only fills the same slots from run to run
+	// with Compaction::Cpu or None on the fragment and transform feedback
+	// backends, other modes pick the slots with atomic counters.
+	void snapshot(ParticleSnapshot& snapshot) const;
+	// Uploads a snapshot along with its seed and frame. Returns false if it
+	// was taken with another backend or size, nothing is changed then.
+	bool restore(const ParticleSnapshot& snapshot);
+
+	// Only for definitions compiled with grainc -a. Many instances of an
+	// effect share the system, each in its own rectangle of the particle
+	// pool, and are updated together by a single run of every program. The
+	// params of an instance are set after Program::setRegion. Returns -1 if
+	// there is no room left.
+	int allocateRegion(size_t width, size_t height);
+	// Kills the particles of the region, its params are kept for the next
+	// allocation which reuses the id
+	void releaseRegion(int region);
 private:
-	ParticleSystem(const SystemDefinition* def, size_t width, size_t height);
+	ParticleSystem(const SystemDefinition* def, size_t width, size_t height, Backend::Enum backend);
 	~ParticleSystem();
 
-	void flip();
+	void createTextures();
+	void createBuffers();
+	void createStorage();
+	// Index of the float at slot of particle i is base + i * stride
+	void storageLayout(size_t slot, size_t& base, size_t& stride) const;
+	GLuint linkModifier(const std::string& section, std::ostream& err);
+	// Updates every particle with program, which is the current one
+	void runPass(const Program& program, GLbitfield fetchMask, GLbitfield writeMask);
+	// Draws the written textures with program, into their next copies or
+	// in place, a pass per group of mDef->mDrawBuffers of them
+	void drawPasses(const Program& program, GLbitfield writeMask, bool inPlace, GLenum mode, GLsizei count);
+	void flip(GLbitfield writeMask);
+	GLuint currentTexture(size_t texture) const;
+	GLuint nextTexture(size_t texture) const;
+	void resetIndices();
+	void compactGpu(GLsizei count);
+	GLsizei compactCpu();
+	void collectGpu(bool dead, size_t counter, GLuint indexBuffer, GLsizei maxCount);
+	GLsizei collectCpu(bool dead, GLuint indexBuffer, GLsizei maxCount);
+	void emit(const Program& program, GLsizei count);
+	void fillRegion(const AtlasRect& rect, GLint id);
+	// Copies the particles to the previous ones before the first pass of a frame
+	void keepPrevious();
 
-	std::vector<GLenum> mOddTargets;
-	std::vector<GLenum> mEvenTargets;
 	std::vector<GLuint> mOddTextures;
 	std::vector<GLuint> mEvenTextures;
+	// A pass only attaches the textures it writes, so the limits of the
+	// driver apply to a group rather than to every copy of every texture.
+	// mAttachments is the texture at each color attachment of mFbo.
+	std::vector<GLenum> mDrawBuffers;
+	std::vector<GLuint> mAttachments;
+	std::vector<GLuint> mPassTargets;
 	GLuint mFbo;
 	size_t mTexWidth;
 	size_t mTexHeight;
-	bool mFlipFlag;
+	// Each texture flips on its own, only when a pass writes it. An entry
+	// is true when the odd copy holds the current state.
+	std::vector<bool> mOddCurrent;
+	// Transform feedback backend: the current buffer is read by passes which
+	// write the other one. A vertex array per buffer reads it for updates.
+	GLuint mBuffers[2];
+	GLuint mBufferArrays[2];
+	size_t mCurrentBuffer;
+	std::vector<GLuint> mStreamLocations;
+	// Compute backend: kernels update the storage buffer in place, renderers
+	// read it through a buffer texture. Exact emission counts the dead
+	// particles it fills with an atomic counter.
+	GLuint mStorageBuffer;
+	GLuint mStorageTexture;
+	GLuint mEmitCounter;
+	Backend::Enum mBackend;
+	unsigned int mSeed;
+	unsigned int mFrameOffset; // from the frame of the context
+	// Interpolation: particles before the first pass of mPreviousFrame,
+	// read through the framebuffer mCopyFbo for the fragment backend
+	bool mInterpolation;
+	unsigned int mPreviousFrame;
+	std::vector<GLuint> mPreviousTextures;
+	GLuint mPreviousBuffer;
+	GLuint mPreviousTexture;
+	GLuint mCopyFbo;
+	GLint mPreviousWeightLocation; // in the renderer prepared last
+	GLuint mIndexBuffer;
+	GLuint mIndexTexture;
+	GLuint mFreeBuffer;
+	GLuint mFreeTexture;
+	GLuint mDrawCommand;
+	Compaction::Enum mCompaction;
+	std::vector<float> mReadback;
+	std::vector<GLint> mIndices;
+	AtlasAllocator mAtlas;
+	GLuint mRegionTexture;
 	const SystemDefinition* mDef;
 };
 
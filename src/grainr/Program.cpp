@@ -3,16 +3,140 @@
 #include "ParticleSystem.hpp"
 #include "SystemDefinition.hpp"
 #include "Context.hpp"
+#include "CpuModule.hpp"
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
 
 namespace grainr
 {
 
+namespace
+{
+
+size_t typeSize(GLenum type)
+{
+	switch(type)
+	{
+		case GL_FLOAT:
+			return 1;
+		case GL_FLOAT_VEC2:
+			return 2;
+		case GL_FLOAT_VEC3:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+GLenum typeOfSize(size_t size)
+{
+	switch(size)
+	{
+		case 1:
+			return GL_FLOAT;
+		case 2:
+			return GL_FLOAT_VEC2;
+		case 3:
+			return GL_FLOAT_VEC3;
+		default:
+			return GL_FLOAT_VEC4;
+	}
+}
+
+// The param block always uses this binding point
+const GLuint gParamBlockBinding = 0;
+
+}
+
+ParamBlock::ParamBlock(const Program* program, GLsizeiptr size)
+	:mProgram(program)
+	,mData(size, 0)
+	,mDirty(false)
+{
+	glGenBuffers(1, &mBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, mBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, mData.data(), GL_DYNAMIC_DRAW);
+}
+
+ParamBlock::~ParamBlock()
+{
+	glDeleteBuffers(1, &mBuffer);
+}
+
+void ParamBlock::destroy()
+{
+	delete this;
+}
+
+void ParamBlock::setParam(ParamHandle param, GLenum type, const float* value)
+{
+	if(!param.isValid()) { return; }
+	const Program::Uniform& uniform = mProgram->mUniforms[param.mIndex];
+	if(uniform.mType != type || uniform.mOffset < 0) { return; }
+
+	size_t size = typeSize(type) * sizeof(float);
+	unsigned char* dest = mData.data() + uniform.mOffset;
+	if(memcmp(dest, value, size) == 0) { return; }
+
+	memcpy(dest, value, size);
+	mDirty = true;
+}
+
+void ParamBlock::upload()
+{
+	if(!mDirty) { return; }
+
+	glBindBuffer(GL_UNIFORM_BUFFER, mBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, mData.size(), mData.data());
+	mDirty = false;
+}
+
+void ParamBlock::setParamFloat(ParamHandle param, float value)
+{
+	setParam(param, GL_FLOAT, &value);
+}
+
+void ParamBlock::setParamVec2(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC2, vec);
+}
+
+void ParamBlock::setParamVec3(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC3, vec);
+}
+
+void ParamBlock::setParamVec4(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC4, vec);
+}
+
 Program::Program()
+	:mParamBlockSize(0)
+	,mOwnParamBlock(NULL)
+	,mParamBlock(NULL)
+	,mUsesRegions(false)
+	,mRegion(-1)
+	,mRegionStride(0)
+	,mRegionBuffer(0)
+	,mRegionTexture(0)
+	,mRegionBufferSize(0)
+	,mRegionDirty(false)
+	,mFrameLocation(-1)
+	,mStreamLocation(-1)
+	,mPassLocation(-1)
+	,mEmitCountLocation(-1)
+	,mNameHash(0)
 {}
 
 Program::~Program()
 {
+	delete mOwnParamBlock;
+	glDeleteTextures(1, &mRegionTexture);
+	glDeleteBuffers(1, &mRegionBuffer);
 	glDeleteProgram(mHandle);
 }
 
@@ -21,9 +145,113 @@ void Program::destroy()
 	delete this;
 }
 
+void Program::init(GLuint handle, ParticleSystem* system, const string& section)
+{
+	mHandle = handle;
+	mSystem = system;
+
+	// definitions without access information read and write everything
+	map<string, SectionAccess>::const_iterator accessItr = mSystem->mDef->mAccess.find(section);
+	bool hasAccess = accessItr != mSystem->mDef->mAccess.end();
+	mFetchMask = hasAccess ? accessItr->second.mFetchMask : ~(GLbitfield)0;
+	mWriteMask = hasAccess ? accessItr->second.mWriteMask : ~(GLbitfield)0;
+
+	// build the table of active uniforms once
+	GLint numUniforms, maxNameLength;
+	glGetProgramiv(mHandle, GL_ACTIVE_UNIFORMS, &numUniforms);
+	glGetProgramiv(mHandle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+	GLuint blockIndex = glGetUniformBlockIndex(mHandle, "_gr_params");
+	vector<GLchar> nameBuff(maxNameLength + 1);
+	for(GLint i = 0; i < numUniforms; ++i)
+	{
+		Uniform uniform;
+		GLint size;
+		GLuint uniformIndex = i;
+		GLint uniformBlock;
+		glGetActiveUniform(mHandle, i, nameBuff.size(), NULL, &size, &uniform.mType, nameBuff.data());
+		glGetActiveUniformsiv(mHandle, 1, &uniformIndex, GL_UNIFORM_BLOCK_INDEX, &uniformBlock);
+		glGetActiveUniformsiv(mHandle, 1, &uniformIndex, GL_UNIFORM_OFFSET, &uniform.mOffset);
+		uniform.mLocation = glGetUniformLocation(mHandle, nameBuff.data());
+		uniform.mSlot = -1;
+		uniform.mHasValue = false;
+
+		bool inParamBlock = blockIndex != GL_INVALID_INDEX && uniformBlock == (GLint)blockIndex;
+		if(!inParamBlock) { uniform.mOffset = -1; }
+		if(uniform.mLocation < 0 && !inParamBlock) { continue; }
+
+		// arrays are reported as name[0]
+		string name(nameBuff.data());
+		string::size_type bracketPos = name.find_first_of('[');
+		if(bracketPos != string::npos) { name.erase(bracketPos); }
+
+		mUniformIndices.insert(make_pair(name, (int)mUniforms.size()));
+		mUniforms.push_back(uniform);
+	}
+
+	if(blockIndex != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(mHandle, blockIndex, gParamBlockBinding);
+		GLint blockSize;
+		glGetActiveUniformBlockiv(mHandle, blockIndex, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+		mParamBlockSize = blockSize;
+		mOwnParamBlock = new ParamBlock(this, mParamBlockSize);
+		mParamBlock = mOwnParamBlock;
+	}
+
+	// params read per region are not uniforms, their layout is in the header
+	GLint regionsLocation = glGetUniformLocation(mHandle, "_gr_regions");
+	mUsesRegions = regionsLocation >= 0;
+	typedef map<string, RegionParamLayout> RegionParams;
+	map<string, RegionParams>::const_iterator sectionItr = mSystem->mDef->mRegionParams.find(section);
+	if(mUsesRegions && sectionItr != mSystem->mDef->mRegionParams.end())
+	{
+		for(RegionParams::const_iterator itr = sectionItr->second.begin()
+		;   itr != sectionItr->second.end()
+		;   ++itr)
+		{
+			Uniform uniform;
+			uniform.mLocation = -1;
+			uniform.mOffset = -1;
+			uniform.mSlot = itr->second.mSlot;
+			uniform.mType = typeOfSize(itr->second.mSize);
+			uniform.mHasValue = false;
+			mRegionStride = std::max(mRegionStride, itr->second.mSlot + 1);
+
+			mUniformIndices.insert(make_pair(itr->first, (int)mUniforms.size()));
+			mUniforms.push_back(uniform);
+		}
+	}
+
+	if(mUsesRegions)
+	{
+		size_t numTextures = mSystem->mDef->mNumTextures;
+		prepare();
+		glUniform1i(regionsLocation, numTextures);
+		glUniform1i(glGetUniformLocation(mHandle, "_gr_regionParams"), numTextures + 1);
+
+		glGenBuffers(1, &mRegionBuffer);
+		glGenTextures(1, &mRegionTexture);
+	}
+
+	mFrameLocation = glGetUniformLocation(mHandle, "_gr_frame");
+	mStreamLocation = glGetUniformLocation(mHandle, "_gr_stream");
+	mPassLocation = glGetUniformLocation(mHandle, "_gr_pass");
+	mEmitCountLocation = glGetUniformLocation(mHandle, "_gr_emitCount");
+	mNameHash = CpuRandom::hashName(section.c_str());
+	mDtParam = getParam("dt");
+	mChanceParam = getParam("_gr_chance");
+}
+
+ParamHandle Program::getParam(const char* name) const
+{
+	map<string, int>::const_iterator itr = mUniformIndices.find(name);
+	return itr == mUniformIndices.end() ? ParamHandle() : ParamHandle(itr->second);
+}
+
 GLint Program::getUniformLocation(const char* name)
 {
-	return glGetUniformLocation(mHandle, name);
+	ParamHandle param = getParam(name);
+	return param.isValid() ? mUniforms[param.mIndex].mLocation : glGetUniformLocation(mHandle, name);
 }
 
 void Program::prepare()
@@ -34,36 +262,170 @@ void Program::prepare()
 void Program::run()
 {
 	const Context* context = mSystem->mDef->mContext;
-	glUniform1f(getUniformLocation("_gr_time"), context->mTime);
-	glUniform1f(getUniformLocation("dt"), context->mDt);
+	glUniform1ui(mFrameLocation, mSystem->getFrame());
+	glUniform1ui(mStreamLocation, CpuRandom::stream(mNameHash, mSystem->mSeed));
+	setParamFloat(mDtParam, context->mDt);
 
-	mSystem->flip();
-	glViewport(0, 0, mSystem->mTexWidth, mSystem->mTexHeight);
-	glBindVertexArray(context->mUpdateVAO);
-	glDrawArrays(GL_QUADS, 0, 4);
+	applyParams();
+
+	mSystem->runPass(*this, mFetchMask, mWriteMask);
+}
+
+ParamBlock* Program::createParamBlock() const
+{
+	return mParamBlockSize > 0 ? new ParamBlock(this, mParamBlockSize) : NULL;
+}
+
+void Program::setParamBlock(ParamBlock* block)
+{
+	mParamBlock = block != NULL ? block : mOwnParamBlock;
+}
+
+void Program::setRegion(int region)
+{
+	if(!mUsesRegions || region < 0) { return; }
+
+	mRegion = region;
+	size_t size = (region + 1) * mRegionStride * 4;
+	if(mRegionData.size() < size)
+	{
+		mRegionData.resize(size, 0.0f);
+	}
+}
+
+void Program::applyParams()
+{
+	if(mParamBlock != NULL)
+	{
+		mParamBlock->upload();
+		glBindBufferBase(GL_UNIFORM_BUFFER, gParamBlockBinding, mParamBlock->mBuffer);
+	}
+
+	if(!mUsesRegions) { return; }
+
+	if(mRegionDirty)
+	{
+		size_t size = mRegionData.size() * sizeof(float);
+		glBindBuffer(GL_TEXTURE_BUFFER, mRegionBuffer);
+		if(size > mRegionBufferSize)
+		{
+			glBufferData(GL_TEXTURE_BUFFER, size, mRegionData.data(), GL_DYNAMIC_DRAW);
+			glBindTexture(GL_TEXTURE_BUFFER, mRegionTexture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, mRegionBuffer);
+			mRegionBufferSize = size;
+		}
+		else
+		{
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, size, mRegionData.data());
+		}
+		mRegionDirty = false;
+	}
+
+	size_t numTextures = mSystem->mDef->mNumTextures;
+	glActiveTexture(GL_TEXTURE0 + numTextures);
+	glBindTexture(GL_TEXTURE_2D, mSystem->mRegionTexture);
+	glActiveTexture(GL_TEXTURE0 + numTextures + 1);
+	glBindTexture(GL_TEXTURE_BUFFER, mRegionTexture);
+}
+
+void Program::setRegionParam(const Uniform& uniform, const float* value)
+{
+	if(mRegion < 0) { return; }
+
+	size_t size = typeSize(uniform.mType);
+	float* dest = mRegionData.data() + (mRegion * mRegionStride + uniform.mSlot) * 4;
+	if(std::equal(value, value + size, dest)) { return; }
+
+	std::copy(value, value + size, dest);
+	mRegionDirty = true;
+}
+
+void Program::setParam(ParamHandle param, GLenum type, const float* value)
+{
+	// unknown names and mismatched types are ignored
+	if(!param.isValid()) { return; }
+	Uniform& uniform = mUniforms[param.mIndex];
+	if(uniform.mType != type) { return; }
+
+	if(uniform.mOffset >= 0)
+	{
+		mParamBlock->setParam(param, type, value);
+		return;
+	}
+
+	if(uniform.mSlot >= 0)
+	{
+		setRegionParam(uniform, value);
+		return;
+	}
+
+	size_t size = typeSize(type);
+
+	if(uniform.mHasValue && std::equal(value, value + size, uniform.mValue)) { return; }
+	uniform.mHasValue = true;
+	std::copy(value, value + size, uniform.mValue);
+
+	switch(type)
+	{
+		case GL_FLOAT:
+			glUniform1fv(uniform.mLocation, 1, value);
+			break;
+		case GL_FLOAT_VEC2:
+			glUniform2fv(uniform.mLocation, 1, value);
+			break;
+		case GL_FLOAT_VEC3:
+			glUniform3fv(uniform.mLocation, 1, value);
+			break;
+		case GL_FLOAT_VEC4:
+			glUniform4fv(uniform.mLocation, 1, value);
+			break;
+	}
+}
+
+void Program::setParamFloat(ParamHandle param, float value)
+{
+	setParam(param, GL_FLOAT, &value);
+}
+
+void Program::setParamVec2(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC2, vec);
+}
+
+void Program::setParamVec3(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC3, vec);
+}
+
+void Program::setParamVec4(ParamHandle param, const float* vec)
+{
+	setParam(param, GL_FLOAT_VEC4, vec);
 }
 
 void Program::setParamFloat(const char* name, float value)
 {
-	glUniform1f(getUniformLocation(name), value);
+	setParamFloat(getParam(name), value);
 }
 
-void Program::setParamVec2(const char* name, float* vec)
+void Program::setParamVec2(const char* name, const float* vec)
 {
-	glUniform2fv(getUniformLocation(name), 1, vec);
+	setParamVec2(getParam(name), vec);
 }
 
-void Program::setParamVec3(const char* name, float* vec)
+void Program::setParamVec3(const char* name, const float* vec)
 {
-	glUniform3fv(getUniformLocation(name), 1, vec);
+	setParamVec3(getParam(name), vec);
 }
 
-void Program::setParamVec4(const char* name, float* vec)
+void Program::setParamVec4(const char* name, const float* vec)
 {
-	glUniform4fv(getUniformLocation(name), 1, vec);
+	setParamVec4(getParam(name), vec);
 }
 
-Emitter::Emitter()
+Emitter::Emitter(Emission::Enum emission)
+	:mEmission(emission)
+	,mRate(0.0f)
+	,mAccumulator(0.0f)
 {}
 
 Emitter::~Emitter()
@@ -71,7 +433,37 @@ Emitter::~Emitter()
 
 void Emitter::setRate(float rate)
 {
-	glUniform1f(getUniformLocation("_gr_chance"), rate);
+	if(mEmission == Emission::Exact)
+	{
+		mRate = rate;
+	}
+	else
+	{
+		setParamFloat(mChanceParam, rate);
+	}
+}
+
+void Emitter::run()
+{
+	if(mEmission == Emission::Random)
+	{
+		Program::run();
+		return;
+	}
+
+	const Context* context = mSystem->mDef->mContext;
+	glUniform1ui(mFrameLocation, mSystem->getFrame());
+	glUniform1ui(mStreamLocation, CpuRandom::stream(mNameHash, mSystem->mSeed));
+	setParamFloat(mDtParam, context->mDt);
+
+	applyParams();
+
+	// carry the fractional particle over to the next update
+	mAccumulator += mRate * context->mDt;
+	GLsizei count = (GLsizei)mAccumulator;
+	mAccumulator -= count;
+
+	mSystem->emit(*this, count);
 }
 
 Affector::Affector()
@@ -80,10 +472,28 @@ Affector::Affector()
 Affector::~Affector()
 {}
 
+Pipeline::Pipeline()
+{}
+
+Pipeline::~Pipeline()
+{}
+
+void Pipeline::setRate(float rate)
+{
+	setParamFloat(mChanceParam, rate);
+}
+
 Renderer::Renderer()
+	:mPreviousWeightLocation(-1)
 {}
 
 Renderer::~Renderer()
 {}
 
+void Renderer::prepare()
+{
+	Program::prepare();
+	mSystem->mPreviousWeightLocation = mPreviousWeightLocation;
+}
+
 }
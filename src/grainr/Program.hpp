@@ -2,32 +2,147 @@
 #define GRAINR_PROGRAM_HPP
 
 #include <GL/gl.h>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace grainr
 {
 
 class ParticleSystem;
 
-//TODO: state cache
+namespace Emission
+{
+	enum Enum
+	{
+		Random, // each dead slot is filled with a probability of rate
+		Exact   // rate particles per second are placed in dead slots
+	};
+}
+
+// A parameter resolved once by name, only valid for the program it was
+// obtained from
+class ParamHandle
+{
+	friend class Program;
+	friend class ParamBlock;
+public:
+	ParamHandle()
+		:mIndex(-1)
+	{}
+
+	bool isValid() const { return mIndex >= 0; }
+
+private:
+	explicit ParamHandle(int index)
+		:mIndex(index)
+	{}
+
+	int mIndex;
+};
+
+class Program;
+
+// CPU side copy of the params of a program compiled with grainc -u. Changes
+// are uploaded in one go when the program runs with the block.
+class ParamBlock
+{
+	friend class Program;
+public:
+	void setParamFloat(ParamHandle param, float value);
+	void setParamVec2(ParamHandle param, const float* vec);
+	void setParamVec3(ParamHandle param, const float* vec);
+	void setParamVec4(ParamHandle param, const float* vec);
+	void destroy();
+
+private:
+	ParamBlock(const Program* program, GLsizeiptr size);
+	~ParamBlock();
+
+	void setParam(ParamHandle param, GLenum type, const float* value);
+	void upload();
+
+	const Program* mProgram;
+	GLuint mBuffer;
+	std::vector<unsigned char> mData;
+	bool mDirty;
+};
+
 class Program
 {
 	friend class ParticleSystem;
+	friend class ParamBlock;
 public:
-	void prepare();
+	virtual void prepare();
+	ParamHandle getParam(const char* name) const;
+	void setParamFloat(ParamHandle param, float value);
+	void setParamVec2(ParamHandle param, const float* vec);
+	void setParamVec3(ParamHandle param, const float* vec);
+	void setParamVec4(ParamHandle param, const float* vec);
 	void setParamFloat(const char* name, float value);
-	void setParamVec2(const char* name, float* vec);
-	void setParamVec3(const char* name, float* vec);
-	void setParamVec4(const char* name, float* vec);
+	void setParamVec2(const char* name, const float* vec);
+	void setParamVec3(const char* name, const float* vec);
+	void setParamVec4(const char* name, const float* vec);
 	GLint getUniformLocation(const char* name);
-	void run();
+
+	// Only available if the program has a param block, each emitter instance
+	// can have its own block. Passing NULL restores the program's own block.
+	ParamBlock* createParamBlock() const;
+	void setParamBlock(ParamBlock* block);
+
+	// Only for systems compiled with grainc -a, selects the region whose
+	// params are changed by the setters. Built-in uniforms stay shared.
+	void setRegion(int region);
+
+	virtual void run();
 	void destroy();
 
 protected:
 	Program();
 	virtual ~Program();
 
+	void init(GLuint handle, ParticleSystem* system, const std::string& section);
+	void setParam(ParamHandle param, GLenum type, const float* value);
+	void applyParams();
+
+	struct Uniform
+	{
+		GLint mLocation; // -1 for members of the param block and region params
+		GLint mOffset;   // offset in the param block
+		GLint mSlot;     // texel in a region's row of the atlas
+		GLenum mType;
+		bool mHasValue;
+		float mValue[4];
+	};
+
+	void setRegionParam(const Uniform& uniform, const float* value);
+
 	GLuint mHandle;
 	ParticleSystem* mSystem;
+	GLbitfield mFetchMask;
+	GLbitfield mWriteMask;
+	std::vector<Uniform> mUniforms;
+	std::map<std::string, int> mUniformIndices;
+	GLsizeiptr mParamBlockSize;
+	ParamBlock* mOwnParamBlock;
+	ParamBlock* mParamBlock;
+	bool mUsesRegions;
+	int mRegion;
+	size_t mRegionStride;
+	std::vector<float> mRegionData;
+	GLuint mRegionBuffer;
+	GLuint mRegionTexture;
+	size_t mRegionBufferSize;
+	bool mRegionDirty;
+
+	// built-in uniforms
+	GLint mFrameLocation;
+	GLint mStreamLocation;
+	GLint mPassLocation; // -1 unless the writes need more than one pass
+	GLint mEmitCountLocation; // exact emission kernels of the compute backend
+	unsigned int mNameHash; // of the section, see CpuRandom::stream
+	ParamHandle mDtParam;
+	ParamHandle mChanceParam;
 };
 
 class Emitter: public Program
@@ -35,10 +150,15 @@ class Emitter: public Program
 	friend class ParticleSystem;
 public:
 	void setRate(float rate);
+	virtual void run();
 
 private:
-	Emitter();
+	Emitter(Emission::Enum emission);
 	virtual ~Emitter();
+
+	Emission::Enum mEmission;
+	float mRate;
+	float mAccumulator;
 };
 
 class Affector: public Program
@@ -50,13 +170,31 @@ private:
 	virtual ~Affector();
 };
 
+// A chain of modifiers fused by grainc into a single pass (-p option)
+class Pipeline: public Program
+{
+	friend class ParticleSystem;
+public:
+	// Only has an effect if the pipeline starts with an emitter
+	void setRate(float rate);
+
+private:
+	Pipeline();
+	virtual ~Pipeline();
+};
+
 class Renderer: public Program
 {
 	friend class ParticleSystem;
 public:
+	// Also makes it the renderer whose uniforms ParticleSystem::render sets
+	virtual void prepare();
+
 private:
 	Renderer();
 	virtual ~Renderer();
+
+	GLint mPreviousWeightLocation;
 };
 
 }
@@ -1,74 +1,326 @@
 #include <GL/glew.h>
 #include "Shader.hpp"
+#include "FileCache.hpp"
 #include <sstream>
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
 
 using namespace std;
 
 namespace grainr
 {
 
+namespace
+{
+
+bool checkLink(GLuint prog, std::ostream& err)
+{
+	GLint logSize, status;
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
+	if(status == GL_FALSE)
+	{
+		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &logSize);
+		if(logSize > 0)
+		{
+			GLchar* infoLog = new GLchar[logSize + 1];
+			glGetProgramInfoLog(prog, (GLsizei)logSize, NULL, infoLog);
+			err << infoLog << endl;
+			delete[] infoLog;
+		}
+		glDeleteProgram(prog);
+		return false;
+	}
+
+	return true;
+}
+
+bool linkProgram(GLuint prog, std::ostream& err)
+{
+	glLinkProgram(prog);
+	return checkLink(prog, err);
+}
+
+void bindSamplers(GLuint prog, size_t numOutputs)
+{
+	glUseProgram(prog);
+	for(size_t i = 0; i < numOutputs; ++i)
+	{
+		stringstream ss;
+		ss << "_gr_tex[" << i << ']';
+		glUniform1i(glGetUniformLocation(prog, ss.str().c_str()), i);
+	}
+}
+
+}
+
 GLuint createShader(GLenum shaderType, const char* source, std::ostream& err)
+{
+	GLuint handle = compileShader(shaderType, source);
+	if(!checkShader(handle, err))
+	{
+		glDeleteShader(handle);
+		return 0;
+	}
+	return handle;
+}
+
+GLuint compileShader(GLenum shaderType, const char* source)
 {
 	GLuint handle = glCreateShader(shaderType);
 	glShaderSource(handle, 1, &source, NULL);
 	glCompileShader(handle);
+	return handle;
+}
+
+bool checkShader(GLuint shader, std::ostream& err)
+{
 	GLint logSize, status;
-	glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logSize);
-	glGetShaderiv(handle, GL_COMPILE_STATUS, &status);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
 	if(status == GL_FALSE)
 	{
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logSize);
 		if(logSize > 0)
 		{
 			GLchar* infoLog = new GLchar[logSize + 1];
-			glGetShaderInfoLog(handle, (GLsizei)logSize, NULL, infoLog);
+			glGetShaderInfoLog(shader, (GLsizei)logSize, NULL, infoLog);
 			err << infoLog << std::endl;
 			delete[] infoLog;
 		}
-		glDeleteShader(handle);
-		return 0;
+		return false;
 	}
-	return handle;
+	return true;
 }
 
-GLuint createProgram(GLuint vsh, GLuint fsh, size_t numOutputs, std::ostream& err)
+GLuint createProgram(GLuint vsh, GLuint fsh, GLuint prelude, size_t numOutputs, std::ostream& err)
+{
+	return finishProgram(startProgram(vsh, fsh, prelude, numOutputs), numOutputs, err);
+}
+
+GLuint startProgram(GLuint vsh, GLuint fsh, GLuint prelude, size_t numOutputs)
 {
 	GLuint prog = glCreateProgram();
 	glAttachShader(prog, vsh);
-	glAttachShader(prog, fsh);
+	if(fsh != 0)
+	{
+		glAttachShader(prog, fsh);
+	}
+	if(prelude != 0)
+	{
+		glAttachShader(prog, prelude);
+	}
+
+	GLint shaderType;
+	glGetShaderiv(vsh, GL_SHADER_TYPE, &shaderType);
+	bool feedback = fsh == 0 && shaderType == GL_VERTEX_SHADER;
+
+	// fragment outputs past the draw buffers don't exist, grainc splits
+	// the passes which write more textures
+	GLint maxDrawBuffers;
+	glGetIntegerv(GL_MAX_DRAW_BUFFERS, &maxDrawBuffers);
+
+	vector<string> names;
 	for(size_t i = 0; i < numOutputs; ++i)
 	{
 		stringstream ss;
+		ss << "_gr_stream" << i;
+		glBindAttribLocation(prog, streamLocation(i, numOutputs), ss.str().c_str());
+
+		ss.str("");
 		ss << "_gr_out[" << i << ']';
-		glBindFragDataLocation(prog, i, ss.str().c_str());
+		names.push_back(ss.str());
+		if(fsh != 0 && i < (size_t)maxDrawBuffers)
+		{
+			glBindFragDataLocation(prog, i, names.back().c_str());
+		}
+	}
+	if(feedback)
+	{
+		vector<const GLchar*> varyings;
+		for(vector<string>::const_iterator itr = names.begin(); itr != names.end(); ++itr)
+		{
+			varyings.push_back(itr->c_str());
+		}
+		glTransformFeedbackVaryings(prog, varyings.size(), varyings.data(), GL_INTERLEAVED_ATTRIBS);
+	}
+	if(GLEW_ARB_get_program_binary)
+	{
+		glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	}
-
 	glLinkProgram(prog);
-	GLint logSize, status;
+
+	return prog;
+}
+
+GLuint finishProgram(GLuint prog, size_t numOutputs, std::ostream& err)
+{
+	if(!checkLink(prog, err)) { return 0; }
+
+	bindSamplers(prog, numOutputs);
+
+	return prog;
+}
+
+bool isProgramComplete(GLuint prog)
+{
+	if(!GLEW_KHR_parallel_shader_compile) { return true; }
+
+	GLint complete;
+	glGetProgramiv(prog, GL_COMPLETION_STATUS_KHR, &complete);
+	return complete == GL_TRUE;
+}
+
+GLuint createComputeProgram(GLuint csh, std::ostream& err)
+{
+	GLuint prog = glCreateProgram();
+	glAttachShader(prog, csh);
+	if(!linkProgram(prog, err)) { return 0; }
+
+	return prog;
+}
+
+GLuint streamLocation(size_t stream, size_t numStreams)
+{
+	GLint maxAttribs;
+	glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &maxAttribs);
+	return maxAttribs - numStreams + stream;
+}
+
+GLuint createProgramFromBinary(GLenum format, const void* binary, GLsizei length, size_t numOutputs)
+{
+	if(!GLEW_ARB_get_program_binary) { return 0; }
+
+	GLuint prog = glCreateProgram();
+	glProgramBinary(prog, format, binary, length);
+	GLint status;
 	glGetProgramiv(prog, GL_LINK_STATUS, &status);
 	if(status == GL_FALSE)
 	{
-		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &logSize);
-		if(logSize > 0)
-		{
-			GLchar* infoLog = new GLchar[logSize + 1];
-			glGetProgramInfoLog(prog, (GLsizei)logSize, NULL, infoLog);
-			err << infoLog << endl;
-			delete[] infoLog;
-		}
 		glDeleteProgram(prog);
 		return 0;
 	}
 
-	for(size_t i = 0; i < numOutputs; ++i)
+	// uniforms are back to their default values
+	bindSamplers(prog, numOutputs);
+
+	return prog;
+}
+
+bool getProgramBinary(GLuint prog, GLenum& format, std::vector<char>& binary)
+{
+	if(!GLEW_ARB_get_program_binary) { return false; }
+
+	GLint length = 0;
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0) { return false; }
+
+	binary.resize(length);
+	glGetProgramBinary(prog, length, &length, &format, binary.data());
+	binary.resize(length);
+
+	return length > 0;
+}
+
+std::string getShaderSource(GLuint shader)
+{
+	GLint length = 0;
+	glGetShaderiv(shader, GL_SHADER_SOURCE_LENGTH, &length);
+	if(length <= 0) { return string(); }
+
+	vector<GLchar> source(length);
+	glGetShaderSource(shader, length, NULL, source.data());
+	return string(source.data());
+}
+
+ProgramCache::ProgramCache()
+{
+	mStats.mHits = 0;
+	mStats.mMisses = 0;
+}
+
+void ProgramCache::setDirectory(const char* directory)
+{
+	mDirectory = directory != NULL ? directory : "";
+}
+
+bool ProgramCache::isEnabled() const
+{
+	return !mDirectory.empty() && GLEW_ARB_get_program_binary;
+}
+
+std::string ProgramCache::makeKey(
+	const std::string& driver,
+	const std::string& vshSource,
+	const std::string& fshSource,
+	const std::string& preludeSource,
+	size_t numOutputs
+) const
+{
+	Hash hash;
+	hash.add(driver);
+	hash.add(vshSource);
+	hash.add(fshSource);
+	hash.add(preludeSource);
+	hash.add((const char*)&numOutputs, sizeof(numOutputs));
+	return hash.hex();
+}
+
+std::string ProgramCache::path(const std::string& key) const
+{
+	return mDirectory + '/' + key + ".bin";
+}
+
+bool ProgramCache::contains(const std::string& key) const
+{
+	ifstream input(path(key).c_str(), ios::in | ios::binary);
+	return input.good();
+}
+
+GLuint ProgramCache::load(const std::string& key, size_t numOutputs)
+{
+	// file content: format followed by the binary
+	ifstream input(path(key).c_str(), ios::in | ios::binary);
+	GLenum format;
+	if(!input.read((char*)&format, sizeof(format)))
 	{
-		glUseProgram(prog);
-		stringstream ss;
-		ss << "_gr_tex[" << i << ']';
-		glUniform1i(glGetUniformLocation(prog, ss.str().c_str()), i);
+		++mStats.mMisses;
+		return 0;
 	}
 
+	vector<char> binary((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+	GLuint prog = createProgramFromBinary(format, binary.data(), binary.size(), numOutputs);
+	++(prog != 0 ? mStats.mHits : mStats.mMisses);
 	return prog;
 }
 
+void ProgramCache::store(const std::string& key, GLuint prog)
+{
+	GLenum format;
+	vector<char> binary;
+	if(!getProgramBinary(prog, format, binary)) { return; }
+
+	// other threads and apps sharing the directory may store the same key
+	string filename = path(key);
+	string tempFilename;
+	if(!createTempFile(filename, tempFilename)) { return; }
+	{
+		ofstream output(tempFilename.c_str(), ios::out | ios::binary);
+		output.write((const char*)&format, sizeof(format));
+		output.write(binary.data(), binary.size());
+		if(!output.good())
+		{
+			output.close();
+			std::remove(tempFilename.c_str());
+			return;
+		}
+	}
+	replaceFile(tempFilename, filename);
+}
+
+const ProgramCacheStats& ProgramCache::getStats() const
+{
+	return mStats;
+}
+
 }
@@ -3,12 +3,74 @@
 
 #include <GL/gl.h>
 #include <iosfwd>
+#include <string>
+#include <vector>
 
 namespace grainr
 {
 
 GLuint createShader(GLenum shaderType, const char* source, std::ostream& err);
-GLuint createProgram(GLuint vsh, GLuint fsh, size_t numOutputs, std::ostream& err);
+// prelude is an extra fragment shader holding functions called by fsh, 0 if
+// there is none. Without fsh, the outputs of vsh are captured by transform
+// feedback, interleaved, unless vsh is a compute shader.
+GLuint createProgram(GLuint vsh, GLuint fsh, GLuint prelude, size_t numOutputs, std::ostream& err);
+
+// The same steps split so that the driver can compile and link in the
+// background (GL_KHR_parallel_shader_compile). Compilation and link status
+// are only queried by the check/finish functions, which block until the
+// driver is done. A failed program is deleted by finishProgram, a failed
+// shader is left to the caller.
+GLuint compileShader(GLenum shaderType, const char* source);
+bool checkShader(GLuint shader, std::ostream& err);
+GLuint startProgram(GLuint vsh, GLuint fsh, GLuint prelude, size_t numOutputs);
+GLuint finishProgram(GLuint prog, size_t numOutputs, std::ostream& err);
+// Never blocks, always true without GL_KHR_parallel_shader_compile
+bool isProgramComplete(GLuint prog);
+GLuint createComputeProgram(GLuint csh, std::ostream& err);
+// Vertex attribute of each stream of particles in a buffer. They are the last
+// ones so that renderers keep the low locations for their own attributes.
+GLuint streamLocation(size_t stream, size_t numStreams);
+
+// Program binaries are only valid for the driver which produced them, a
+// failure to load one is silent so that the caller can link from source
+GLuint createProgramFromBinary(GLenum format, const void* binary, GLsizei length, size_t numOutputs);
+bool getProgramBinary(GLuint prog, GLenum& format, std::vector<char>& binary);
+std::string getShaderSource(GLuint shader);
+
+struct ProgramCacheStats
+{
+	size_t mHits;
+	size_t mMisses;
+};
+
+// Directory of program binaries named after a hash of everything which went
+// into the program: sources, outputs and the driver
+class ProgramCache
+{
+public:
+	ProgramCache();
+
+	void setDirectory(const char* directory);
+	bool isEnabled() const;
+	std::string makeKey(
+		const std::string& driver,
+		const std::string& vshSource,
+		const std::string& fshSource,
+		const std::string& preludeSource,
+		size_t numOutputs
+	) const;
+	bool contains(const std::string& key) const;
+	// Returns 0 on a miss
+	GLuint load(const std::string& key, size_t numOutputs);
+	void store(const std::string& key, GLuint prog);
+	const ProgramCacheStats& getStats() const;
+
+private:
+	std::string path(const std::string& key) const;
+
+	std::string mDirectory;
+	ProgramCacheStats mStats;
+};
 
 }
 
@@ -1,25 +1,141 @@
 #include <GL/glew.h>
 #include "SystemDefinition.hpp"
 #include "ParticleSystem.hpp"
+#include "Context.hpp"
+#include "Shader.hpp"
+#include "BinaryFormat.hpp"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+using namespace std;
 
 namespace grainr
 {
 
+namespace
+{
+
+class StringTable
+{
+public:
+	BinaryWord add(const string& str)
+	{
+		map<string, BinaryWord>::const_iterator itr = mOffsets.find(str);
+		if(itr != mOffsets.end()) { return itr->second; }
+
+		BinaryWord offset = mData.size();
+		mData.insert(mData.end(), str.begin(), str.end());
+		mData.push_back('\0');
+		mOffsets.insert(make_pair(str, offset));
+		return offset;
+	}
+
+	const vector<char>& data() const { return mData; }
+
+private:
+	vector<char> mData;
+	map<string, BinaryWord> mOffsets;
+};
+
+const char gPreludeSection[] = "prelude";
+
+bool endsWith(const string& str, const char* suffix)
+{
+	size_t length = strlen(suffix);
+	return str.size() >= length && str.compare(str.size() - length, length, suffix) == 0;
+}
+
+// Renderers of every backend end with a vertex shader
+GLenum sectionShaderType(const string& name)
+{
+	if(endsWith(name, ".vsh") || endsWith(name, ".feedback") || endsWith(name, ".vsh.compute"))
+	{
+		return GL_VERTEX_SHADER;
+	}
+	return endsWith(name, ".compute") ? GL_COMPUTE_SHADER : GL_FRAGMENT_SHADER;
+}
+
+// Variants of other backends are named after the fragment one with a suffix
+Backend::Enum programBackend(const string& name)
+{
+	if(endsWith(name, ".feedback")) { return Backend::TransformFeedback; }
+	return endsWith(name, ".compute") ? Backend::Compute : Backend::Fragment;
+}
+
+BinaryWord align(BinaryWord offset)
+{
+	return (offset + 3) & ~3u;
+}
+
+template<typename T>
+BinaryTable place(BinaryWord& offset, size_t count)
+{
+	BinaryTable table;
+	table.mOffset = offset;
+	table.mCount = count;
+	offset = align(offset + count * sizeof(T));
+	return table;
+}
+
+template<typename T>
+void writeTable(ostream& output, const vector<T>& items)
+{
+	if(items.empty()) { return; }
+	output.write((const char*)items.data(), items.size() * sizeof(T));
+}
+
+void pad(ostream& output)
+{
+	const char zeros[4] = { 0, 0, 0, 0 };
+	output.write(zeros, align(output.tellp()) - output.tellp());
+}
+
+}
+
 SystemDefinition::SystemDefinition()
+	:mNumTextures(0)
+	,mDrawBuffers(0)
+	,mLinkingBackends(0)
+	,mAtlas(false)
+	,mStorageLayout(StorageLayout::Interleaved)
 {
 }
 
 SystemDefinition::~SystemDefinition()
 {
+	for(std::map<std::string, GLuint>::const_iterator itr = mPendingPrograms.begin(); itr != mPendingPrograms.end(); ++ itr)
+	{
+		glDeleteProgram(itr->second);
+	}
+
 	for(std::map<std::string, GLuint>::const_iterator itr = mShaders.begin(); itr != mShaders.end(); ++ itr)
 	{
 		glDeleteShader(itr->second);
 	}
 }
 
-ParticleSystem* SystemDefinition::create(size_t width, size_t height) const
+ParticleSystem* SystemDefinition::create(size_t width, size_t height, Backend::Enum backend) const
 {
-	return new ParticleSystem(this, width, height);
+	// particles are instanced attributes of renderers
+	if(backend == Backend::TransformFeedback && !GLEW_VERSION_3_3 && !GLEW_ARB_instanced_arrays)
+	{
+		return NULL;
+	}
+
+	if(backend == Backend::Compute && (!GLEW_ARB_compute_shader || !GLEW_ARB_shader_storage_buffer_object))
+	{
+		return NULL;
+	}
+
+	// the programs of a definition loaded with loadAsync start linking with
+	// the first system of their backend
+	if(mLinkingBackends != 0)
+	{
+		startLinking(backend);
+	}
+
+	return new ParticleSystem(this, width, height, backend);
 }
 
 void SystemDefinition::destroy()
@@ -27,4 +143,408 @@ void SystemDefinition::destroy()
 	delete this;
 }
 
+bool SystemDefinition::hasSection(const string& name) const
+{
+	return mSources.find(name) != mSources.end();
+}
+
+GLuint SystemDefinition::findShader(const string& name, ostream& err) const
+{
+	// shaders compiled in the background are checked on first use
+	map<string, GLuint>::iterator shaderItr = mShaders.find(name);
+	if(shaderItr != mShaders.end())
+	{
+		GLuint shader = shaderItr->second;
+		if(checkShader(shader, err)) { return shader; }
+
+		glDeleteShader(shader);
+		mShaders.erase(shaderItr);
+		return 0;
+	}
+
+	map<string, string>::const_iterator sourceItr = mSources.find(name);
+	if(sourceItr == mSources.end()) { return 0; }
+
+	GLuint shader = createShader(sectionShaderType(name), sourceItr->second.c_str(), err);
+	if(shader != 0)
+	{
+		mShaders.insert(make_pair(name, shader));
+	}
+	return shader;
+}
+
+bool SystemDefinition::usesPrelude(const string& vshName) const
+{
+	// render programs have a vertex shader section, modifiers don't
+	return vshName.empty() && hasSection(gPreludeSection);
+}
+
+bool SystemDefinition::findPrelude(const string& vshName, GLuint& prelude, ostream& err) const
+{
+	prelude = 0;
+	if(!usesPrelude(vshName)) { return true; }
+
+	prelude = findShader(gPreludeSection, err);
+	return prelude != 0;
+}
+
+GLuint SystemDefinition::linkProgram(const string& name, ostream& err) const
+{
+	GLuint vsh;
+	string vshName;
+	string fshName;
+	if(!findProgramShaders(name, vsh, vshName, fshName))
+	{
+		err << "Cannot find the shaders of '" << name << "'" << endl;
+		return 0;
+	}
+
+	// started by Context::loadAsync
+	map<string, GLuint>::iterator pendingItr = mPendingPrograms.find(name);
+	if(pendingItr != mPendingPrograms.end())
+	{
+		GLuint prog = pendingItr->second;
+		mPendingPrograms.erase(pendingItr);
+
+		// report compile errors rather than the link error they cause
+		GLuint prelude;
+		if((!vshName.empty() && findShader(vshName, err) == 0)
+		|| (!fshName.empty() && findShader(fshName, err) == 0)
+		|| !findPrelude(vshName, prelude, err))
+		{
+			glDeleteProgram(prog);
+			return 0;
+		}
+
+		prog = finishProgram(prog, mNumTextures, err);
+		if(prog != 0) { storeProgram(name, vsh, vshName, fshName, prog); }
+		return prog;
+	}
+
+	map<string, ProgramBinary>::iterator binItr = mProgramBinaries.find(name);
+	if(binItr != mProgramBinaries.end())
+	{
+		const ProgramBinary& binary = binItr->second;
+		GLuint prog = createProgramFromBinary(binary.mFormat, binary.mData.data(), binary.mData.size(), mNumTextures);
+		if(prog != 0) { return prog; }
+
+		// rejected by the driver, it is replaced after linking
+		mProgramBinaries.erase(binItr);
+	}
+
+	ProgramCache& cache = mContext->mProgramCache;
+	if(cache.isEnabled())
+	{
+		GLuint prog = cache.load(cacheKey(vsh, vshName, fshName), mNumTextures);
+		if(prog != 0)
+		{
+			keepBinary(name, prog);
+			return prog;
+		}
+	}
+
+	if(!vshName.empty())
+	{
+		vsh = findShader(vshName, err);
+		if(vsh == 0) { return 0; }
+	}
+	GLuint fsh = 0;
+	if(!fshName.empty())
+	{
+		fsh = findShader(fshName, err);
+		if(fsh == 0) { return 0; }
+	}
+
+	GLuint prelude;
+	if(!findPrelude(vshName, prelude, err)) { return 0; }
+
+	GLuint prog = createProgram(vsh, fsh, prelude, mNumTextures, err);
+	if(prog != 0) { storeProgram(name, vsh, vshName, fshName, prog); }
+
+	return prog;
+}
+
+string SystemDefinition::cacheKey(GLuint vsh, const string& vshName, const string& fshName) const
+{
+	string vshSource = vshName.empty() ? getShaderSource(vsh) : mSources.find(vshName)->second;
+	string fshSource = fshName.empty() ? string() : mSources.find(fshName)->second;
+	string preludeSource = usesPrelude(vshName) ? mSources.find(gPreludeSection)->second : string();
+	return mContext->mProgramCache.makeKey(
+		mContext->mDriver,
+		vshSource,
+		fshSource,
+		preludeSource,
+		mNumTextures
+	);
+}
+
+void SystemDefinition::storeProgram(
+	const string& name,
+	GLuint vsh,
+	const string& vshName,
+	const string& fshName,
+	GLuint prog
+) const
+{
+	keepBinary(name, prog);
+
+	ProgramCache& cache = mContext->mProgramCache;
+	if(cache.isEnabled())
+	{
+		cache.store(cacheKey(vsh, vshName, fshName), prog);
+	}
+}
+
+void SystemDefinition::keepBinary(const string& name, GLuint prog) const
+{
+	ProgramBinary binary;
+	if(getProgramBinary(prog, binary.mFormat, binary.mData))
+	{
+		mProgramBinaries[name] = binary;
+	}
+}
+
+bool SystemDefinition::findProgramShaders(
+	const string& name,
+	GLuint& vsh,
+	string& vshName,
+	string& fshName
+) const
+{
+	vsh = 0;
+	vshName.clear();
+	fshName.clear();
+
+	string::size_type dotPos = name.find('.');
+	if(dotPos == string::npos) { return false; }
+
+	string ext = name.substr(dotPos + 1);
+	if(ext == "emitter" || ext == "affector" || ext == "pipeline")
+	{
+		vsh = mContext->mQuadVsh;
+		fshName = name;
+	}
+	else if(ext == "emitter.exact")
+	{
+		vsh = mContext->mEmitVsh;
+		fshName = name;
+	}
+	else if(ext == "fsh")
+	{
+		vshName = name.substr(0, dotPos) + ".vsh";
+		fshName = name;
+	}
+	else if(ext == "emitter.feedback" || ext == "affector.feedback" || ext == "pipeline.feedback"
+	|| ext == "emitter.compute" || ext == "emitter.exact.compute" || ext == "affector.compute" || ext == "pipeline.compute")
+	{
+		vshName = name;
+	}
+	else if(ext == "vsh.feedback" || ext == "vsh.compute")
+	{
+		vshName = name;
+		fshName = name.substr(0, dotPos) + ".fsh";
+	}
+	else
+	{
+		return false;
+	}
+
+	return hasSection(name)
+		&& (vshName.empty() || hasSection(vshName))
+		&& (fshName.empty() || hasSection(fshName));
+}
+
+void SystemDefinition::startLinking(Backend::Enum backend) const
+{
+	unsigned int backendBit = 1u << backend;
+	if((mLinkingBackends & backendBit) != 0) { return; }
+	mLinkingBackends |= backendBit;
+
+	// programs which will be loaded from a binary need no link
+	vector<string> programs;
+	for(map<string, string>::const_iterator itr = mSources.begin(); itr != mSources.end(); ++itr)
+	{
+		GLuint vsh;
+		string vshName;
+		string fshName;
+		if(programBackend(itr->first) != backend) { continue; }
+		if(!findProgramShaders(itr->first, vsh, vshName, fshName)) { continue; }
+		if(mProgramBinaries.find(itr->first) != mProgramBinaries.end()) { continue; }
+		if(mContext->mProgramCache.isEnabled()
+		&& mContext->mProgramCache.contains(cacheKey(vsh, vshName, fshName)))
+		{
+			continue;
+		}
+
+		programs.push_back(itr->first);
+	}
+
+	// every shader is handed to the driver before the first link so that
+	// they can all compile in parallel
+	for(vector<string>::const_iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		GLuint vsh;
+		string vshName;
+		string fshName;
+		findProgramShaders(*itr, vsh, vshName, fshName);
+		string preludeName = usesPrelude(vshName) ? gPreludeSection : "";
+
+		const string* names[] = { &vshName, &fshName, &preludeName };
+		for(size_t i = 0; i < 3; ++i)
+		{
+			const string& name = *names[i];
+			if(name.empty() || mShaders.find(name) != mShaders.end()) { continue; }
+
+			mShaders.insert(make_pair(name, compileShader(sectionShaderType(name), mSources.find(name)->second.c_str())));
+		}
+	}
+
+	for(vector<string>::const_iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		GLuint vsh;
+		string vshName;
+		string fshName;
+		findProgramShaders(*itr, vsh, vshName, fshName);
+		if(!vshName.empty()) { vsh = mShaders.find(vshName)->second; }
+		GLuint fsh = fshName.empty() ? 0 : mShaders.find(fshName)->second;
+		GLuint prelude = usesPrelude(vshName) ? mShaders.find(gPreludeSection)->second : 0;
+
+		mPendingPrograms[*itr] = startProgram(vsh, fsh, prelude, mNumTextures);
+	}
+}
+
+bool SystemDefinition::isReady() const
+{
+	for(map<string, GLuint>::const_iterator itr = mPendingPrograms.begin(); itr != mPendingPrograms.end(); ++itr)
+	{
+		if(!isProgramComplete(itr->second)) { return false; }
+	}
+
+	return true;
+}
+
+bool SystemDefinition::save(const char* filename, ostream& err) const
+{
+	StringTable strings;
+	BinaryHeader header;
+	memcpy(header.mMagic, gBinaryMagic, sizeof(header.mMagic));
+	header.mVersion = gBinaryVersion;
+	header.mNumTextures = mNumTextures;
+	header.mDrawBuffers = mDrawBuffers;
+	header.mFlags = (mAtlas ? BinaryFlag::Atlas : 0)
+		| (mStorageLayout == StorageLayout::Streams ? BinaryFlag::StorageStreams : 0);
+	header.mDriver = strings.add(mContext->mDriver);
+
+	vector<BinaryWord> textureFormats(mTextureFormats.begin(), mTextureFormats.end());
+
+	vector<BinaryAttribute> attributes;
+	for(map<string, AttributeLayout>::const_iterator itr = mAttributes.begin(); itr != mAttributes.end(); ++itr)
+	{
+		BinaryAttribute attribute;
+		attribute.mName = strings.add(itr->first);
+		attribute.mSlot = itr->second.mSlot;
+		attribute.mSize = itr->second.mSize;
+		attributes.push_back(attribute);
+	}
+
+	typedef map<string, RegionParamLayout> RegionParams;
+	vector<BinaryParam> params;
+	for(map<string, RegionParams>::const_iterator sectionItr = mRegionParams.begin()
+	;   sectionItr != mRegionParams.end()
+	;   ++sectionItr)
+	{
+		for(RegionParams::const_iterator itr = sectionItr->second.begin(); itr != sectionItr->second.end(); ++itr)
+		{
+			BinaryParam param;
+			param.mSection = strings.add(sectionItr->first);
+			param.mName = strings.add(itr->first);
+			param.mSlot = itr->second.mSlot;
+			param.mSize = itr->second.mSize;
+			params.push_back(param);
+		}
+	}
+
+	vector<BinaryAccess> access;
+	for(map<string, SectionAccess>::const_iterator itr = mAccess.begin(); itr != mAccess.end(); ++itr)
+	{
+		BinaryAccess entry;
+		entry.mSection = strings.add(itr->first);
+		entry.mFetchMask = itr->second.mFetchMask;
+		entry.mWriteMask = itr->second.mWriteMask;
+		access.push_back(entry);
+	}
+
+	vector<BinarySection> sections;
+	for(map<string, string>::const_iterator itr = mSources.begin(); itr != mSources.end(); ++itr)
+	{
+		BinarySection section;
+		section.mName = strings.add(itr->first);
+		section.mSource = strings.add(itr->second);
+		sections.push_back(section);
+	}
+
+	vector<BinaryProgram> programs;
+	BinaryWord blobSize = 0;
+	for(map<string, ProgramBinary>::const_iterator itr = mProgramBinaries.begin(); itr != mProgramBinaries.end(); ++itr)
+	{
+		BinaryProgram program;
+		program.mSection = strings.add(itr->first);
+		program.mFormat = itr->second.mFormat;
+		program.mOffset = blobSize; // relocated below
+		program.mLength = itr->second.mData.size();
+		programs.push_back(program);
+		blobSize = align(blobSize + program.mLength);
+	}
+
+	BinaryWord offset = align(sizeof(BinaryHeader));
+	header.mTextureFormats = place<BinaryWord>(offset, textureFormats.size());
+	header.mAttributes = place<BinaryAttribute>(offset, attributes.size());
+	header.mParams = place<BinaryParam>(offset, params.size());
+	header.mAccess = place<BinaryAccess>(offset, access.size());
+	header.mSections = place<BinarySection>(offset, sections.size());
+	header.mPrograms = place<BinaryProgram>(offset, programs.size());
+	header.mStrings = place<char>(offset, strings.data().size());
+	for(vector<BinaryProgram>::iterator itr = programs.begin(); itr != programs.end(); ++itr)
+	{
+		itr->mOffset += offset;
+	}
+
+	ofstream output(filename, ios::out | ios::binary);
+	if(!output.good())
+	{
+		err << "Can't open '" << filename << "' for writing" << endl;
+		return false;
+	}
+
+	output.write((const char*)&header, sizeof(header));
+	pad(output);
+	writeTable(output, textureFormats);
+	pad(output);
+	writeTable(output, attributes);
+	pad(output);
+	writeTable(output, params);
+	pad(output);
+	writeTable(output, access);
+	pad(output);
+	writeTable(output, sections);
+	pad(output);
+	writeTable(output, programs);
+	pad(output);
+	writeTable(output, strings.data());
+	pad(output);
+	for(map<string, ProgramBinary>::const_iterator itr = mProgramBinaries.begin(); itr != mProgramBinaries.end(); ++itr)
+	{
+		writeTable(output, itr->second.mData);
+		pad(output);
+	}
+
+	if(!output.good())
+	{
+		err << "Can't write to '" << filename << "'" << endl;
+		return false;
+	}
+
+	return true;
+}
+
 }
@@ -2,8 +2,10 @@
 #define GRAINR_SYSTEM_DEFINITION_HPP
 
 #include <GL/gl.h>
+#include <iosfwd>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace grainr
 {
@@ -12,20 +14,113 @@ class ParticleSystem;
 class Context;
 class Program;
 
+struct AttributeLayout
+{
+	size_t mSlot; // index of the first float, texture = slot / 4, component = slot % 4
+	size_t mSize;
+};
+
+// Location of a param in the per region buffer of an atlas (grainc -a)
+struct RegionParamLayout
+{
+	size_t mSlot; // texel in the region's row
+	size_t mSize;
+};
+
+// Textures read and written by a modifier program, bit i is texture i.
+// Textures it doesn't write are carried over to the next pass.
+struct SectionAccess
+{
+	GLbitfield mFetchMask;
+	GLbitfield mWriteMask;
+};
+
+// Where particles are stored and how modifiers update them
+namespace Backend
+{
+	enum Enum
+	{
+		Fragment,          // a texture per 4 floats, each pass draws a quad over them
+		TransformFeedback, // vertex buffers of interleaved particles (grainc -f)
+		Compute            // a storage buffer updated in place by kernels (grainc -c)
+	};
+}
+
+// Order of the floats in the storage buffer of the compute backend, the
+// floats of a particle are laid out like its texels
+namespace StorageLayout
+{
+	enum Enum
+	{
+		Interleaved, // AoS, the floats of a particle are contiguous
+		Streams      // SoA, a stream per float (grainc -s)
+	};
+}
+
+struct ProgramBinary
+{
+	GLenum mFormat;
+	std::vector<char> mData;
+};
+
 class SystemDefinition
 {
 	friend class Context;
 	friend class ParticleSystem;
 	friend class Program;
+	friend class Emitter;
 public:
-	ParticleSystem* create(size_t width, size_t height) const;
+	// Returns NULL if the driver doesn't support the backend
+	ParticleSystem* create(size_t width, size_t height, Backend::Enum backend = Backend::Fragment) const;
+	// Writes a binary definition which Context::load reads without parsing.
+	// It also carries the binaries of the programs created so far so that
+	// they are not linked again with the same driver.
+	bool save(const char* filename, std::ostream& err) const;
+	// Whether the programs started by Context::loadAsync, and by create for
+	// other backends, are linked. Never blocks. Creating a program before
+	// that is allowed but may stall.
+	bool isReady() const;
 	void destroy();
 private:
 	SystemDefinition();
 	~SystemDefinition();
 
+	bool hasSection(const std::string& name) const;
+	GLuint findShader(const std::string& name, std::ostream& err) const;
+	// Unoptimized modifiers call functions of a shared prelude section
+	// which is compiled once. prelude is 0 for other programs.
+	bool usesPrelude(const std::string& vshName) const;
+	bool findPrelude(const std::string& vshName, GLuint& prelude, std::ostream& err) const;
+	// Programs are named after their fragment shader, or their vertex shader
+	// for the transform feedback backend, or their kernel for the compute one
+	GLuint linkProgram(const std::string& name, std::ostream& err) const;
+	std::string cacheKey(GLuint vsh, const std::string& vshName, const std::string& fshName) const;
+	// Keeps the binary of a program linked from source for save and the cache
+	void storeProgram(const std::string& name, GLuint vsh, const std::string& vshName, const std::string& fshName, GLuint prog) const;
+	void keepBinary(const std::string& name, GLuint prog) const;
+	// vsh is one of the context's shaders when vshName is empty, fshName is
+	// empty for transform feedback programs and compute kernels, which take
+	// the place of vsh
+	bool findProgramShaders(const std::string& name, GLuint& vsh, std::string& vshName, std::string& fshName) const;
+	// Starts the programs of a backend, only once per backend
+	void startLinking(Backend::Enum backend) const;
+
 	size_t mNumTextures;
-	std::map<std::string, GLuint> mShaders;
+	// Most textures written by a fragment pass (grainc -b), modifiers which
+	// write more run a pass per group of them
+	size_t mDrawBuffers;
+	std::vector<GLenum> mTextureFormats;
+	std::map<std::string, AttributeLayout> mAttributes;
+	std::map<std::string, std::string> mSources;
+	// shaders are compiled on first use
+	mutable std::map<std::string, GLuint> mShaders;
+	mutable std::map<std::string, ProgramBinary> mProgramBinaries;
+	mutable std::map<std::string, GLuint> mPendingPrograms;
+	mutable unsigned int mLinkingBackends; // a bit per Backend::Enum
+	bool mAtlas;
+	StorageLayout::Enum mStorageLayout;
+	std::map<std::string, std::map<std::string, RegionParamLayout> > mRegionParams;
+	std::map<std::string, SectionAccess> mAccess;
 	const Context* mContext;
 };
 